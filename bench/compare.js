@@ -0,0 +1,63 @@
+
+var fs = require("fs")
+
+if (process.argv.length < 4) {
+	console.log("usage: node compare <base.json> <head.json> [threshold]")
+	console.log("")
+	console.log("Exits with a non-zero status if any case in head is slower than")
+	console.log("the same case in base by more than threshold, default 0.1 (10%)")
+	process.exit(-1)
+}
+
+var threshold = parseFloat(process.argv[4] || "0.1")
+
+function load(filename) {
+	var records = {}
+
+	fs.readFileSync(filename, "utf8").split("\n").forEach(function(line) {
+		if (! line.length)
+			return
+
+		var record = JSON.parse(line)
+		if (record.name == "meta")
+			return
+
+		var key = [record.name, record.ruleset, record.threads || "-"].join(" ")
+		records[key] = record
+	})
+
+	return records
+}
+
+// Higher is better for scan throughput, lower is better for configure time
+// and for the latency of small scans in the scan-mixed case
+function score(record) {
+	if (record.name == "configure")
+		return 1 / record.seconds
+	else if (record.name == "scan-mixed")
+		return 1 / record.smallP99Ms
+	else
+		return record.scansPerSec
+}
+
+var base = load(process.argv[2])
+var head = load(process.argv[3])
+
+var regressions = 0
+
+Object.keys(head).sort().forEach(function(key) {
+	if (! base[key])
+		return
+
+	var change = (score(head[key]) / score(base[key])) - 1
+	var regressed = change < -threshold
+
+	if (regressed)
+		regressions++
+
+	console.log("%s %s%s%%%s", (key + "                                        ").substr(0, 40),
+			change >= 0 ? "+" : "", (change * 100).toFixed(1),
+			regressed ? "  REGRESSION" : "")
+})
+
+process.exit(regressions ? 1 : 0)
@@ -0,0 +1,178 @@
+
+var fs = require("fs")
+var path = require("path")
+
+// Strings planted into samples, the rulesets generated by rulesets.js look
+// for these so that the density of matches is controlled by the corpus
+var PLANTED = []
+for (var i = 0; i < 64; i++)
+	PLANTED.push("planted-marker-" + i + "-x")
+
+// A small seeded PRNG (mulberry32), the same seed always produces the same
+// corpus, so results can be compared between commits
+function Random(seed) {
+	this.state = (seed >>> 0) || 1
+}
+
+Random.prototype.next = function() {
+	var t = this.state = (this.state + 0x6d2b79f5) >>> 0
+	t = Math.imul(t ^ (t >>> 15), t | 1)
+	t ^= t + Math.imul(t ^ (t >>> 7), t | 61)
+	return ((t ^ (t >>> 14)) >>> 0) / 4294967296
+}
+
+Random.prototype.int = function(max) {
+	return Math.floor(this.next() * max)
+}
+
+Random.prototype.fill = function(buffer, start, end) {
+	for (var i = start; i < end; i++)
+		buffer[i] = this.int(256)
+}
+
+function randomSample(rng, size) {
+	var buffer = Buffer.alloc(size)
+	rng.fill(buffer, 0, size)
+	return buffer
+}
+
+function peSample(rng, size) {
+	var buffer = randomSample(rng, Math.max(size, 512))
+
+	buffer.fill(0, 0, 0x100)
+
+	// DOS header, e_lfanew pointing at the PE header
+	buffer.write("MZ", 0, "latin1")
+	buffer.writeUInt32LE(0x80, 0x3c)
+	buffer.write("This program cannot be run in DOS mode.", 0x4e, "latin1")
+
+	// PE header, i386, a few sections, and an optional header
+	buffer.write("PE\0\0", 0x80, "latin1")
+	buffer.writeUInt16LE(0x14c, 0x84)
+	buffer.writeUInt16LE(3, 0x86)
+	buffer.writeUInt16LE(0xe0, 0x94)
+	buffer.writeUInt16LE(0x10b, 0x98)
+
+	var names = [".text\0\0\0", ".rdata\0\0", ".data\0\0\0"]
+	for (var i = 0; i < names.length; i++)
+		buffer.write(names[i], 0x178 + (i * 40), "latin1")
+
+	return buffer
+}
+
+var WORDS = ["sshd", "cron", "kernel", "systemd", "nginx", "Accepted",
+		"password", "publickey", "session", "opened", "closed", "for", "user",
+		"root", "from", "port", "error", "warning", "connection", "reset"]
+
+function textSample(rng, size) {
+	var lines = []
+	var length = 0
+
+	while (length < size) {
+		var words = []
+		for (var i = 0; i < 6 + rng.int(8); i++)
+			words.push(WORDS[rng.int(WORDS.length)])
+
+		var line = "2019-06-11T" + (10 + rng.int(10)) + ":" + (10 + rng.int(50))
+				+ ":" + (10 + rng.int(50)) + " host" + rng.int(100) + " "
+				+ words.join(" ") + " 10." + rng.int(256) + "." + rng.int(256)
+				+ "." + rng.int(256) + "\n"
+
+		lines.push(line)
+		length += line.length
+	}
+
+	return Buffer.from(lines.join("").substr(0, size), "latin1")
+}
+
+var GENERATORS = {
+	random: randomSample,
+	pe: peSample,
+	text: textSample
+}
+
+// Overwrite bytes of buffer with planted strings, on average one every
+// density bytes, a density of 0 plants nothing
+function plant(rng, buffer, density) {
+	if (! density)
+		return 0
+
+	var count = Math.floor(buffer.length / density)
+	for (var i = 0; i < count; i++) {
+		var marker = PLANTED[rng.int(PLANTED.length)]
+		var offset = rng.int(Math.max(buffer.length - marker.length, 1))
+		buffer.write(marker, offset, "latin1")
+	}
+
+	return count
+}
+
+/**
+ ** Generate an array of samples, each an object with name, kind and buffer
+ ** attributes.  Options:
+ **
+ **   seed    - PRNG seed, defaults to 1
+ **   count   - number of samples, defaults to 16
+ **   size    - size of each sample in bytes, defaults to 64KiB
+ **   kinds   - array of sample kinds (random, pe, text) used in turn
+ **   density - plant a marker on average every density bytes, 0 for none
+ **/
+function generate(options) {
+	options = options || {}
+
+	var rng = new Random(options.seed || 1)
+	var count = options.count || 16
+	var size = options.size || 65536
+	var kinds = options.kinds || Object.keys(GENERATORS)
+	var density = options.density || 0
+
+	var samples = []
+
+	for (var i = 0; i < count; i++) {
+		var kind = kinds[i % kinds.length]
+		var buffer = GENERATORS[kind](rng, size)
+
+		plant(rng, buffer, density)
+
+		samples.push({
+			name: "sample-" + i + "." + kind,
+			kind: kind,
+			buffer: buffer
+		})
+	}
+
+	return samples
+}
+
+function write(dir, samples) {
+	if (! fs.existsSync(dir))
+		fs.mkdirSync(dir, {recursive: true})
+
+	samples.forEach(function(sample) {
+		sample.filename = path.join(dir, sample.name)
+		fs.writeFileSync(sample.filename, sample.buffer)
+	})
+
+	return samples
+}
+
+exports.PLANTED = PLANTED
+exports.Random = Random
+exports.generate = generate
+exports.write = write
+
+if (require.main === module) {
+	if (process.argv.length < 3) {
+		console.log("usage: node corpus <dir> [count] [size] [density] [seed]")
+		process.exit(-1)
+	}
+
+	var samples = generate({
+		count: parseInt(process.argv[3]) || 16,
+		size: parseInt(process.argv[4]) || 65536,
+		density: parseInt(process.argv[5]) || 0,
+		seed: parseInt(process.argv[6]) || 1
+	})
+
+	write(process.argv[2], samples)
+}
@@ -0,0 +1,124 @@
+
+var corpus = require("./corpus")
+
+function hex(rng, count) {
+	var bytes = []
+	for (var i = 0; i < count; i++)
+		bytes.push(("0" + rng.int(256).toString(16)).substr(-2).toUpperCase())
+	return bytes.join(" ")
+}
+
+function token(rng) {
+	var chars = "abcdefghijklmnopqrstuvwxyz0123456789"
+	var str = ""
+	for (var i = 0; i < 12; i++)
+		str += chars[rng.int(chars.length)]
+	return str
+}
+
+// Each generator returns the source of one rule, rules which reference
+// corpus.PLANTED match in proportion to the density of the corpus
+
+function stringRule(rng, index) {
+	return [
+		"rule strings_" + index + " {",
+		"strings:",
+		"	$a = \"" + token(rng) + "\"",
+		"	$b = \"" + token(rng) + "\" wide",
+		"	$c = \"" + corpus.PLANTED[index % corpus.PLANTED.length] + "\"",
+		"condition:",
+		"	any of them",
+		"}"
+	].join("\n")
+}
+
+function regexRule(rng, index) {
+	return [
+		"rule regex_" + index + " {",
+		"strings:",
+		"	$a = /" + token(rng).substr(0, 4) + "[0-9a-f]{4,8}" + token(rng).substr(0, 3) + "/",
+		"	$b = /planted-marker-" + (index % corpus.PLANTED.length) + "-[a-z]/",
+		"	$c = /host[0-9]{1,2} (sshd|cron) " + token(rng).substr(0, 5) + "/ nocase",
+		"condition:",
+		"	any of them",
+		"}"
+	].join("\n")
+}
+
+function hexRule(rng, index) {
+	return [
+		"rule hex_" + index + " {",
+		"strings:",
+		"	$a = { " + hex(rng, 3) + " [2-8] " + hex(rng, 2) + " ?? " + hex(rng, 2) + " }",
+		"	$b = { 4D 5A [0-64] " + hex(rng, 2) + " [4-16] 50 45 00 00 }",
+		"	$c = { " + hex(rng, 2) + " ( " + hex(rng, 2) + " | " + hex(rng, 2) + " ) [1-4] " + hex(rng, 3) + " }",
+		"condition:",
+		"	any of them",
+		"}"
+	].join("\n")
+}
+
+function conditionRule(rng, index) {
+	return [
+		"rule condition_" + index + " {",
+		"strings:",
+		"	$a = \"" + corpus.PLANTED[index % corpus.PLANTED.length] + "\"",
+		"	$b = \"" + token(rng) + "\"",
+		"condition:",
+		"	(uint16(0) == 0x5A4D and uint32(uint32(0x3C)) == 0x00004550) or",
+		"	(filesize > " + rng.int(4096) + " and #a > " + rng.int(3) + ") or",
+		"	(for any i in (1..#a) : (@a[i] % " + (2 + rng.int(7)) + " == 0) and not $b)",
+		"}"
+	].join("\n")
+}
+
+// Matches almost every sample many times over, for result heavy scans
+function heavyRule(rng, index) {
+	return [
+		"rule heavy_" + index + " {",
+		"strings:",
+		"	$a = \"planted-marker-\"",
+		"	$b = { 00 00 }",
+		"condition:",
+		"	any of them",
+		"}"
+	].join("\n")
+}
+
+// Never matches, for result free scans
+function noneRule(rng, index) {
+	return [
+		"rule none_" + index + " {",
+		"strings:",
+		"	$a = \"" + token(rng) + token(rng) + "\"",
+		"condition:",
+		"	$a",
+		"}"
+	].join("\n")
+}
+
+var GENERATORS = {
+	strings: stringRule,
+	regex: regexRule,
+	hex: hexRule,
+	conditions: conditionRule,
+	heavy: heavyRule,
+	none: noneRule
+}
+
+/**
+ ** Generate the source of a ruleset containing count rules of the given kind
+ ** (strings, regex, hex, conditions, heavy or none).
+ **/
+function generate(kind, count, seed) {
+	var rng = new corpus.Random(seed || 1)
+	var rules = []
+
+	for (var i = 0; i < count; i++)
+		rules.push(GENERATORS[kind](rng, i))
+
+	return rules.join("\n\n") + "\n"
+}
+
+exports.KINDS = Object.keys(GENERATORS)
+exports.generate = generate
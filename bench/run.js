@@ -0,0 +1,364 @@
+
+var child_process = require("child_process")
+var fs = require("fs")
+var os = require("os")
+var path = require("path")
+
+var corpus = require("./corpus")
+var rulesets = require("./rulesets")
+var yara = require("../")
+
+function usage() {
+	console.log("usage: node run [options]")
+	console.log("")
+	console.log("  --threads=1,2,4    thread pool sizes to measure scan scaling with")
+	console.log("  --rules=200        number of rules in each generated ruleset")
+	console.log("  --count=64         number of corpus samples")
+	console.log("  --size=65536       size of each corpus sample in bytes")
+	console.log("  --density=16384    plant a match on average every N bytes")
+	console.log("  --iterations=4     times each sample is scanned per case")
+	console.log("  --seed=1           corpus and ruleset seed")
+	console.log("  --output=<file>    write results to file instead of stdout")
+	process.exit(-1)
+}
+
+var options = {
+	threads: [1, 2, 4],
+	rules: 200,
+	count: 64,
+	size: 65536,
+	density: 16384,
+	iterations: 4,
+	seed: 1,
+	output: null,
+	worker: false
+}
+
+process.argv.slice(2).forEach(function(arg) {
+	var match = /^--([a-z]+)(?:=(.*))?$/.exec(arg)
+	if (! match || ! (match[1] in options))
+		usage()
+
+	if (match[1] == "threads")
+		options.threads = match[2].split(",").map(Number)
+	else if (match[1] == "output")
+		options.output = match[2]
+	else if (match[1] == "worker")
+		options.worker = true
+	else
+		options[match[1]] = parseInt(match[2])
+})
+
+// Size, and number of repeats of the corpus, for the scan-tiny case
+var TINY_SIZE = 64
+var TINY_REPEAT = 64
+
+// Size, and number per thread, of the large buffers for the scan-mixed case,
+// each is as large as the scheduler's default large scan size
+var MIXED_LARGE_SIZE = 16 * 1024 * 1024
+var MIXED_LARGE_PER_THREAD = 2
+
+function now() {
+	var time = process.hrtime()
+	return time[0] + (time[1] / 1e9)
+}
+
+function emit(record) {
+	process.stdout.write(JSON.stringify(record) + "\n")
+}
+
+function configure(scanner, source, placement, cb) {
+	var options = {rules: [{string: source}]}
+
+	if (placement) {
+		options.hugePages = true
+		options.numaReplicas = true
+	}
+
+	var start = now()
+	scanner.configure(options, function(error) {
+		cb(error, now() - start)
+	})
+}
+
+// Scan every request iterations times, with at most concurrency scans
+// in flight, and call cb with the elapsed time and number of matches
+function scanAll(scanner, requests, iterations, concurrency, cb) {
+	var queue = []
+	for (var i = 0; i < iterations; i++)
+		queue = queue.concat(requests)
+
+	var pending = 0
+	var matches = 0
+	var failed = false
+	var start = now()
+
+	function next() {
+		while (! failed && pending < concurrency && queue.length) {
+			pending++
+			scanner.scan(queue.shift(), function(error, result) {
+				pending--
+
+				if (error) {
+					failed = true
+					return cb(error)
+				}
+
+				result.rules.forEach(function(rule) {
+					matches += rule.matches.length
+				})
+
+				next()
+			})
+		}
+
+		if (! failed && pending == 0 && queue.length == 0)
+			cb(null, now() - start, matches)
+	}
+
+	next()
+}
+
+// Request every large scan and then every small scan at once, so that with
+// FIFO scheduling the small scans would wait for the large ones, and call cb
+// with the elapsed time and the latencies in seconds of the small scans
+function scanMixed(scanner, large, small, cb) {
+	var pending = large.length + small.length
+	var latencies = []
+	var failed = false
+	var start = now()
+
+	function scanned(error) {
+		if (failed)
+			return
+
+		if (error) {
+			failed = true
+			return cb(error)
+		}
+
+		if (--pending == 0)
+			cb(null, now() - start, latencies)
+	}
+
+	large.forEach(function(req) {
+		scanner.scan(req, scanned)
+	})
+
+	small.forEach(function(req) {
+		var requested = now()
+		scanner.scan(req, function(error) {
+			latencies.push(now() - requested)
+			scanned(error)
+		})
+	})
+}
+
+function percentile(values, p) {
+	var sorted = values.slice().sort(function(a, b) { return a - b })
+	return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))]
+}
+
+// Runs in a child process with UV_THREADPOOL_SIZE set to threads, since the
+// pool size cannot be changed once Node.js has started
+function worker() {
+	var threads = parseInt(process.env.UV_THREADPOOL_SIZE)
+
+	var samples = corpus.generate({
+		seed: options.seed,
+		count: options.count,
+		size: options.size,
+		density: options.density
+	})
+
+	var dir = fs.mkdtempSync(path.join(os.tmpdir(), "yara-bench-"))
+	corpus.write(dir, samples)
+
+	var cases = []
+
+	rulesets.KINDS.forEach(function(kind) {
+		cases.push({ruleset: kind, input: "buffer"})
+	})
+
+	cases.push({ruleset: "strings", input: "file"})
+
+	// Per-scan overhead dominates with tiny inputs, so this case shows how
+	// well scans of a single scanner scale across threads
+	cases.push({ruleset: "none", input: "tiny"})
+
+	// Small scans requested behind large scans, measures how long the small
+	// scans wait for a thread
+	cases.push({ruleset: "strings", input: "mixed"})
+
+	// Rules on huge pages and replicated on each NUMA node, compared with
+	// scan-buffer for the same ruleset this shows the cost of remote memory
+	cases.push({ruleset: "strings", input: "buffer", placed: true})
+
+	var scanner = yara.createScanner()
+
+	function runCase(index) {
+		if (index >= cases.length) {
+			fs.readdirSync(dir).forEach(function(file) {
+				fs.unlinkSync(path.join(dir, file))
+			})
+			fs.rmdirSync(dir)
+			return
+		}
+
+		var item = cases[index]
+		var source = rulesets.generate(item.ruleset, options.rules, options.seed)
+
+		configure(scanner, source, item.placed, function(error, seconds) {
+			if (error)
+				throw error
+
+			if (threads == options.threads[0] && ! item.placed) {
+				emit({
+					name: "configure",
+					ruleset: item.ruleset,
+					rules: options.rules,
+					seconds: seconds
+				})
+			}
+
+			if (item.input == "mixed") {
+				var large = []
+				for (var i = 0; i < threads * MIXED_LARGE_PER_THREAD; i++) {
+					var buffer = Buffer.alloc(MIXED_LARGE_SIZE)
+					samples[i % samples.length].buffer.copy(buffer)
+					large.push({buffer: buffer})
+				}
+
+				var small = samples.map(function(sample) {
+					return {buffer: sample.buffer}
+				})
+
+				scanMixed(scanner, large, small, function(error, seconds, latencies) {
+					if (error)
+						throw error
+
+					var bytes = (large.length * MIXED_LARGE_SIZE) + (small.length * options.size)
+
+					emit({
+						name: "scan-mixed",
+						ruleset: item.ruleset,
+						rules: options.rules,
+						threads: threads,
+						scans: large.length + small.length,
+						bytes: bytes,
+						seconds: seconds,
+						scansPerSec: (large.length + small.length) / seconds,
+						mbPerSec: (bytes / (1024 * 1024)) / seconds,
+						smallP50Ms: percentile(latencies, 0.5) * 1000,
+						smallP99Ms: percentile(latencies, 0.99) * 1000
+					})
+
+					runCase(index + 1)
+				})
+
+				return
+			}
+
+			var requests = samples.map(function(sample) {
+				if (item.input == "file")
+					return {filename: sample.filename}
+				else if (item.input == "tiny")
+					return {buffer: sample.buffer.slice(0, TINY_SIZE)}
+				else
+					return {buffer: sample.buffer}
+			})
+
+			if (item.input == "tiny") {
+				var tiny = []
+				for (var i = 0; i < TINY_REPEAT; i++)
+					tiny = tiny.concat(requests)
+				requests = tiny
+			}
+
+			var caseBytes = requests.reduce(function(total, req) {
+				return total + (req.buffer ? req.buffer.length : options.size)
+			}, 0) * options.iterations
+
+			scanAll(scanner, requests, options.iterations, threads * 2,
+					function(error, seconds, matches) {
+				if (error)
+					throw error
+
+				emit({
+					name: item.placed ? "scan-placed" : "scan-" + item.input,
+					ruleset: item.ruleset,
+					rules: options.rules,
+					threads: threads,
+					scans: requests.length * options.iterations,
+					bytes: caseBytes,
+					matches: matches,
+					seconds: seconds,
+					scansPerSec: (requests.length * options.iterations) / seconds,
+					mbPerSec: (caseBytes / (1024 * 1024)) / seconds
+				})
+
+				runCase(index + 1)
+			})
+		})
+	}
+
+	yara.initialize(function(error) {
+		if (error)
+			throw error
+		runCase(0)
+	})
+}
+
+function main() {
+	var lines = []
+
+	var commit = null
+	try {
+		commit = child_process.execSync("git rev-parse --short HEAD", {
+			cwd: __dirname,
+			stdio: ["ignore", "pipe", "ignore"]
+		}).toString().trim()
+	} catch (error) {}
+
+	lines.push(JSON.stringify({
+		name: "meta",
+		commit: commit,
+		libyara: yara.libyaraVersion(),
+		node: process.version,
+		cpus: os.cpus().length,
+		numaNodes: yara.buildInfo().numaNodes,
+		options: options
+	}))
+
+	options.threads.forEach(function(threads) {
+		var args = [__filename, "--worker"].concat(process.argv.slice(2))
+		var env = Object.assign({}, process.env, {UV_THREADPOOL_SIZE: String(threads)})
+
+		var child = child_process.spawnSync(process.execPath, args, {
+			env: env,
+			stdio: ["ignore", "pipe", "inherit"]
+		})
+
+		if (child.status != 0) {
+			console.error("benchmark with %d threads failed", threads)
+			process.exit(1)
+		}
+
+		child.stdout.toString().split("\n").forEach(function(line) {
+			if (line.length)
+				lines.push(line)
+		})
+	})
+
+	var output = lines.join("\n") + "\n"
+
+	if (options.output)
+		fs.writeFileSync(options.output, output)
+	else
+		process.stdout.write(output)
+}
+
+if (options.worker)
+	worker()
+else
+	main()
@@ -1,8 +1,14 @@
 {
+  "variables": {
+    "yara_static%": "<!(node -p \"process.env.YARA_STATIC ? 'true' : 'false'\")",
+    "yara_march%": "<!(node -p \"process.env.YARA_MARCH || ''\")",
+    "yara_lto%": "<!(node -p \"process.env.YARA_LTO == '0' ? 'false' : 'true'\")"
+  },
   "targets": [
     {
       "target_name": "yara",
       "sources": [
+        "src/sha256.cc",
         "src/yara.cc"
       ],
       "cflags_cc!": [
@@ -13,7 +19,8 @@
         "<!(node -e 'require(\"nan\")')"
       ],
       "libraries": [
-        "-lyara"
+        "-lyara",
+        "-lz"
       ],
       "conditions": [
         [
@@ -23,6 +30,48 @@
               "GCC_ENABLE_CPP_EXCEPTIONS": "YES"
             }
           }
+        ],
+        [
+          "yara_static==\"true\"",
+          {
+            "include_dirs": [
+              "deps/libyara/include"
+            ],
+            "libraries!": [
+              "-lyara"
+            ],
+            "libraries": [
+              "<(module_root_dir)/deps/libyara/lib/libyara.a",
+              "-lcrypto",
+              "-lm"
+            ],
+            "defines": [
+              "YARA_STATIC_BUILD"
+            ]
+          }
+        ],
+        [
+          "yara_static==\"true\" and yara_lto==\"true\"",
+          {
+            "cflags_cc": [
+              "-flto"
+            ],
+            "ldflags": [
+              "-flto",
+              "-O3"
+            ],
+            "defines": [
+              "YARA_LTO_BUILD"
+            ]
+          }
+        ],
+        [
+          "yara_march!=\"\"",
+          {
+            "defines": [
+              "YARA_MARCH=<(yara_march)"
+            ]
+          }
         ]
       ]
     }
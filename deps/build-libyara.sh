@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Builds a pinned version of libyara as a static library, with link time
+# optimisation, and installs it into deps/libyara, from where binding.gyp
+# will link it when the YARA_STATIC environment variable is set:
+#
+#	sh deps/build-libyara.sh
+#	YARA_STATIC=1 npm rebuild yara
+#
+# The following environment variables are used:
+#
+#	YARA_VERSION - Version of libyara to build, defaults to 3.11.0
+#	YARA_SHA256  - If set, the SHA-256 of the downloaded source archive must
+#	               match this value
+#	YARA_MARCH   - If set, libyara is compiled for this CPU architecture,
+#	               e.g. x86-64-v3, the same value must be set when building
+#	               the module so it can refuse to load on CPUs which do not
+#	               support it
+#	YARA_LTO     - Set to 0 to disable link time optimisation
+#
+
+set -e
+
+YARA_VERSION=${YARA_VERSION:-3.11.0}
+YARA_LTO=${YARA_LTO:-1}
+
+DEPS=$(cd "$(dirname "$0")" && pwd)
+ARCHIVE="$DEPS/yara-$YARA_VERSION.tar.gz"
+SOURCE="$DEPS/yara-$YARA_VERSION"
+PREFIX="$DEPS/libyara"
+
+if [ ! -f "$ARCHIVE" ]; then
+	curl -fsSL -o "$ARCHIVE.tmp" \
+			"https://github.com/VirusTotal/yara/archive/v$YARA_VERSION.tar.gz"
+	mv "$ARCHIVE.tmp" "$ARCHIVE"
+fi
+
+if [ -n "$YARA_SHA256" ]; then
+	echo "$YARA_SHA256  $ARCHIVE" | sha256sum -c -
+fi
+
+rm -rf "$SOURCE" "$PREFIX"
+tar -xzf "$ARCHIVE" -C "$DEPS"
+
+CFLAGS="-O3 -fPIC"
+
+if [ -n "$YARA_MARCH" ]; then
+	CFLAGS="$CFLAGS -march=$YARA_MARCH"
+fi
+
+# Objects in the archive keep both LTO and regular code, so the module can
+# still be linked by a toolchain which cannot use the LTO code
+if [ "$YARA_LTO" = "1" ]; then
+	CFLAGS="$CFLAGS -flto -ffat-lto-objects"
+	export AR=gcc-ar RANLIB=gcc-ranlib NM=gcc-nm
+fi
+
+export CFLAGS
+
+cd "$SOURCE"
+
+./bootstrap.sh
+./configure \
+		--prefix="$PREFIX" \
+		--enable-static \
+		--disable-shared \
+		--with-crypto \
+		--enable-dotnet
+
+make -j"$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 2)"
+make install
@@ -1,4 +1,8 @@
 
+var crypto = require("crypto")
+var events = require("events")
+var fs = require("fs")
+var path = require("path")
 var util = require("util")
 var yara = require ("./build/Release/yara");
 
@@ -12,6 +16,10 @@ function _expandConstantObject(object) {
 
 _expandConstantObject(yara.ErrorCode)
 
+// Each region is read whole into memory, so very large regions are skipped
+// unless the caller asks for them
+var REGIONS_DEFAULT_MAX_SIZE = 256 * 1024 * 1024
+
 function CompileRulesError(message) {
 	this.name = "CompileRulesError"
 	this.message = message
@@ -19,12 +27,117 @@ function CompileRulesError(message) {
 
 util.inherits(CompileRulesError, Error)
 
+// Async iterators pause the scan once this many rules are waiting to be
+// consumed, and resume it once half of them have been
+var STREAM_HIGH_WATER_MARK = 1024
+
+function ScanStream(wrap) {
+	ScanStream.super_.call(this)
+	this._wrap = wrap
+	this._id = null
+}
+
+util.inherits(ScanStream, events.EventEmitter)
+
+ScanStream.prototype.pause = function() {
+	if (this._id !== null)
+		this._wrap.pauseStream(this._id)
+	return this
+}
+
+ScanStream.prototype.resume = function() {
+	if (this._id !== null)
+		this._wrap.resumeStream(this._id)
+	return this
+}
+
+ScanStream.prototype.abort = function() {
+	if (this._id !== null)
+		this._wrap.abortStream(this._id)
+	return this
+}
+
+ScanStream.prototype[Symbol.asyncIterator] = function() {
+	var me = this
+
+	var rules = []
+	var waiting = []
+	var done = false
+	var failed = null
+	var paused = false
+
+	function onRule(rule) {
+		if (waiting.length) {
+			waiting.shift().resolve({value: rule, done: false})
+		} else {
+			rules.push(rule)
+
+			if (! paused && rules.length >= STREAM_HIGH_WATER_MARK) {
+				paused = true
+				me.pause()
+			}
+		}
+	}
+
+	function onEnd() {
+		done = true
+		while (waiting.length)
+			waiting.shift().resolve({value: undefined, done: true})
+	}
+
+	function onError(error) {
+		failed = error
+		while (waiting.length)
+			waiting.shift().reject(error)
+	}
+
+	me.on("rule", onRule)
+	me.once("end", onEnd)
+	me.once("error", onError)
+
+	return {
+		next: function() {
+			if (rules.length) {
+				var rule = rules.shift()
+
+				if (paused && rules.length <= STREAM_HIGH_WATER_MARK / 2) {
+					paused = false
+					me.resume()
+				}
+
+				return Promise.resolve({value: rule, done: false})
+			}
+			if (failed)
+				return Promise.reject(failed)
+			if (done)
+				return Promise.resolve({value: undefined, done: true})
+
+			return new Promise(function(resolve, reject) {
+				waiting.push({resolve: resolve, reject: reject})
+			})
+		},
+
+		// Breaking out of a loop stops the scan rather than leaving it to run
+		return: function() {
+			me.removeListener("rule", onRule)
+			rules = []
+			if (! done && ! failed)
+				me.abort()
+			done = true
+			return Promise.resolve({value: undefined, done: true})
+		}
+	}
+}
+
 function Scanner(options) {
+	Scanner.super_.call(this)
 	this.yara = new yara.ScannerWrap()
 }
 
-Scanner.prototype.configure = function(options, cb) {
-	return this.yara.configure(options, function(error, warnings) {
+util.inherits(Scanner, events.EventEmitter)
+
+function _configure(me, options, cb) {
+	var args = [options, function(error, warnings) {
 		if (warnings) {
 			for (var i = 0; i < warnings.length; i++) {
 				var fields = warnings[i].split(":")
@@ -57,69 +170,441 @@ Scanner.prototype.configure = function(options, cb) {
 		} else {
 			cb(null, warnings)
 		}
+	}]
+
+	// Only pay for progress reporting when someone is listening
+	if (me.listenerCount("progress") > 0) {
+		args.push(function(progress) {
+			me.emit("progress", progress)
+		})
+	}
+
+	return me.yara.configure.apply(me.yara, args)
+}
+
+Scanner.prototype.configure = function(options, cb) {
+	var me = this
+
+	// Configuring again replaces any previous configuration, including watching
+	me._unwatch()
+
+	return _configure(me, options, function(error, warnings) {
+		if (! error && options.watch) {
+			try {
+				me._watch(options)
+			} catch (watchError) {
+				error = watchError
+			}
+		}
+
+		cb(error, warnings)
 	})
 }
 
-Scanner.prototype.scan = function(req, cb) {
+Scanner.prototype._watch = function(options) {
+	var me = this
+
+	var filenames = []
+	options.rules.forEach(function(rule) {
+		if (rule && typeof rule.filename == "string" && rule.filename.length)
+			filenames.push(rule.filename)
+	})
+
+	var reloadOptions = {}
+	for (var key in options)
+		reloadOptions[key] = options[key]
+	reloadOptions.keepRulesOnError = true
+
+	var state = {reloading: false, pending: {}}
+
+	function reload(changed) {
+		state.reloading = true
+
+		var start = process.hrtime()
+
+		function complete(error, warnings) {
+			var elapsed = process.hrtime(start)
+			var durationMs = (elapsed[0] * 1e3) + (elapsed[1] / 1e6)
+
+			state.reloading = false
+
+			if (me._watchState !== state)
+				return
+
+			if (error) {
+				me.emit("reloadFailed", {
+					error: error,
+					changed: changed,
+					durationMs: durationMs
+				})
+			} else {
+				me.emit("reloaded", {
+					changed: changed,
+					warnings: warnings,
+					durationMs: durationMs
+				})
+			}
+
+			var pending = Object.keys(state.pending)
+			if (pending.length) {
+				state.pending = {}
+				reload(pending)
+			}
+		}
+
+		try {
+			_configure(me, reloadOptions, complete)
+		} catch (error) {
+			complete(error)
+		}
+	}
+
+	// Files which change while reloading are picked up by another reload
+	me.yara.watch(filenames, typeof options.debounceMs == "number" ? options.debounceMs : 200, function(changed) {
+		if (me._watchState !== state)
+			return
+
+		if (state.reloading) {
+			changed.forEach(function(filename) {
+				state.pending[filename] = true
+			})
+		} else {
+			reload(changed)
+		}
+	})
+
+	me._watchState = state
+}
+
+Scanner.prototype._unwatch = function() {
+	if (this._watchState) {
+		this._watchState = null
+		this.yara.unwatch()
+	}
+}
+
+function _parseRules(rules) {
+	rules.forEach(function(rule) {
+		for (var i = 0; i < rule.metas.length; i++) {
+			var fields = rule.metas[i].split(":")
+
+			var type = parseInt(fields.shift())
+			var id = fields.shift()
+
+			var meta = {
+				type: type,
+				id: id,
+				value: fields.join(":")
+			}
+
+			if (meta.type == yara.MetaType.Integer)
+				meta.value = parseInt(meta.value)
+			else if (meta.type == yara.MetaType.Boolean)
+				meta.value = (meta.value == "true") ? true : false
+
+			rule.metas[i] = meta
+		}
+
+		for (var i = 0; i < rule.matches.length; i++) {
+			var fields = rule.matches[i].split(":")
+
+			var match = {
+				offset: parseInt(fields[0]),
+				length: parseInt(fields[1]),
+				id: fields[2]
+			}
+
+			if (i < rule.datas.length)
+				match.bytes = rule.datas[i]
+
+			rule.matches[i] = match
+		}
+
+		delete rule.datas
+
+		if (rule.truncated) {
+			for (var i = 0; i < rule.truncated.length; i++) {
+				var fields = rule.truncated[i].split(":")
+
+				rule.truncated[i] = {
+					id: fields[1],
+					count: parseInt(fields[0])
+				}
+			}
+		}
+	})
+
+	return rules
+}
+
+function _parseMaps(data) {
+	var regions = []
+
+	data.split("\n").forEach(function(line) {
+		var fields = line.trim().split(/\s+/)
+		if (fields.length < 5)
+			return
+
+		var range = fields[0].split("-")
+		var start = parseInt(range[0], 16)
+		var end = parseInt(range[1], 16)
+
+		regions.push({
+			address: start,
+			length: end - start,
+			permissions: fields[1],
+			path: fields.slice(5).join(" ")
+		})
+	})
+
+	return regions
+}
+
+// Module data is only parsed from JSON when it is first accessed
+function _parseModules(result) {
+	if (result.members)
+		result.members.forEach(_parseModules)
+
+	if (! result.modules)
+		return result
+
+	var json = result.modules
+	var modules = {}
+
+	Object.keys(json).forEach(function(name) {
+		var value
+
+		Object.defineProperty(modules, name, {
+			enumerable: true,
+			get: function() {
+				if (value === undefined)
+					value = JSON.parse(json[name])
+				return value
+			}
+		})
+	})
+
+	result.modules = modules
+
+	return result
+}
+
+function _promise(me, method, req) {
+	return new Promise(function(resolve, reject) {
+		method.call(me, req, function(error, result) {
+			if (error)
+				reject(error)
+			else
+				resolve(result)
+		})
+	})
+}
+
+function _normalizeRequest(req) {
 	if (req.buffer) {
 		if (! req.offset)
 			req.offset = 0
 		if (! req.length)
 			req.length = req.buffer.length - req.offset
 	}
+}
+
+Scanner.prototype.scan = function(req, cb) {
+	if (! cb)
+		return _promise(this, this.scan, req)
+
+	if (req.pid && req.regions) {
+		if (req.output)
+			throw new Error("Region scans cannot use output")
+
+		return this.scanRegions(req, cb)
+	}
+
+	_normalizeRequest(req)
 
 	return this.yara.scan(req, function(error, result) {
 		if (error) {
 			cb(error)
+		} else if (Buffer.isBuffer(result)) {
+			// Encoded by the scanning thread, see the output attribute
+			cb(null, result)
 		} else {
-			result.rules.forEach(function(rule) {
-				for (var i = 0; i < rule.metas.length; i++) {
-					var fields = rule.metas[i].split(":")
+			_parseRules(result.rules)
 
-					var type = parseInt(fields.shift())
-					var id = fields.shift()
+			if (result.members) {
+				result.members.forEach(function(member) {
+					if (member.rules)
+						_parseRules(member.rules)
+				})
+			}
 
-					var meta = {
-						type: type,
-						id: id,
-						value: fields.join(":")
-					}
+			cb(null, _parseModules(result))
+		}
+	})
+}
 
-					if (meta.type == yara.MetaType.Integer)
-						meta.value = parseInt(meta.value)
-					else if (meta.type == yara.MetaType.Boolean)
-						meta.value = (meta.value == "true") ? true : false
+Scanner.prototype.scanStream = function(req) {
+	if (req.pid && req.regions)
+		throw new Error("Regions cannot be streamed")
 
-					rule.metas[i] = meta
-				}
+	if (req.expand)
+		throw new Error("Expanded scans cannot be streamed")
+
+	if (req.output)
+		throw new Error("Output cannot be streamed")
+
+	_normalizeRequest(req)
+
+	var stream = new ScanStream(this.yara)
+
+	stream._id = this.yara.scan(req, function(error, result) {
+		if (error)
+			stream.emit("error", error)
+		else
+			stream.emit("end", _parseModules(result))
+	}, function(rules) {
+		_parseRules(rules).forEach(function(rule) {
+			stream.emit("rule", rule)
+		})
+	})
+
+	return stream
+}
+
+Scanner.prototype.scanRegions = function(req, cb) {
+	if (! cb)
+		return _promise(this, this.scanRegions, req)
+
+	var me = this
+	var options = (typeof req.regions == "object") ? req.regions : {}
+
+	var permissions = options.permissions || "r"
+	var maxSize = (options.maxSize === undefined)
+			? REGIONS_DEFAULT_MAX_SIZE
+			: options.maxSize
+	var concurrency = options.concurrency
+			|| parseInt(process.env.UV_THREADPOOL_SIZE)
+			|| 4
+
+	fs.readFile("/proc/" + req.pid + "/maps", "utf8", function(error, data) {
+		if (error)
+			return cb(error)
+
+		var skipped = 0
+
+		var regions = _parseMaps(data).filter(function(region) {
+			// The kernel refuses reads of these through /proc/<pid>/mem
+			if (region.path == "[vvar]" || region.path == "[vsyscall]")
+				return false
 
-				for (var i = 0; i < rule.matches.length; i++) {
-					var fields = rule.matches[i].split(":")
+			for (var i = 0; i < permissions.length; i++) {
+				if (region.permissions.indexOf(permissions[i]) < 0)
+					return false
+			}
+
+			if (maxSize && region.length > maxSize) {
+				skipped++
+				return false
+			}
+
+			return true
+		})
+
+		if (options.maxRegions && regions.length > options.maxRegions) {
+			skipped += regions.length - options.maxRegions
+			regions = regions.slice(0, options.maxRegions)
+		}
+
+		var index = 0
+		var pending = 0
+		var failed = false
+
+		function onScan(region, error, result) {
+			pending--
 
-					var match = {
-						offset: parseInt(fields[0]),
-						length: parseInt(fields[1]),
-						id: fields[2]
-					}
+			if (error) {
+				region.error = error.message
+			} else {
+				region.rules = _parseRules(result.rules)
+
+				if (result.truncated)
+					region.truncated = result.truncated
+			}
 
-					if (i < rule.datas.length)
-						match.bytes = rule.datas[i]
+			if (req.stats)
+				region.stats = error ? error.stats : result.stats
 
-					rule.matches[i] = match
+			next()
+		}
+
+		function next() {
+			while (! failed && pending < concurrency && index < regions.length) {
+				var region = regions[index++]
+
+				var regionReq = {
+					pid: req.pid,
+					address: region.address,
+					length: region.length,
+					flags: req.flags,
+					timeout: req.timeout,
+					matchedBytes: req.matchedBytes,
+					maxMatchesPerString: req.maxMatchesPerString,
+					maxMatchesTotal: req.maxMatchesTotal,
+					maxResultBytes: req.maxResultBytes,
+					stats: req.stats
 				}
 
-				delete rule.datas
-			})
+				try {
+					me.yara.scan(regionReq, onScan.bind(me, region))
+					pending++
+				} catch (error) {
+					failed = true
+					return cb(error)
+				}
+			}
 
-			cb(null, result)
+			if (! failed && pending == 0 && index >= regions.length)
+				cb(null, {regions: regions, skipped: skipped})
 		}
+
+		next()
+	})
+
+	return this
+}
+
+Scanner.prototype.memoryUsage = function() {
+	return this.yara.memoryUsage()
+}
+
+Scanner.prototype.rulesFingerprint = function(cb) {
+	if (! cb)
+		return _promise(this, function(req, cb) {
+			this.rulesFingerprint(cb)
+		})
+
+	var fingerprint = this.yara.rulesFingerprint()
+
+	process.nextTick(function() {
+		cb(null, fingerprint)
 	})
+
+	return this
+}
+
+// The native watcher's callback references the scanner, so watching
+// scanners are only released once destroyed
+Scanner.prototype.destroy = function(cb) {
+	this._watchState = null
+	return this.yara.destroy(cb || function() {})
 }
 
 exports.CompileRulesError = CompileRulesError
 
 exports.Scanner = Scanner
 
+exports.ScanStream = ScanStream
+
 exports.MetaType = yara.MetaType
 
 exports.ScanFlag = yara.ScanFlag
@@ -137,3 +622,335 @@ exports.initialize = function(cb) {
 exports.libyaraVersion = function() {
 	return yara.libyaraVersion()
 }
+
+exports.buildInfo = function() {
+	return yara.buildInfo()
+}
+
+exports.buildAllowlist = function(input, output, cb) {
+	return yara.buildAllowlist(input, output, cb)
+}
+
+exports.loadAllowlist = function(filename, cb) {
+	return yara.loadAllowlist(filename, cb)
+}
+
+exports.unloadAllowlist = function() {
+	return yara.unloadAllowlist()
+}
+
+exports.configureScheduler = function(options) {
+	return yara.configureScheduler(options)
+}
+
+exports.schedulerStats = function() {
+	return yara.schedulerStats()
+}
+
+exports.configureCapture = function(options) {
+	return yara.configureCapture(options)
+}
+
+exports.captureStats = function() {
+	return yara.captureStats()
+}
+
+function _hashFile(filename, cb) {
+	var hash = crypto.createHash("sha256")
+	var stream = fs.createReadStream(filename)
+
+	stream.on("error", cb)
+	stream.on("data", function(data) {
+		hash.update(data)
+	})
+	stream.on("end", function() {
+		cb(null, hash.digest("hex"))
+	})
+}
+
+// Build the request to repeat a capture, using the captured content when
+// present, otherwise the original file if it has not changed
+function _replayRequest(dir, capture, cb) {
+	var req = {}
+	for (var name in capture.request)
+		req[name] = capture.request[name]
+
+	req.stats = true
+	req.capture = false
+
+	var input = path.join(dir, "input")
+
+	if (! capture.inputCaptured) {
+		if (capture.input != "file")
+			return cb(new Error("Input was not captured"))
+
+		return _hashFile(capture.filename, function(error, sha256) {
+			if (error)
+				return cb(error)
+
+			if (sha256 != capture.sha256)
+				return cb(new Error("Input has changed since it was captured"))
+
+			req.filename = capture.filename
+			cb(null, req)
+		})
+	}
+
+	if (capture.input == "file") {
+		req.filename = input
+		return cb(null, req)
+	}
+
+	fs.readFile(input, function(error, data) {
+		if (error)
+			return cb(error)
+
+		if (capture.input == "buffer") {
+			req.buffer = data
+		} else {
+			var offset = 0
+
+			req.buffers = capture.blocks.map(function(length) {
+				var block = data.slice(offset, offset + length)
+				offset += length
+				return block
+			})
+		}
+
+		cb(null, req)
+	})
+}
+
+// Captures are replayed one at a time, so timings are not skewed by other
+// scans, and in the order they were captured.  Without a scanner each capture
+// is replayed using the rules saved with it, otherwise the scanner must have
+// the same rules as each capture.
+exports.replay = function(dir, scanner, cb) {
+	if (typeof scanner == "function") {
+		cb = scanner
+		scanner = null
+	}
+
+	if (! cb) {
+		return new Promise(function(resolve, reject) {
+			exports.replay(dir, scanner, function(error, results) {
+				if (error)
+					reject(error)
+				else
+					resolve(results)
+			})
+		})
+	}
+
+	fs.readdir(dir, function(error, names) {
+		if (error)
+			return cb(error)
+
+		var captures = names.filter(function(name) {
+			return name.indexOf("capture-") == 0
+		}).sort()
+
+		var results = []
+		var index = 0
+
+		// Scanners created for saved rules, and any error loading them, keyed
+		// by fingerprint
+		var loaded = {}
+		var fingerprint = null
+
+		function complete() {
+			var fingerprints = Object.keys(loaded)
+
+			function destroyNext() {
+				if (! fingerprints.length)
+					return cb(null, results)
+
+				var item = loaded[fingerprints.shift()]
+
+				if (item.scanner)
+					item.scanner.destroy(destroyNext)
+				else
+					destroyNext()
+			}
+
+			destroyNext()
+		}
+
+		function scannerFor(capture, rulesFile, cb) {
+			if (scanner) {
+				if (capture.rulesFingerprint != fingerprint)
+					return cb(new Error("Scanner rules do not match the captured rules"))
+
+				return cb(null, scanner)
+			}
+
+			var item = loaded[capture.rulesFingerprint]
+
+			if (item)
+				return cb(item.error, item.scanner)
+
+			item = loaded[capture.rulesFingerprint] = {
+				scanner: exports.createScanner()
+			}
+
+			item.scanner.configure({rules: [{compiled: rulesFile}]}, function(error) {
+				if (error) {
+					item.error = error
+					item.scanner.destroy(function() {})
+					item.scanner = null
+				}
+
+				cb(item.error, item.scanner)
+			})
+		}
+
+		function replayed(result, error, scanned) {
+			if (error)
+				result.error = error.message
+
+			if (error && error.stats)
+				result.stats = error.stats
+
+			if (scanned) {
+				result.rules = scanned.rules
+				result.stats = scanned.stats
+			}
+
+			results.push(result)
+			next()
+		}
+
+		function next() {
+			if (index >= captures.length)
+				return complete()
+
+			var name = captures[index++]
+			var captureDir = path.join(dir, name)
+			var result = {capture: name}
+
+			fs.readFile(path.join(captureDir, "capture.json"), "utf8", function(error, data) {
+				if (error)
+					return replayed(result, error)
+
+				var capture
+
+				try {
+					capture = JSON.parse(data)
+				} catch (error) {
+					return replayed(result, error)
+				}
+
+				result.input = capture.input
+				result.size = capture.size
+				result.sha256 = capture.sha256
+				result.rulesFingerprint = capture.rulesFingerprint
+				result.rulesFile = path.join(dir, "rules-" + capture.rulesFingerprint + ".yarc")
+				result.captured = {
+					wallMs: capture.wallMs,
+					cpuMs: capture.cpuMs,
+					timedOut: capture.timedOut
+				}
+
+				if (capture.filename)
+					result.filename = capture.filename
+
+				if (capture.error)
+					result.captured.error = capture.error
+
+				scannerFor(capture, result.rulesFile, function(error, replayScanner) {
+					if (error)
+						return replayed(result, error)
+
+					_replayRequest(captureDir, capture, function(error, req) {
+						if (error)
+							return replayed(result, error)
+
+						try {
+							replayScanner.scan(req, function(error, scanned) {
+								replayed(result, error, scanned)
+							})
+						} catch (error) {
+							replayed(result, error)
+						}
+					})
+				})
+			})
+		}
+
+		if (! scanner)
+			return next()
+
+		try {
+			scanner.rulesFingerprint(function(error, scannerFingerprint) {
+				if (error)
+					return cb(error)
+
+				fingerprint = scannerFingerprint
+				next()
+			})
+		} catch (error) {
+			cb(error)
+		}
+	})
+}
+
+// A file is read, or mapped, once into a Buffer which every scanner then
+// scans, and results are keyed the same way as scanners
+exports.scanMulti = function(scanners, req, cb) {
+	if (! cb) {
+		return new Promise(function(resolve, reject) {
+			exports.scanMulti(scanners, req, function(error, results) {
+				if (error)
+					reject(error)
+				else
+					resolve(results)
+			})
+		})
+	}
+
+	var keys = Object.keys(scanners)
+	var results = Array.isArray(scanners) ? [] : {}
+	var pending = keys.length
+
+	function scanned(key, error, result) {
+		results[key] = error ? {error: error} : result
+
+		if (--pending == 0)
+			cb(null, results)
+	}
+
+	function scanAll(buffer) {
+		if (pending == 0)
+			return cb(null, results)
+
+		keys.forEach(function(key) {
+			var item = {}
+			for (var name in req)
+				item[name] = req[name]
+
+			if (buffer) {
+				delete item.filename
+				delete item.readLimit
+				item.buffer = buffer
+			}
+
+			try {
+				scanners[key].scan(item, function(error, result) {
+					scanned(key, error, result)
+				})
+			} catch (error) {
+				scanned(key, error)
+			}
+		})
+	}
+
+	if (! req.filename)
+		return scanAll(null)
+
+	yara.mapFile(req.filename, req.readLimit || 0, function(error, buffer) {
+		if (error)
+			cb(error)
+		else
+			scanAll(buffer)
+	})
+}
@@ -0,0 +1,33 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace yara {
+
+#define SHA256_LENGTH 32
+
+/**
+ ** Incremental SHA-256, as specified in FIPS 180-4, used to hash inputs
+ ** before scanning them so they can be checked against an allowlist.
+ **/
+class Sha256 {
+public:
+	Sha256(void);
+
+	void update(const uint8_t* data, size_t length);
+	void final(uint8_t digest[SHA256_LENGTH]);
+
+private:
+	void transform(const uint8_t block[64]);
+
+	uint32_t state_[8];
+	uint64_t length_;
+	uint8_t buffer_[64];
+	size_t buffered_;
+};
+
+}; /* namespace yara */
+
+#endif /* SHA256_H */
@@ -1,15 +1,37 @@
 #ifndef YARA_CC
 #define YARA_CC
 
+#include <algorithm>
+#include <cmath>
 #include <list>
 #include <map>
+#include <new>
+#include <set>
 #include <stdexcept>
 #include <string>
 #include <sstream>
+#include <vector>
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
+#include "sha256.h"
 #include "yara.h"
 
 const char* yara_strerror(int code) {
@@ -45,6 +67,10 @@ void compileCallback(int error_level, const char* file_name, int line_number,
 
 int scanCallback(int message, void* data, void* param);
 
+void scanCompleted(bool large);
+bool captureEnabled(void);
+std::string digestToHex(const uint8_t* digest);
+
 const char* getErrorString(int code) {
 	size_t count = error_codes.count(code);
 	if (count > 0)
@@ -67,7 +93,472 @@ private:
 	std::string _what;
 };
 
+#ifdef __linux__
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+		| IN_MOVED_FROM | IN_MOVED_TO)
+
+/**
+ ** Watches the directories containing rule files using inotify, so that
+ ** files replaced by renaming them into place are also seen.  Changes are
+ ** collected until none have been seen for debounce_ms, and the changed
+ ** files are then passed to the callback on the main thread.
+ **/
+class RuleWatcher {
+public:
+	RuleWatcher(Nan::Callback* callback, int64_t debounce_ms)
+			: callback_(callback),
+				resource_("yara:RuleWatcher"),
+				debounce_ms_(debounce_ms),
+				inotify_fd_(-1),
+				stop_fd_(-1),
+				async_(NULL),
+				started_(false) {
+		pthread_mutex_init(&mutex_, NULL);
+	}
+
+	~RuleWatcher() {
+		stop();
+
+		delete callback_;
+		pthread_mutex_destroy(&mutex_);
+	}
+
+	void start(const std::list<std::string>& filenames) {
+		inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (inotify_fd_ < 0)
+			yara_throw(YaraError, "inotify_init1() failed: "
+					<< yara_strerror(errno));
+
+		stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (stop_fd_ < 0) {
+			close(inotify_fd_);
+			inotify_fd_ = -1;
+			yara_throw(YaraError, "eventfd() failed: "
+					<< yara_strerror(errno));
+		}
+
+		std::list<std::string>::const_iterator filenames_it;
+
+		for (filenames_it = filenames.begin();
+				filenames_it != filenames.end();
+				filenames_it++) {
+			std::string dir = ".";
+			std::string name = *filenames_it;
+
+			size_t slash = filenames_it->rfind('/');
+			if (slash != std::string::npos) {
+				dir = slash ? filenames_it->substr(0, slash) : "/";
+				name = filenames_it->substr(slash + 1);
+			}
+
+			int wd = inotify_add_watch(inotify_fd_, dir.c_str(), WATCH_EVENTS);
+			if (wd < 0) {
+				int error = errno;
+				close(inotify_fd_);
+				close(stop_fd_);
+				inotify_fd_ = stop_fd_ = -1;
+				yara_throw(YaraError, "inotify_add_watch(" << dir.c_str()
+						<< ") failed: " << yara_strerror(error));
+			}
+
+			files_[wd][name].insert(*filenames_it);
+
+			// Kubernetes mounts ConfigMaps with each file a symlink through
+			// ..data, itself a symlink swapped by a rename to update every
+			// file at once, so the first component of a relative symlink
+			// target in the same directory is watched too
+			char target[PATH_MAX];
+			ssize_t length = readlink(filenames_it->c_str(), target, sizeof(target) - 1);
+
+			if (length > 0 && target[0] != '/') {
+				target[length] = '\0';
+				std::string first(target, strcspn(target, "/"));
+
+				if (first.length() && first != "." && first != ".." && first != name)
+					files_[wd][first].insert(*filenames_it);
+			}
+		}
+
+		async_ = new uv_async_t;
+		uv_async_init(Nan::GetCurrentEventLoop(), async_, onAsync);
+		async_->data = (void*) this;
+
+		// Like an unreferenced timer, watching does not keep the process alive
+		uv_unref((uv_handle_t*) async_);
+
+		// pthread_create() returns its error rather than setting errno
+		int error = pthread_create(&thread_, NULL, run, (void*) this);
+		if (error != 0) {
+			stop();
+			yara_throw(YaraError, "pthread_create() failed: "
+					<< yara_strerror(error));
+		}
+
+		started_ = true;
+	}
+
+	void stop(void) {
+		if (started_) {
+			uint64_t value = 1;
+			if (write(stop_fd_, &value, sizeof(value)) < 0) {}
+			pthread_join(thread_, NULL);
+			started_ = false;
+		}
+
+		if (async_) {
+			async_->data = NULL;
+			uv_close((uv_handle_t*) async_, onClose);
+			async_ = NULL;
+		}
+
+		if (inotify_fd_ >= 0) {
+			close(inotify_fd_);
+			inotify_fd_ = -1;
+		}
+
+		if (stop_fd_ >= 0) {
+			close(stop_fd_);
+			stop_fd_ = -1;
+		}
+	}
+
+private:
+	static void* run(void* data) {
+		((RuleWatcher*) data)->loop();
+		return NULL;
+	}
+
+	static int64_t now(void) {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ((int64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+	}
+
+	void loop(void) {
+		std::set<std::string> pending;
+		int64_t deadline = 0;
+		char events[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+		while (true) {
+			struct pollfd fds[2];
+			fds[0].fd = inotify_fd_;
+			fds[0].events = POLLIN;
+			fds[1].fd = stop_fd_;
+			fds[1].events = POLLIN;
+
+			int timeout = -1;
+			if (pending.size()) {
+				int64_t remaining = deadline - now();
+				timeout = remaining > 0 ? (int) remaining : 0;
+			}
+
+			int rc = poll(fds, 2, timeout);
+			if (rc < 0 && errno != EINTR)
+				break;
+
+			if (fds[1].revents & POLLIN)
+				break;
+
+			if (rc > 0 && (fds[0].revents & POLLIN)) {
+				ssize_t length;
+
+				while ((length = read(inotify_fd_, events, sizeof(events))) > 0) {
+					for (char* ptr = events; ptr < events + length; ) {
+						struct inotify_event* event = (struct inotify_event*) ptr;
+						ptr += sizeof(struct inotify_event) + event->len;
+
+						// Events were lost, so assume every file changed
+						if (event->mask & IN_Q_OVERFLOW) {
+							addAll(pending);
+							deadline = now() + debounce_ms_;
+							continue;
+						}
+
+						if (! event->len || ! files_.count(event->wd))
+							continue;
+
+						std::map<std::string, std::set<std::string> >& names = files_[event->wd];
+						std::map<std::string, std::set<std::string> >::iterator names_it
+								= names.find(event->name);
+
+						if (names_it != names.end()) {
+							pending.insert(names_it->second.begin(), names_it->second.end());
+							deadline = now() + debounce_ms_;
+						}
+					}
+				}
+			}
+
+			if (pending.size() && now() >= deadline) {
+				pthread_mutex_lock(&mutex_);
+				changed_.insert(pending.begin(), pending.end());
+				pthread_mutex_unlock(&mutex_);
+
+				pending.clear();
+
+				uv_async_send(async_);
+			}
+		}
+	}
+
+	void addAll(std::set<std::string>& pending) {
+		std::map<int, std::map<std::string, std::set<std::string> > >::iterator files_it;
+		std::map<std::string, std::set<std::string> >::iterator names_it;
+
+		for (files_it = files_.begin(); files_it != files_.end(); files_it++)
+			for (names_it = files_it->second.begin();
+					names_it != files_it->second.end();
+					names_it++)
+				pending.insert(names_it->second.begin(), names_it->second.end());
+	}
+
+	static void onAsync(uv_async_t* handle) {
+		RuleWatcher* watcher = (RuleWatcher*) handle->data;
+		if (! watcher)
+			return;
+
+		Nan::HandleScope scope;
+
+		pthread_mutex_lock(&watcher->mutex_);
+		std::set<std::string> changed;
+		changed.swap(watcher->changed_);
+		pthread_mutex_unlock(&watcher->mutex_);
+
+		if (! changed.size())
+			return;
+
+		Local<Array> filenames = Nan::New<Array>();
+		uint32_t index = 0;
+
+		std::set<std::string>::iterator changed_it;
+
+		for (changed_it = changed.begin(); changed_it != changed.end(); changed_it++)
+			Nan::Set(filenames, index++, Nan::New(changed_it->c_str()).ToLocalChecked());
+
+		Local<Value> argv[1];
+		argv[0] = filenames;
+		watcher->callback_->Call(1, argv, &watcher->resource_);
+	}
+
+	static void onClose(uv_handle_t* handle) {
+		delete (uv_async_t*) handle;
+	}
+
+	Nan::Callback* callback_;
+	Nan::AsyncResource resource_;
+	int64_t debounce_ms_;
+
+	int inotify_fd_;
+	int stop_fd_;
+	uv_async_t* async_;
+	pthread_t thread_;
+	bool started_;
+
+	// Watched file names by watch descriptor and then by name in directory,
+	// a name can stand for several files when it is a symlink they pass
+	// through
+	std::map<int, std::map<std::string, std::set<std::string> > > files_;
+
+	pthread_mutex_t mutex_;
+	std::set<std::string> changed_;
+};
+
+#else /* __linux__ */
+
+class RuleWatcher {
+public:
+	RuleWatcher(Nan::Callback* callback, int64_t debounce_ms)
+			: callback_(callback) {}
+
+	~RuleWatcher() {
+		delete callback_;
+	}
+
+	void start(const std::list<std::string>& filenames) {
+		yara_throw(YaraError, "Watching rule files is only supported on Linux");
+	}
+
+	void stop(void) {}
+
+private:
+	Nan::Callback* callback_;
+};
+
+#endif /* __linux__ */
+
+#define STRINGIFY_(value) #value
+#define STRINGIFY(value) STRINGIFY_(value)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_FEATURES_X86
+#endif
+
+/**
+ ** Highest x86-64 micro-architecture level supported by this CPU, as a
+ ** number, i.e. 1 for baseline x86-64 through to 4 for x86-64-v4.
+ **/
+int getCpuLevel(void) {
+#ifdef CPU_FEATURES_X86
+	__builtin_cpu_init();
+
+	if (! (__builtin_cpu_supports("popcnt")
+			&& __builtin_cpu_supports("sse3")
+			&& __builtin_cpu_supports("ssse3")
+			&& __builtin_cpu_supports("sse4.1")
+			&& __builtin_cpu_supports("sse4.2")))
+		return 1;
+
+	if (! (__builtin_cpu_supports("avx")
+			&& __builtin_cpu_supports("avx2")
+			&& __builtin_cpu_supports("bmi")
+			&& __builtin_cpu_supports("bmi2")
+			&& __builtin_cpu_supports("fma")))
+		return 2;
+
+	if (! (__builtin_cpu_supports("avx512f")
+			&& __builtin_cpu_supports("avx512bw")
+			&& __builtin_cpu_supports("avx512cd")
+			&& __builtin_cpu_supports("avx512dq")
+			&& __builtin_cpu_supports("avx512vl")))
+		return 3;
+
+	return 4;
+#else
+	return 0;
+#endif
+}
+
+/**
+ ** Level required by the architecture libyara was compiled for, if it was
+ ** compiled for one of the x86-64 levels, otherwise 0.
+ **/
+int getBuildLevel(void) {
+#ifdef YARA_MARCH
+	const char* march = STRINGIFY(YARA_MARCH);
+
+	if (! strcmp(march, "x86-64"))
+		return 1;
+	if (! strncmp(march, "x86-64-v", 8))
+		return atoi(march + 8);
+#endif
+	return 0;
+}
+
+/**
+ ** NUMA topology read from sysfs when the module is loaded, the node of each
+ ** CPU and the CPUs of each node.  Nodes are numbered by their index here,
+ ** not their kernel id, since ids can be sparse, and nodes without CPUs are
+ ** left out since no thread could load or use a replica on them.  Machines
+ ** without NUMA, or which are not Linux, appear as a single node.
+ **/
+std::vector<int> cpu_nodes;
+std::vector<std::vector<int> > node_cpus;
+
+void parseCpuList(const char* list, std::vector<int>* cpus) {
+	const char* ptr = list;
+
+	while (*ptr >= '0' && *ptr <= '9') {
+		char* end;
+		int first = strtol(ptr, &end, 10);
+		int last = first;
+
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+
+		for (int cpu = first; cpu <= last; cpu++)
+			cpus->push_back(cpu);
+
+		ptr = (*end == ',') ? end + 1 : end;
+	}
+}
+
+void initNumaTopology(void) {
+#ifdef __linux__
+	char line[4096];
+	std::vector<int> online;
+
+	// Online node ids are listed in the same format as CPUs
+	FILE* file = fopen("/sys/devices/system/node/online", "r");
+	if (file) {
+		if (fgets(line, sizeof(line), file))
+			parseCpuList(line, &online);
+		fclose(file);
+	}
+
+	for (size_t i = 0; i < online.size(); i++) {
+		std::ostringstream path;
+		path << "/sys/devices/system/node/node" << online[i] << "/cpulist";
+
+		file = fopen(path.str().c_str(), "r");
+		if (! file)
+			continue;
+
+		std::vector<int> cpus;
+
+		if (fgets(line, sizeof(line), file))
+			parseCpuList(line, &cpus);
+
+		fclose(file);
+
+		if (cpus.empty())
+			continue;
+
+		int node = node_cpus.size();
+
+		for (size_t j = 0; j < cpus.size(); j++) {
+			if ((size_t) cpus[j] >= cpu_nodes.size())
+				cpu_nodes.resize(cpus[j] + 1, 0);
+			cpu_nodes[cpus[j]] = node;
+		}
+
+		node_cpus.push_back(cpus);
+	}
+#endif
+
+	if (node_cpus.empty())
+		node_cpus.push_back(std::vector<int>());
+}
+
+int currentNumaNode(void) {
+#ifdef __linux__
+	int cpu = sched_getcpu();
+
+	if (cpu >= 0 && (size_t) cpu < cpu_nodes.size())
+		return cpu_nodes[cpu];
+#endif
+
+	return 0;
+}
+
+// Size of a transparent huge page, read from sysfs when the module is loaded
+size_t huge_page_size = 2 * 1024 * 1024;
+
+void initHugePageSize(void) {
+#ifdef __linux__
+	FILE* file = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (! file)
+		return;
+
+	unsigned long size;
+	if (fscanf(file, "%lu", &size) == 1 && size > 0 && (size & (size - 1)) == 0)
+		huge_page_size = size;
+
+	fclose(file);
+#endif
+}
+
 void InitAll(Local<Object> exports) {
+	// A libyara compiled for a newer CPU would crash on its first scan
+	if (getBuildLevel() > getCpuLevel()) {
+		Nan::ThrowError("This CPU does not support the instructions libyara "
+				"was compiled to use (" STRINGIFY(YARA_MARCH) ")");
+		return;
+	}
+
+	initNumaTopology();
+	initHugePageSize();
+
 	MAP_ERROR_CODE("ERROR_SUCCESS", ERROR_SUCCESS);
 	MAP_ERROR_CODE("ERROR_INSUFICIENT_MEMORY", ERROR_INSUFICIENT_MEMORY);
 	MAP_ERROR_CODE("ERROR_COULD_NOT_ATTACH_TO_PROCESS", ERROR_COULD_NOT_ATTACH_TO_PROCESS);
@@ -153,6 +644,15 @@ void ExportConstants(Local<Object> target) {
 void ExportFunctions(Local<Object> target) {
 	Nan::Set(target, Nan::New("libyaraVersion").ToLocalChecked(), Nan::GetFunction(Nan::New<FunctionTemplate>(LibyaraVersion)).ToLocalChecked());
 	Nan::Set(target, Nan::New("initialize").ToLocalChecked(), Nan::GetFunction(Nan::New<FunctionTemplate>(Initialize)).ToLocalChecked());
+	Nan::Set(target, Nan::New("buildInfo").ToLocalChecked(), Nan::GetFunction(Nan::New<FunctionTemplate>(BuildInfo)).ToLocalChecked());
+	Nan::Set(target, Nan::New("buildAllowlist").ToLocalChecked(), Nan::GetFunction(Nan::New<FunctionTemplate>(BuildAllowlist)).ToLocalChecked());
+	Nan::Set(target, Nan::New("loadAllowlist").ToLocalChecked(), Nan::GetFunction(Nan::New<FunctionTemplate>(LoadAllowlist)).ToLocalChecked());
+	Nan::Set(target, Nan::New("unloadAllowlist").ToLocalChecked(), Nan::GetFunction(Nan::New<FunctionTemplate>(UnloadAllowlist)).ToLocalChecked());
+	Nan::Set(target, Nan::New("configureScheduler").ToLocalChecked(), Nan::GetFunction(Nan::New<FunctionTemplate>(ConfigureScheduler)).ToLocalChecked());
+	Nan::Set(target, Nan::New("schedulerStats").ToLocalChecked(), Nan::GetFunction(Nan::New<FunctionTemplate>(SchedulerStats)).ToLocalChecked());
+	Nan::Set(target, Nan::New("mapFile").ToLocalChecked(), Nan::GetFunction(Nan::New<FunctionTemplate>(MapFile)).ToLocalChecked());
+	Nan::Set(target, Nan::New("configureCapture").ToLocalChecked(), Nan::GetFunction(Nan::New<FunctionTemplate>(ConfigureCapture)).ToLocalChecked());
+	Nan::Set(target, Nan::New("captureStats").ToLocalChecked(), Nan::GetFunction(Nan::New<FunctionTemplate>(CaptureStats)).ToLocalChecked());
 }
 
 NAN_METHOD(LibyaraVersion) {
@@ -163,6 +663,69 @@ NAN_METHOD(LibyaraVersion) {
 	info.GetReturnValue().Set(version);
 }
 
+NAN_METHOD(BuildInfo) {
+	Nan::HandleScope scope;
+
+	Local<Object> build = Nan::New<Object>();
+
+	Nan::Set(build, Nan::New("libyaraVersion").ToLocalChecked(), Nan::New(YR_VERSION).ToLocalChecked());
+
+#ifdef YARA_STATIC_BUILD
+	Nan::Set(build, Nan::New("static").ToLocalChecked(), Nan::True());
+#else
+	Nan::Set(build, Nan::New("static").ToLocalChecked(), Nan::False());
+#endif
+
+#ifdef YARA_LTO_BUILD
+	Nan::Set(build, Nan::New("lto").ToLocalChecked(), Nan::True());
+#else
+	Nan::Set(build, Nan::New("lto").ToLocalChecked(), Nan::False());
+#endif
+
+#ifdef YARA_MARCH
+	Nan::Set(build, Nan::New("march").ToLocalChecked(), Nan::New(STRINGIFY(YARA_MARCH)).ToLocalChecked());
+#else
+	Nan::Set(build, Nan::New("march").ToLocalChecked(), Nan::Null());
+#endif
+
+	int level = getCpuLevel();
+
+	if (level > 0) {
+		std::ostringstream oss;
+		oss << "x86-64";
+		if (level > 1)
+			oss << "-v" << level;
+		Nan::Set(build, Nan::New("cpuLevel").ToLocalChecked(), Nan::New(oss.str().c_str()).ToLocalChecked());
+	} else {
+		Nan::Set(build, Nan::New("cpuLevel").ToLocalChecked(), Nan::Null());
+	}
+
+	Local<Array> features = Nan::New<Array>();
+
+#ifdef CPU_FEATURES_X86
+	uint32_t index = 0;
+
+#define ADD_CPU_FEATURE(name) \
+		if (__builtin_cpu_supports(name)) \
+			Nan::Set(features, index++, Nan::New(name).ToLocalChecked())
+
+	ADD_CPU_FEATURE("sse4.2");
+	ADD_CPU_FEATURE("popcnt");
+	ADD_CPU_FEATURE("avx");
+	ADD_CPU_FEATURE("avx2");
+	ADD_CPU_FEATURE("bmi2");
+	ADD_CPU_FEATURE("avx512f");
+	ADD_CPU_FEATURE("avx512bw");
+
+#undef ADD_CPU_FEATURE
+#endif
+
+	Nan::Set(build, Nan::New("cpuFeatures").ToLocalChecked(), features);
+
+	Nan::Set(build, Nan::New("numaNodes").ToLocalChecked(), Nan::New<Number>((double) node_cpus.size()));
+
+	info.GetReturnValue().Set(build);
+}
 
 class AsyncInitialize : public Nan::AsyncWorker {
 public:
@@ -221,39 +784,331 @@ void ScannerWrap::Init(Local<Object> exports) {
 
 	Nan::SetPrototypeMethod(tpl, "configure", Configure);
 	Nan::SetPrototypeMethod(tpl, "scan", Scan);
+	Nan::SetPrototypeMethod(tpl, "memoryUsage", MemoryUsage);
+	Nan::SetPrototypeMethod(tpl, "destroy", Destroy);
+	Nan::SetPrototypeMethod(tpl, "watch", Watch);
+	Nan::SetPrototypeMethod(tpl, "unwatch", Unwatch);
+	Nan::SetPrototypeMethod(tpl, "rulesFingerprint", RulesFingerprint);
+	Nan::SetPrototypeMethod(tpl, "pauseStream", PauseStream);
+	Nan::SetPrototypeMethod(tpl, "resumeStream", ResumeStream);
+	Nan::SetPrototypeMethod(tpl, "abortStream", AbortStream);
 
 	ScannerWrap_constructor.Reset(tpl);
 	Nan::Set(exports, Nan::New("ScannerWrap").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
 }
 
-ScannerWrap::ScannerWrap() : compiler(NULL), rules(NULL) {
-	pthread_rwlock_init(&lock, NULL);
+/**
+ ** Advise the kernel to back each page of a rules arena with transparent huge
+ ** pages, and lock the pages in memory, as requested by placement.  Arenas
+ ** are allocated by libyara using malloc(), so only the huge page aligned
+ ** part of each is eligible for huge pages.  If locking fails the pages
+ ** already locked are unlocked again.
+ **/
+void placeRulesPages(YR_RULES* rules, const Placement& placement) {
+	for (YR_ARENA_PAGE* page = rules->arena->page_list_head;
+			page != NULL;
+			page = page->next) {
+#ifdef MADV_HUGEPAGE
+		if (placement.huge_pages) {
+			uintptr_t start = ((uintptr_t) page->address + huge_page_size - 1) & ~(huge_page_size - 1);
+			uintptr_t end = ((uintptr_t) page->address + page->size) & ~(huge_page_size - 1);
+
+			if (end > start)
+				madvise((void*) start, end - start, MADV_HUGEPAGE);
+		}
+#endif
+
+		if (placement.lock && mlock(page->address, page->size) != 0) {
+			int error = errno;
+
+			for (YR_ARENA_PAGE* locked = rules->arena->page_list_head;
+					locked != page;
+					locked = locked->next)
+				munlock(locked->address, locked->size);
+
+			yara_throw(YaraError, "mlock() failed: " << yara_strerror(error));
+		}
+	}
+}
+
+void unlockRulesPages(YR_RULES* rules) {
+	for (YR_ARENA_PAGE* page = rules->arena->page_list_head;
+			page != NULL;
+			page = page->next)
+		munlock(page->address, page->size);
 }
 
-ScannerWrap::~ScannerWrap() {
-	if (compiler) {
-		yr_compiler_destroy(compiler);
-		compiler = NULL;
+size_t appendStreamWrite(const void* ptr, size_t size, size_t count,
+		void* user_data) {
+	((std::string*) user_data)->append((const char*) ptr, size * count);
+	return count;
+}
+
+/**
+ ** Save rules into image.  libyara rewrites the arena in place while saving,
+ ** so this is only safe before the rules are published to scans.
+ **/
+void saveRulesImage(YR_RULES* rules, std::string* image) {
+	YR_STREAM stream;
+	stream.user_data = (void*) image;
+	stream.read = NULL;
+	stream.write = appendStreamWrite;
+
+	int rc = yr_rules_save_stream(rules, &stream);
+	if (rc != ERROR_SUCCESS)
+		yara_throw(YaraError, "yr_rules_save_stream() failed: "
+				<< getErrorString(rc));
+}
+
+std::string imageFingerprint(const std::string& image) {
+	Sha256 sha256;
+	uint8_t digest[SHA256_LENGTH];
+
+	sha256.update((const uint8_t*) image.data(), image.length());
+	sha256.final(digest);
+
+	return digestToHex(digest);
+}
+
+struct RulesImage {
+	const std::string* data;
+	size_t offset;
+};
+
+size_t imageStreamRead(void* ptr, size_t size, size_t count, void* user_data) {
+	RulesImage* image = (RulesImage*) user_data;
+
+	size_t available = (image->data->length() - image->offset) / size;
+	if (count > available)
+		count = available;
+
+	memcpy(ptr, image->data->data() + image->offset, size * count);
+	image->offset += size * count;
+
+	return count;
+}
+
+struct ReplicaArgs {
+	const std::string* image;
+	const Placement* placement;
+	YR_RULES* rules;
+	std::string error;
+};
+
+/**
+ ** Runs on a thread bound to the CPUs of one node, so that the arena libyara
+ ** allocates and fills while loading the rules is first touched, and so
+ ** placed, on that node.
+ **/
+void* loadReplica(void* param) {
+	ReplicaArgs* args = (ReplicaArgs*) param;
+
+	RulesImage image;
+	image.data = args->image;
+	image.offset = 0;
+
+	YR_STREAM stream;
+	stream.user_data = (void*) &image;
+	stream.read = imageStreamRead;
+	stream.write = NULL;
+
+	int rc = yr_rules_load_stream(&stream, &args->rules);
+	if (rc != ERROR_SUCCESS) {
+		args->rules = NULL;
+		args->error = std::string("yr_rules_load_stream() failed: ")
+				+ getErrorString(rc);
+		return NULL;
+	}
+
+	try {
+		placeRulesPages(args->rules, *args->placement);
+	} catch(std::exception& error) {
+		args->error = error.what();
+	}
+
+	return NULL;
+}
+
+/**
+ ** Replace the rules of a handle with one copy per NUMA node, each loaded
+ ** from the saved image of the rules on that node.  The copy for node 0 also
+ ** becomes the handles default rules.
+ **/
+void replicateRules(RulesHandle* handle, const Placement& placement,
+		const std::string& image) {
+	std::vector<ReplicaArgs> args(node_cpus.size());
+	std::vector<pthread_t> threads(node_cpus.size());
+	std::vector<bool> started(node_cpus.size(), false);
+
+	for (size_t node = 0; node < node_cpus.size(); node++) {
+		args[node].image = &image;
+		args[node].placement = &placement;
+		args[node].rules = NULL;
+
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+
+#ifdef __linux__
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (size_t i = 0; i < node_cpus[node].size(); i++)
+			CPU_SET(node_cpus[node][i], &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+#endif
+
+		// pthread_create() returns its error rather than setting errno
+		int rc = pthread_create(&threads[node], &attr, loadReplica, (void*) &args[node]);
+		if (rc == 0)
+			started[node] = true;
+		else
+			args[node].error = std::string("pthread_create() failed: ")
+					+ yara_strerror(rc);
+
+		pthread_attr_destroy(&attr);
+	}
+
+	std::string error;
+
+	for (size_t node = 0; node < node_cpus.size(); node++) {
+		if (started[node])
+			pthread_join(threads[node], NULL);
+
+		if (args[node].error.length() && ! error.length())
+			error = args[node].error;
+	}
+
+	if (error.length()) {
+		for (size_t node = 0; node < node_cpus.size(); node++) {
+			if (args[node].rules) {
+				if (placement.lock)
+					unlockRulesPages(args[node].rules);
+				yr_rules_destroy(args[node].rules);
+			}
+		}
+
+		yara_throw(YaraError, error);
+	}
+
+	yr_rules_destroy(handle->rules);
+
+	for (size_t node = 0; node < node_cpus.size(); node++)
+		handle->replicas.push_back(args[node].rules);
+
+	handle->rules = handle->replicas[0];
+}
+
+/**
+ ** Apply the placement requested for the scanner to newly compiled rules,
+ ** replicating them only when there is more than one node.
+ **/
+void placeRules(RulesHandle* handle, const Placement& placement,
+		const std::string& image) {
+	if (placement.replicas && node_cpus.size() > 1) {
+		replicateRules(handle, placement, image);
+		handle->size *= handle->replicas.size();
+	} else {
+		placeRulesPages(handle->rules, placement);
+	}
+
+	handle->locked = placement.lock;
+}
+
+RulesHandle* acquireRules(RulesHandle* handle) {
+	if (handle)
+		handle->refs++;
+	return handle;
+}
+
+void releaseRules(RulesHandle* handle) {
+	if (handle && --handle->refs == 0) {
+		if (handle->replicas.size()) {
+			for (size_t node = 0; node < handle->replicas.size(); node++) {
+				if (handle->locked)
+					unlockRulesPages(handle->replicas[node]);
+				yr_rules_destroy(handle->replicas[node]);
+			}
+		} else {
+			if (handle->locked)
+				unlockRulesPages(handle->rules);
+			yr_rules_destroy(handle->rules);
+		}
+
+		delete handle;
 	}
+}
+
+/**
+ ** Releases a scanners reference to a generation of rules on a pool thread,
+ ** so that destroying large rules never blocks the event loop.
+ **/
+class AsyncReleaseRules : public Nan::AsyncWorker {
+public:
+	AsyncReleaseRules(RulesHandle* handle)
+			: Nan::AsyncWorker(NULL), handle_(handle) {}
+
+	~AsyncReleaseRules() {}
+
+	void Execute() {
+		releaseRules(handle_);
+	}
+
+protected:
+	void HandleOKCallback() {}
+
+private:
+	RulesHandle* handle_;
+};
 
-	if (rules) {
-		yr_rules_destroy(rules);
-		rules = NULL;
+void retireRules(RulesHandle* handle) {
+	if (handle)
+		Nan::AsyncQueueWorker(new AsyncReleaseRules(handle));
+}
+
+ScannerWrap::ScannerWrap() : rules(NULL), scan_bytes(0), destroyed(false),
+		watcher(NULL), reported_memory_(0) {}
+
+ScannerWrap::~ScannerWrap() {
+	if (watcher) {
+		delete watcher;
+		watcher = NULL;
 	}
 
-	pthread_rwlock_destroy(&lock);
+	// Scans keep the scanner alive, so this is the last reference
+	releaseRules(rules);
+	rules = NULL;
+
+	if (reported_memory_)
+		Nan::AdjustExternalMemory(-reported_memory_);
 }
 
-void ScannerWrap::lock_read(void) {
-	pthread_rwlock_rdlock(&lock);
+/**
+ ** Tell V8 how much memory outside of its heap this scanner is keeping alive,
+ ** i.e. compiled rules and the results of in-progress scans, so that garbage
+ ** collection takes it into account.  Must be called on the main thread.
+ **/
+void ScannerWrap::report_memory(void) {
+	int64_t memory = rules ? rules->size : 0;
+
+	memory += scan_bytes;
+
+	if (memory != reported_memory_) {
+		Nan::AdjustExternalMemory(memory - reported_memory_);
+		reported_memory_ = memory;
+	}
 }
 
-void ScannerWrap::lock_write(void) {
-	pthread_rwlock_wrlock(&lock);
+RulesHandle* ScannerWrap::acquire_rules(void) {
+	return acquireRules(rules);
 }
 
-void ScannerWrap::unlock(void) {
-	pthread_rwlock_unlock(&lock);
+/**
+ ** Replace the current generation of rules, returning the previous one, whose
+ ** reference the caller now owns.  Must be called on the main thread.
+ **/
+RulesHandle* ScannerWrap::swap_rules(RulesHandle* handle) {
+	RulesHandle* previous = rules;
+	rules = handle;
+	return previous;
 }
 
 NAN_METHOD(ScannerWrap::New) {
@@ -269,6 +1124,7 @@ NAN_METHOD(ScannerWrap::New) {
 struct RuleConfig {
 	bool isFile;
 	std::string source;
+	std::string content;
 	std::string ns;
 	uint32_t index;
 };
@@ -287,22 +1143,72 @@ class AsyncConfigure;
 struct CompileArgs {
 	RuleConfig* rule_config;
 	AsyncConfigure* configure;
+	bool precheck;
+	uint32_t error_count;
 };
 
 typedef std::list<RuleConfig*> RuleConfigList;
 typedef std::list<VarConfig*> VarConfigList;
 
-class AsyncConfigure : public Nan::AsyncWorker {
+enum ConfigurePhase {
+	LoadConfigurePhase     = 1,
+	PrecheckConfigurePhase = 2,
+	CompileConfigurePhase  = 3
+};
+
+struct ConfigureProgress {
+	ConfigurePhase phase;
+	uint32_t index;
+	uint32_t completed;
+	uint32_t total;
+};
+
+#define CONFIGURE_DEFAULT_CONCURRENCY 4
+#define CONFIGURE_MAX_CONCURRENCY 64
+
+// Inputs are checked against magics using only the first bytes read
+#define PREFILTER_MAX_MAGIC 64
+
+/**
+ ** Rule sources are loaded from disk, and optionally pre-checked by compiling
+ ** each one on its own in a throwaway compiler, using a number of threads.
+ ** libyara cannot merge compilers so the final compile is still sequential,
+ ** but scans continue using the previous rules until the new rules are
+ ** swapped in on the main thread.
+ **/
+class AsyncConfigure : public Nan::AsyncProgressQueueWorker<ConfigureProgress> {
 public:
 	AsyncConfigure(
 			ScannerWrap* scanner,
 			RuleConfigList* rule_configs,
 			VarConfigList* var_configs,
+			const std::string& compiled,
+			uint32_t concurrency,
+			bool precheck,
+			bool fail_fast,
+			bool keep_rules,
+			const Prefilter& prefilter,
+			const Placement& placement,
+			Nan::Callback* progress_callback,
 			Nan::Callback* callback
-		) : Nan::AsyncWorker(callback),
+		) : Nan::AsyncProgressQueueWorker<ConfigureProgress>(callback),
 				scanner_(scanner),
 				rule_configs_(rule_configs),
-				var_configs_(var_configs) {}
+				var_configs_(var_configs),
+				compiled_(compiled),
+				concurrency_(concurrency),
+				precheck_(precheck),
+				fail_fast_(fail_fast),
+				keep_rules_(keep_rules),
+				prefilter_(prefilter),
+				placement_(placement),
+				progress_callback_(progress_callback),
+				progress_(NULL),
+				rules_(NULL),
+				stop_(false),
+				completed_(0) {
+		pthread_mutex_init(&mutex_, NULL);
+	}
 
 	~AsyncConfigure() {
 		if (rule_configs_) {
@@ -336,144 +1242,138 @@ public:
 			delete var_configs_;
 			var_configs_ = NULL;
 		}
-	}
 
-	void Execute() {
-		scanner_->lock_write();
+		if (progress_callback_) {
+			delete progress_callback_;
+			progress_callback_ = NULL;
+		}
 
-		try {
-			if (scanner_->rules) {
-				yr_rules_destroy(scanner_->rules);
-				scanner_->rules = NULL;
-			}
+		releaseRules(rules_);
 
-			if (scanner_->compiler) {
-				yr_compiler_destroy(scanner_->compiler);
-				scanner_->compiler = NULL;
-			}
+		pthread_mutex_destroy(&mutex_);
+	}
 
-			CompileArgs compile_args;
-			compile_args.configure = this;
+	void Execute(const ExecutionProgress& progress) {
+		YR_COMPILER* compiler = NULL;
+		YR_RULES* rules = NULL;
 
-			int rc = yr_compiler_create(&scanner_->compiler);
-			if (rc != ERROR_SUCCESS)
-				yara_throw(YaraError, "yr_compiler_create() failed: "
-						<< getErrorString(rc));
-			yr_compiler_set_callback(scanner_->compiler, compileCallback,
-					(void*) &compile_args);
+		progress_ = &progress;
+		error_count = 0;
 
-			VarConfig* var_config;
-			VarConfigList::iterator var_configs_it;
+		try {
+			if (compiled_.length()) {
+				int rc = yr_rules_load(compiled_.c_str(), &rules);
+				if (rc != ERROR_SUCCESS)
+					yara_throw(YaraError, "yr_rules_load(" << compiled_
+							<< ") failed: " << getErrorString(rc));
+			} else {
+				prepareSources();
 
-			for (var_configs_it = var_configs_->begin();
-					var_configs_it != var_configs_->end();
-					var_configs_it++) {
-				var_config = *var_configs_it;
+				if (error_count == 0) {
+					compileSources(&compiler);
 
-				switch (var_config->type) {
-					case IntegerVarType:
-						rc = yr_compiler_define_integer_variable(
-								scanner_->compiler,
-								var_config->id.c_str(),
-								var_config->value_integer
-							);
-						if (rc != ERROR_SUCCESS)
-							yara_throw(YaraError, "yr_compiler_define_integer_variable() failed: "
-									<< getErrorString(rc));
-						break;
-					case FloatVarType:
-						rc = yr_compiler_define_float_variable(
-								scanner_->compiler,
-								var_config->id.c_str(),
-								var_config->value_float
-							);
-						if (rc != ERROR_SUCCESS)
-							yara_throw(YaraError, "yr_compiler_define_float_variable() failed: "
-									<< getErrorString(rc));
-						break;
-					case BooleanVarType:
-						rc = yr_compiler_define_boolean_variable(
-								scanner_->compiler,
-								var_config->id.c_str(),
-								var_config->value_boolean ? 1 : 0
-							);
-						if (rc != ERROR_SUCCESS)
-							yara_throw(YaraError, "yr_compiler_define_boolean_variable() failed: "
-									<< getErrorString(rc));
-						break;
-					case StringVarType:
-						rc = yr_compiler_define_string_variable(
-								scanner_->compiler,
-								var_config->id.c_str(),
-								var_config->value_string.c_str()
-							);
+					if (error_count == 0) {
+						int rc = yr_compiler_get_rules(compiler, &rules);
 						if (rc != ERROR_SUCCESS)
-							yara_throw(YaraError, "yr_compiler_define_string_variable() failed: "
+							yara_throw(YaraError, "yr_compiler_get_rules() failed: "
 									<< getErrorString(rc));
-						break;
-					default:
-						yara_throw(YaraError, "Unknown variable type: "
-								<< var_config->type);
-						break;
+					}
 				}
 			}
 
-			RuleConfig* rule_config;
-			RuleConfigList::iterator rule_configs_it;
-
-			error_count = 0;
-
-			for (rule_configs_it = rule_configs_->begin();
-					rule_configs_it != rule_configs_->end();
-					rule_configs_it++) {
-				rule_config = *rule_configs_it;
+			if (rules) {
+				rules_ = new RulesHandle();
+				rules_->rules = rules;
+				rules_->prefilter = prefilter_;
+				rules_->locked = false;
+				rules_->refs = 1;
 
-				compile_args.rule_config = rule_config;
+				// Saved once here, while no scan can be using the rules,
+				// which is the size of their arena
+				std::string image;
+				saveRulesImage(rules, &image);
 
-				if (rule_config->isFile) {
-					FILE *fp = fopen(rule_config->source.c_str(), "r");
-					if (! fp)
-						yara_throw(YaraError, "fopen(" << rule_config->source.c_str()
-								<< ") failed: " << yara_strerror(errno));
+				rules_->size = image.length();
+				rules_->fingerprint = imageFingerprint(image);
 
-					error_count += yr_compiler_add_file(
-							scanner_->compiler,
-							fp,
-							rule_config->ns.length()
-									? rule_config->ns.c_str()
-									: NULL,
-							rule_config->source.c_str()
-						);
+				placeRules(rules_, placement_, image);
 
-					fclose(fp);
-				} else {
-					error_count += yr_compiler_add_string(
-							scanner_->compiler,
-							rule_config->source.c_str(),
-							rule_config->ns.length()
-									? rule_config->ns.c_str()
-									: NULL
-						);
+				if (captureEnabled()) {
+					rules_->image.swap(image);
+					rules_->size += rules_->image.length();
 				}
 			}
-			
-			if (error_count == 0) {
-				rc = yr_compiler_get_rules(scanner_->compiler, &scanner_->rules);
-				if (rc != ERROR_SUCCESS)
-					yara_throw(YaraError, "yr_compiler_get_rules() failed: "
-							<< getErrorString(rc));
-			}
 		} catch(std::exception& error) {
 			SetErrorMessage(error.what());
+
+			// Rules which could not be placed as requested are not used
+			releaseRules(rules_);
+			rules_ = NULL;
+		}
+
+		// Compiled rules do not reference the compiler which created them
+		if (compiler)
+			yr_compiler_destroy(compiler);
+
+		progress_ = NULL;
+	}
+
+	void HandleProgressCallback(const ConfigureProgress* data, size_t count) {
+		if (! progress_callback_)
+			return;
+
+		Nan::HandleScope scope;
+
+		for (size_t i = 0; i < count; i++) {
+			Local<Object> progress = Nan::New<Object>();
+
+			const char* phase = data[i].phase == LoadConfigurePhase
+					? "load"
+					: (data[i].phase == PrecheckConfigurePhase
+							? "precheck"
+							: "compile");
+
+			Nan::Set(progress, Nan::New("phase").ToLocalChecked(), Nan::New(phase).ToLocalChecked());
+			Nan::Set(progress, Nan::New("index").ToLocalChecked(), Nan::New<Number>(data[i].index));
+			Nan::Set(progress, Nan::New("completed").ToLocalChecked(), Nan::New<Number>(data[i].completed));
+			Nan::Set(progress, Nan::New("total").ToLocalChecked(), Nan::New<Number>(data[i].total));
+
+			Local<Value> argv[1];
+			argv[0] = progress;
+			progress_callback_->Call(1, argv, async_resource);
 		}
+	}
+
+	void addMessage(int error_level, const std::string& message) {
+		pthread_mutex_lock(&mutex_);
 
-		scanner_->unlock();
+		if (error_level == YARA_ERROR_LEVEL_WARNING)
+			warnings.push_back(message);
+		else
+			errors.push_back(message);
+
+		pthread_mutex_unlock(&mutex_);
 	}
 
 	uint32_t error_count;
 	std::list<std::string> errors;
 	std::list<std::string> warnings;
 
+	void WorkComplete() {
+		// New rules are swapped in on the main thread, where scans acquire
+		// them, and are only ever NULL here if configuration failed
+		if (! scanner_->destroyed && (rules_ || ! keep_rules_))
+			retireRules(scanner_->swap_rules(rules_));
+		else
+			retireRules(rules_);
+
+		rules_ = NULL;
+
+		scanner_->report_memory();
+
+		Nan::AsyncProgressQueueWorker<ConfigureProgress>::WorkComplete();
+	}
+
 protected:
 
 	void HandleOKCallback() {
@@ -517,9 +1417,353 @@ protected:
 	}
 
 private:
+	static void* prepareThread(void* data) {
+		((AsyncConfigure*) data)->prepareLoop();
+		return NULL;
+	}
+
+	/**
+	 ** Load file sources into memory, and pre-check all sources if requested,
+	 ** using up to concurrency_ threads, including this one.
+	 **/
+	void prepareSources(void) {
+		uint32_t sources = 0;
+
+		for (RuleConfigList::iterator rule_configs_it = rule_configs_->begin();
+				rule_configs_it != rule_configs_->end();
+				rule_configs_it++) {
+			if (precheck_ || (*rule_configs_it)->isFile)
+				sources++;
+		}
+
+		if (sources == 0)
+			return;
+
+		// Report bad variables once, rather than once for every source
+		if (precheck_)
+			checkVariables();
+
+		next_ = rule_configs_->begin();
+		completed_ = 0;
+		total_ = sources;
+
+		uint32_t threads = concurrency_ < sources ? concurrency_ : sources;
+		std::list<pthread_t> workers;
+
+		for (uint32_t i = 1; i < threads; i++) {
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, prepareThread, (void*) this) != 0)
+				break;
+			workers.push_back(thread);
+		}
+
+		prepareLoop();
+
+		for (std::list<pthread_t>::iterator workers_it = workers.begin();
+				workers_it != workers.end();
+				workers_it++)
+			pthread_join(*workers_it, NULL);
+
+		if (load_error_.length())
+			throw YaraError(load_error_.c_str());
+
+		if (precheck_ && errors.size()) {
+			error_count = errors.size();
+			errors.sort(compareMessages);
+		}
+	}
+
+	void prepareLoop(void) {
+		while (true) {
+			RuleConfig* rule_config = NULL;
+
+			pthread_mutex_lock(&mutex_);
+
+			while (! stop_ && next_ != rule_configs_->end() && ! rule_config) {
+				if (precheck_ || (*next_)->isFile)
+					rule_config = *next_;
+				next_++;
+			}
+
+			pthread_mutex_unlock(&mutex_);
+
+			if (! rule_config)
+				break;
+
+			ConfigurePhase phase = LoadConfigurePhase;
+
+			if (rule_config->isFile && ! loadSource(rule_config))
+				continue;
+
+			if (precheck_) {
+				phase = PrecheckConfigurePhase;
+
+				if (precheckSource(rule_config) > 0 && fail_fast_) {
+					pthread_mutex_lock(&mutex_);
+					stop_ = true;
+					pthread_mutex_unlock(&mutex_);
+				}
+			}
+
+			sendProgress(phase, rule_config->index, ++completed_, total_);
+		}
+	}
+
+	bool loadSource(RuleConfig* rule_config) {
+		FILE *fp = fopen(rule_config->source.c_str(), "r");
+
+		if (! fp) {
+			std::ostringstream oss;
+			oss << "fopen(" << rule_config->source.c_str() << ") failed: "
+					<< yara_strerror(errno);
+
+			pthread_mutex_lock(&mutex_);
+
+			// Report the same file a sequential load would have failed on
+			if (! load_error_.length() || rule_config->index < load_error_index_) {
+				load_error_ = oss.str();
+				load_error_index_ = rule_config->index;
+			}
+
+			stop_ = true;
+
+			pthread_mutex_unlock(&mutex_);
+
+			return false;
+		}
+
+		char data[65536];
+		size_t count;
+
+		while ((count = fread(data, 1, sizeof(data), fp)) > 0)
+			rule_config->content.append(data, count);
+
+		fclose(fp);
+
+		return true;
+	}
+
+	uint32_t precheckSource(RuleConfig* rule_config) {
+		YR_COMPILER* compiler = NULL;
+
+		CompileArgs compile_args;
+		compile_args.rule_config = rule_config;
+		compile_args.configure = this;
+		compile_args.precheck = true;
+		compile_args.error_count = 0;
+
+		int rc = yr_compiler_create(&compiler);
+		if (rc != ERROR_SUCCESS) {
+			std::ostringstream oss;
+			oss << rule_config->index << ":0:yr_compiler_create() failed: "
+					<< getErrorString(rc);
+			addMessage(YARA_ERROR_LEVEL_ERROR, oss.str());
+			return 1;
+		}
+
+		yr_compiler_set_callback(compiler, compileCallback,
+				(void*) &compile_args);
+
+		try {
+			defineVariables(compiler);
+			addSource(compiler, rule_config);
+		} catch(std::exception& error) {
+			std::ostringstream oss;
+			oss << rule_config->index << ":0:" << error.what();
+			addMessage(YARA_ERROR_LEVEL_ERROR, oss.str());
+			compile_args.error_count++;
+		}
+
+		yr_compiler_destroy(compiler);
+
+		return compile_args.error_count;
+	}
+
+	void checkVariables(void) {
+		YR_COMPILER* compiler = NULL;
+
+		int rc = yr_compiler_create(&compiler);
+		if (rc != ERROR_SUCCESS)
+			yara_throw(YaraError, "yr_compiler_create() failed: "
+					<< getErrorString(rc));
+
+		try {
+			defineVariables(compiler);
+		} catch(std::exception& error) {
+			yr_compiler_destroy(compiler);
+			throw;
+		}
+
+		yr_compiler_destroy(compiler);
+	}
+
+	void compileSources(YR_COMPILER** compiler) {
+		CompileArgs compile_args;
+		compile_args.configure = this;
+		compile_args.precheck = false;
+		compile_args.error_count = 0;
+
+		int rc = yr_compiler_create(compiler);
+		if (rc != ERROR_SUCCESS)
+			yara_throw(YaraError, "yr_compiler_create() failed: "
+					<< getErrorString(rc));
+		yr_compiler_set_callback(*compiler, compileCallback,
+				(void*) &compile_args);
+
+		defineVariables(*compiler);
+
+		RuleConfig* rule_config;
+		RuleConfigList::iterator rule_configs_it;
+		uint32_t completed = 0;
+
+		for (rule_configs_it = rule_configs_->begin();
+				rule_configs_it != rule_configs_->end();
+				rule_configs_it++) {
+			rule_config = *rule_configs_it;
+
+			compile_args.rule_config = rule_config;
+
+			error_count += addSource(*compiler, rule_config);
+
+			sendProgress(CompileConfigurePhase, rule_config->index, ++completed,
+					rule_configs_->size());
+
+			if (error_count > 0 && fail_fast_)
+				break;
+		}
+	}
+
+	int addSource(YR_COMPILER* compiler, RuleConfig* rule_config) {
+		const char* ns = rule_config->ns.length()
+				? rule_config->ns.c_str()
+				: NULL;
+
+		if (! rule_config->isFile)
+			return yr_compiler_add_string(compiler, rule_config->source.c_str(), ns);
+
+		if (! rule_config->content.length())
+			return yr_compiler_add_string(compiler, "", ns);
+
+		// The file name is still needed to resolve includes
+		FILE *fp = fmemopen((void*) rule_config->content.data(),
+				rule_config->content.length(), "r");
+		if (! fp)
+			yara_throw(YaraError, "fmemopen(" << rule_config->source.c_str()
+					<< ") failed: " << yara_strerror(errno));
+
+		int count = yr_compiler_add_file(compiler, fp, ns,
+				rule_config->source.c_str());
+
+		fclose(fp);
+
+		return count;
+	}
+
+	void defineVariables(YR_COMPILER* compiler) {
+		VarConfig* var_config;
+		VarConfigList::iterator var_configs_it;
+		int rc;
+
+		for (var_configs_it = var_configs_->begin();
+				var_configs_it != var_configs_->end();
+				var_configs_it++) {
+			var_config = *var_configs_it;
+
+			switch (var_config->type) {
+				case IntegerVarType:
+					rc = yr_compiler_define_integer_variable(
+							compiler,
+							var_config->id.c_str(),
+							var_config->value_integer
+						);
+					if (rc != ERROR_SUCCESS)
+						yara_throw(YaraError, "yr_compiler_define_integer_variable() failed: "
+								<< getErrorString(rc));
+					break;
+				case FloatVarType:
+					rc = yr_compiler_define_float_variable(
+							compiler,
+							var_config->id.c_str(),
+							var_config->value_float
+						);
+					if (rc != ERROR_SUCCESS)
+						yara_throw(YaraError, "yr_compiler_define_float_variable() failed: "
+								<< getErrorString(rc));
+					break;
+				case BooleanVarType:
+					rc = yr_compiler_define_boolean_variable(
+							compiler,
+							var_config->id.c_str(),
+							var_config->value_boolean ? 1 : 0
+						);
+					if (rc != ERROR_SUCCESS)
+						yara_throw(YaraError, "yr_compiler_define_boolean_variable() failed: "
+								<< getErrorString(rc));
+					break;
+				case StringVarType:
+					rc = yr_compiler_define_string_variable(
+							compiler,
+							var_config->id.c_str(),
+							var_config->value_string.c_str()
+						);
+					if (rc != ERROR_SUCCESS)
+						yara_throw(YaraError, "yr_compiler_define_string_variable() failed: "
+								<< getErrorString(rc));
+					break;
+				default:
+					yara_throw(YaraError, "Unknown variable type: "
+							<< var_config->type);
+					break;
+			}
+		}
+	}
+
+	void sendProgress(ConfigurePhase phase, uint32_t index, uint32_t completed,
+			uint32_t total) {
+		if (! progress_callback_ || ! progress_)
+			return;
+
+		ConfigureProgress progress;
+		progress.phase = phase;
+		progress.index = index;
+		progress.completed = completed;
+		progress.total = total;
+
+		progress_->Send(&progress, 1);
+	}
+
+	static bool compareMessages(const std::string& a, const std::string& b) {
+		return strtoul(a.c_str(), NULL, 10) < strtoul(b.c_str(), NULL, 10);
+	}
+
 	ScannerWrap* scanner_;
 	RuleConfigList* rule_configs_;
 	VarConfigList* var_configs_;
+
+	// Saved rules to load instead of compiling rule_configs_
+	std::string compiled_;
+
+	uint32_t concurrency_;
+	bool precheck_;
+	bool fail_fast_;
+	bool keep_rules_;
+
+	Prefilter prefilter_;
+	Placement placement_;
+
+	Nan::Callback* progress_callback_;
+	const ExecutionProgress* progress_;
+
+	// Compiled by Execute() and swapped in by WorkComplete()
+	RulesHandle* rules_;
+
+	pthread_mutex_t mutex_;
+	RuleConfigList::iterator next_;
+	bool stop_;
+	std::atomic<uint32_t> completed_;
+	uint32_t total_;
+	std::string load_error_;
+	uint32_t load_error_index_;
 };
 
 void compileCallback(int error_level, const char* file_name, int line_number,
@@ -529,10 +1773,14 @@ void compileCallback(int error_level, const char* file_name, int line_number,
 	std::ostringstream oss;
 	oss << args->rule_config->index << ":" << line_number << ":" << message;
 
-	if (error_level == YARA_ERROR_LEVEL_WARNING)
-		args->configure->warnings.push_back(oss.str());
-	else
-		args->configure->errors.push_back(oss.str());
+	if (error_level != YARA_ERROR_LEVEL_WARNING)
+		args->error_count++;
+
+	// Warnings are only reported by the full compile
+	if (args->precheck && error_level == YARA_ERROR_LEVEL_WARNING)
+		return;
+
+	args->configure->addMessage(error_level, oss.str());
 }
 
 NAN_METHOD(ScannerWrap::Configure) {
@@ -553,15 +1801,51 @@ NAN_METHOD(ScannerWrap::Configure) {
 		return;
 	}
 
-	Local<Object> options = Nan::To<Object>(info[0]).ToLocalChecked();
+	if (info.Length() > 2 && ! info[2]->IsFunction()) {
+		Nan::ThrowError("Progress callback argument must be a function");
+		return;
+	}
 
-	RuleConfigList* rule_configs = new RuleConfigList();
+	ScannerWrap* scanner = ScannerWrap::Unwrap<ScannerWrap>(info.This());
+
+	if (scanner->destroyed) {
+		Nan::ThrowError("Scanner has been destroyed");
+		return;
+	}
+
+	Local<Object> options = Nan::To<Object>(info[0]).ToLocalChecked();
 
 	Local<Array> rules = Local<Array>::Cast(
 			Nan::Get(options, Nan::New("rules").ToLocalChecked()).ToLocalChecked()
 		);
 
+	// Rules saved by libyara are loaded instead of compiled, so cannot be
+	// combined with sources or variables
+	std::string compiled;
+
 	for (uint32_t i = 0; i < rules->Length(); i++) {
+		if (Nan::Get(rules, i).ToLocalChecked()->IsObject()) {
+			Local<Object> rule = Nan::To<Object>(Nan::Get(rules, i).ToLocalChecked()).ToLocalChecked();
+
+			if (Nan::Get(rule, Nan::New("compiled").ToLocalChecked()).ToLocalChecked()->IsString())
+				compiled = *Nan::Utf8String(Nan::Get(rule, Nan::New("compiled").ToLocalChecked()).ToLocalChecked());
+		}
+	}
+
+	if (compiled.length() && rules->Length() > 1) {
+		Nan::ThrowError("Compiled rules must be the only rules item");
+		return;
+	}
+
+	if (compiled.length() && Nan::Get(options, Nan::New("variables").ToLocalChecked()).ToLocalChecked()->IsArray()
+			&& Local<Array>::Cast(Nan::Get(options, Nan::New("variables").ToLocalChecked()).ToLocalChecked())->Length() > 0) {
+		Nan::ThrowError("Variables cannot be defined for compiled rules");
+		return;
+	}
+
+	RuleConfigList* rule_configs = new RuleConfigList();
+
+	for (uint32_t i = 0; i < rules->Length() && ! compiled.length(); i++) {
 		if (Nan::Get(rules, i).ToLocalChecked()->IsObject()) {
 			Local<Object> rule = Nan::To<Object>(Nan::Get(rules, i).ToLocalChecked()).ToLocalChecked();
 
@@ -645,211 +1929,4020 @@ NAN_METHOD(ScannerWrap::Configure) {
 		}
 	}
 
+	uint32_t concurrency = CONFIGURE_DEFAULT_CONCURRENCY;
+	bool precheck = false;
+	bool fail_fast = false;
+	bool keep_rules = false;
+
+	if (Nan::Get(options, Nan::New("concurrency").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(options, Nan::New("concurrency").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() < 1 || n->Value() > CONFIGURE_MAX_CONCURRENCY) {
+			Nan::ThrowError("Concurrency is out of bounds");
+			return;
+		} else {
+			concurrency = n->Value();
+		}
+	}
+
+	if (Nan::Get(options, Nan::New("precheck").ToLocalChecked()).ToLocalChecked()->IsBoolean())
+		precheck = Nan::To<Boolean>(Nan::Get(options, Nan::New("precheck").ToLocalChecked()).ToLocalChecked()).ToLocalChecked()->Value();
+
+	if (Nan::Get(options, Nan::New("failFast").ToLocalChecked()).ToLocalChecked()->IsBoolean())
+		fail_fast = Nan::To<Boolean>(Nan::Get(options, Nan::New("failFast").ToLocalChecked()).ToLocalChecked()).ToLocalChecked()->Value();
+
+	if (Nan::Get(options, Nan::New("keepRulesOnError").ToLocalChecked()).ToLocalChecked()->IsBoolean())
+		keep_rules = Nan::To<Boolean>(Nan::Get(options, Nan::New("keepRulesOnError").ToLocalChecked()).ToLocalChecked()).ToLocalChecked()->Value();
+
+	Placement placement;
+	placement.huge_pages = false;
+	placement.lock = false;
+	placement.replicas = false;
+
+	if (Nan::Get(options, Nan::New("hugePages").ToLocalChecked()).ToLocalChecked()->IsBoolean())
+		placement.huge_pages = Nan::To<Boolean>(Nan::Get(options, Nan::New("hugePages").ToLocalChecked()).ToLocalChecked()).ToLocalChecked()->Value();
+
+	if (Nan::Get(options, Nan::New("lockRules").ToLocalChecked()).ToLocalChecked()->IsBoolean())
+		placement.lock = Nan::To<Boolean>(Nan::Get(options, Nan::New("lockRules").ToLocalChecked()).ToLocalChecked()).ToLocalChecked()->Value();
+
+	if (Nan::Get(options, Nan::New("numaReplicas").ToLocalChecked()).ToLocalChecked()->IsBoolean())
+		placement.replicas = Nan::To<Boolean>(Nan::Get(options, Nan::New("numaReplicas").ToLocalChecked()).ToLocalChecked()).ToLocalChecked()->Value();
+
+	Prefilter prefilter;
+	prefilter.min_size = -1;
+	prefilter.max_size = -1;
+	prefilter.max_magic = 0;
+
+	if (Nan::Get(options, Nan::New("prefilter").ToLocalChecked()).ToLocalChecked()->IsObject()) {
+		Local<Object> filter = Nan::To<Object>(Nan::Get(options, Nan::New("prefilter").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (Nan::Get(filter, Nan::New("minSize").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+			Local<Number> n = Nan::To<Number>(Nan::Get(filter, Nan::New("minSize").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+			if (n->Value() < 0) {
+				Nan::ThrowError("Prefilter minSize is out of bounds");
+				return;
+			} else {
+				prefilter.min_size = n->Value();
+			}
+		}
+
+		if (Nan::Get(filter, Nan::New("maxSize").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+			Local<Number> n = Nan::To<Number>(Nan::Get(filter, Nan::New("maxSize").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+			if (n->Value() < 0 || n->Value() < prefilter.min_size) {
+				Nan::ThrowError("Prefilter maxSize is out of bounds");
+				return;
+			} else {
+				prefilter.max_size = n->Value();
+			}
+		}
+
+		if (Nan::Get(filter, Nan::New("magic").ToLocalChecked()).ToLocalChecked()->IsArray()) {
+			Local<Array> magics = Local<Array>::Cast(Nan::Get(filter, Nan::New("magic").ToLocalChecked()).ToLocalChecked());
+
+			for (uint32_t i = 0; i < magics->Length(); i++) {
+				Local<Value> item = Nan::Get(magics, i).ToLocalChecked();
+				std::string magic;
+
+				if (node::Buffer::HasInstance(item)) {
+					magic.assign(node::Buffer::Data(item), node::Buffer::Length(item));
+				} else if (item->IsString()) {
+					magic = *Nan::Utf8String(item);
+				} else {
+					Nan::ThrowError("Prefilter magic items must be strings or Buffers");
+					return;
+				}
+
+				if (magic.length() < 1 || magic.length() > PREFILTER_MAX_MAGIC) {
+					Nan::ThrowError("Prefilter magic is out of bounds");
+					return;
+				}
+
+				if (magic.length() > prefilter.max_magic)
+					prefilter.max_magic = magic.length();
+
+				prefilter.magics.push_back(magic);
+			}
+		}
+	}
+
 	Nan::Callback* callback = new Nan::Callback(info[1].As<Function>());
 
-	ScannerWrap* scanner = ScannerWrap::Unwrap<ScannerWrap>(info.This());
+	Nan::Callback* progress_callback = NULL;
+	if (info.Length() > 2)
+		progress_callback = new Nan::Callback(info[2].As<Function>());
 
 	AsyncConfigure* async_configure = new AsyncConfigure(
 			scanner,
 			rule_configs,
 			var_configs,
+			compiled,
+			concurrency,
+			precheck,
+			fail_fast,
+			keep_rules,
+			prefilter,
+			placement,
+			progress_callback,
 			callback
 		);
 
+	// Keep the scanner alive until configuration has completed
+	async_configure->SaveToPersistent("scanner", info.This());
+
 	Nan::AsyncQueueWorker(async_configure);
 
 	info.GetReturnValue().Set(info.This());
 }
 
-struct ScanReq {
-	std::string filename;
-	const char* buffer;
-	int64_t offset;
-	int64_t length;
-	int32_t flags;
-	int32_t timeout;
-};
+NAN_METHOD(ScannerWrap::Watch) {
+	Nan::HandleScope scope;
 
-struct MatchData {
-	MatchData() {
-		bytes = NULL;
-		length = 0;
-	};
+	if (info.Length() < 3) {
+		Nan::ThrowError("Three arguments are required");
+		return;
+	}
 
-	bool copy(const uint8_t* data_bytes, uint32_t data_length) {
-		bytes = (uint8_t*) realloc((uint8_t*) bytes, data_length);
-		if (! bytes)
+	if (! info[0]->IsArray()) {
+		Nan::ThrowError("Filenames argument must be an array");
+		return;
+	}
+
+	if (! info[1]->IsNumber()) {
+		Nan::ThrowError("Debounce argument must be a number");
+		return;
+	}
+
+	if (! info[2]->IsFunction()) {
+		Nan::ThrowError("Callback argument must be a function");
+		return;
+	}
+
+	ScannerWrap* scanner = ScannerWrap::Unwrap<ScannerWrap>(info.This());
+
+	if (scanner->destroyed) {
+		Nan::ThrowError("Scanner has been destroyed");
+		return;
+	}
+
+	int64_t debounce_ms = Nan::To<Integer>(info[1]).ToLocalChecked()->Value();
+
+	if (debounce_ms < 0) {
+		Nan::ThrowError("Debounce cannot be negative");
+		return;
+	}
+
+	Local<Array> array = Local<Array>::Cast(info[0]);
+	std::list<std::string> filenames;
+
+	for (uint32_t i = 0; i < array->Length(); i++) {
+		Local<Value> value = Nan::Get(array, i).ToLocalChecked();
+		if (value->IsString())
+			filenames.push_back(*Nan::Utf8String(value));
+	}
+
+	if (scanner->watcher) {
+		delete scanner->watcher;
+		scanner->watcher = NULL;
+	}
+
+	RuleWatcher* watcher = new RuleWatcher(
+			new Nan::Callback(info[2].As<Function>()),
+			debounce_ms
+		);
+
+	try {
+		watcher->start(filenames);
+	} catch(std::exception& error) {
+		delete watcher;
+		Nan::ThrowError(error.what());
+		return;
+	}
+
+	scanner->watcher = watcher;
+
+	info.GetReturnValue().Set(info.This());
+}
+
+NAN_METHOD(ScannerWrap::Unwatch) {
+	Nan::HandleScope scope;
+
+	ScannerWrap* scanner = ScannerWrap::Unwrap<ScannerWrap>(info.This());
+
+	if (scanner->watcher) {
+		delete scanner->watcher;
+		scanner->watcher = NULL;
+	}
+
+	info.GetReturnValue().Set(info.This());
+}
+
+struct ScanBlock {
+	const char* buffer;
+	int64_t length;
+};
+
+typedef std::list<ScanBlock> ScanBlockList;
+
+typedef std::map<std::string, std::list<std::string> > ModuleDataMap;
+
+void jsonString(std::string& out, const char* data, size_t length) {
+	static const char* hex = "0123456789abcdef";
+
+	out += '"';
+
+	for (size_t i = 0; i < length; i++) {
+		unsigned char c = (unsigned char) data[i];
+
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20 || c > 0x7e) {
+			// Module strings are bytes, not UTF-8, so escape as Latin-1
+			out += "\\u00";
+			out += hex[c >> 4];
+			out += hex[c & 0xf];
+		} else {
+			out += c;
+		}
+	}
+
+	out += '"';
+}
+
+bool moduleObjectDefined(YR_OBJECT* object) {
+	switch (object->type) {
+		case OBJECT_TYPE_INTEGER:
+			return ! IS_UNDEFINED(yr_object_get_integer(object, NULL));
+		case OBJECT_TYPE_FLOAT:
+			return ! std::isnan(yr_object_get_float(object, NULL));
+		case OBJECT_TYPE_STRING:
+			return yr_object_get_string(object, NULL) != NULL;
+		case OBJECT_TYPE_STRUCTURE:
+		case OBJECT_TYPE_ARRAY:
+		case OBJECT_TYPE_DICTIONARY:
+			return true;
+		default:
 			return false;
-		memcpy((void*) bytes, (void*) data_bytes, data_length);
-		length = data_length;
-		return true;
 	}
+}
 
-	// We don't free bytes since we assume it is managed by a Buffer instance
-	~MatchData() {};
+/**
+ ** Serialise a module object, as populated by libyara when it parsed the
+ ** input, to JSON.  Undefined values are left out of structures and are null
+ ** in arrays and dictionaries, and functions are left out entirely.
+ **/
+void moduleObjectToJson(std::string& out, YR_OBJECT* object) {
+	if (! moduleObjectDefined(object)) {
+		out += "null";
+		return;
+	}
 
-	uint8_t* bytes;
-	uint32_t length;
+	switch (object->type) {
+		case OBJECT_TYPE_INTEGER: {
+			std::ostringstream oss;
+			oss << yr_object_get_integer(object, NULL);
+			out += oss.str();
+			break;
+		}
+		case OBJECT_TYPE_FLOAT: {
+			double value = yr_object_get_float(object, NULL);
+
+			// JSON has no representation for infinity
+			if (! std::isfinite(value)) {
+				out += "null";
+				break;
+			}
+
+			std::ostringstream oss;
+			oss.precision(17);
+			oss << value;
+			out += oss.str();
+			break;
+		}
+		case OBJECT_TYPE_STRING: {
+			SIZED_STRING* str = yr_object_get_string(object, NULL);
+			jsonString(out, str->c_string, str->length);
+			break;
+		}
+		case OBJECT_TYPE_STRUCTURE: {
+			YR_STRUCTURE_MEMBER* member = ((YR_OBJECT_STRUCTURE*) object)->members;
+			bool first = true;
+
+			out += '{';
+
+			for (; member; member = member->next) {
+				if (! moduleObjectDefined(member->object))
+					continue;
+
+				if (! first)
+					out += ',';
+				first = false;
+
+				jsonString(out, member->object->identifier,
+						strlen(member->object->identifier));
+				out += ':';
+				moduleObjectToJson(out, member->object);
+			}
+
+			out += '}';
+			break;
+		}
+		case OBJECT_TYPE_ARRAY: {
+			YR_ARRAY_ITEMS* items = ((YR_OBJECT_ARRAY*) object)->items;
+
+			out += '[';
+
+			for (int i = 0; items && i < items->count; i++) {
+				if (i)
+					out += ',';
+
+				if (items->objects[i])
+					moduleObjectToJson(out, items->objects[i]);
+				else
+					out += "null";
+			}
+
+			out += ']';
+			break;
+		}
+		case OBJECT_TYPE_DICTIONARY: {
+			YR_DICTIONARY_ITEMS* items = ((YR_OBJECT_DICTIONARY*) object)->items;
+
+			out += '{';
+
+			for (int i = 0; items && i < items->used; i++) {
+				if (i)
+					out += ',';
+
+				jsonString(out, items->objects[i].key, strlen(items->objects[i].key));
+				out += ':';
+				moduleObjectToJson(out, items->objects[i].obj);
+			}
+
+			out += '}';
+			break;
+		}
+	}
+}
+
+/**
+ ** Serialise the fields of a module object selected by a list of dotted
+ ** paths, e.g. "sections" or "version_info.CompanyName", or the whole module
+ ** if the list is empty.
+ **/
+std::string moduleDataToJson(YR_OBJECT* module, std::list<std::string>& fields) {
+	std::string out;
+
+	if (! fields.size()) {
+		moduleObjectToJson(out, module);
+		return out;
+	}
+
+	out += '{';
+
+	for (std::list<std::string>::iterator fields_it = fields.begin();
+			fields_it != fields.end();
+			fields_it++) {
+		YR_OBJECT* object = module;
+		std::istringstream path(*fields_it);
+		std::string name;
+
+		while (object && std::getline(path, name, '.')) {
+			if (object->type != OBJECT_TYPE_STRUCTURE) {
+				object = NULL;
+				break;
+			}
+
+			object = yr_object_lookup_field(object, name.c_str());
+		}
+
+		if (out.length() > 1)
+			out += ',';
+
+		jsonString(out, fields_it->c_str(), fields_it->length());
+		out += ':';
+
+		if (object)
+			moduleObjectToJson(out, object);
+		else
+			out += "null";
+	}
+
+	out += '}';
+
+	return out;
+}
+
+/**
+ ** Container formats which can be expanded, so that each member is scanned
+ ** as well as the container itself, and the limits which bound the work done
+ ** for any one request, protecting against decompression bombs.
+ **/
+#define EXPAND_GZIP 0x01
+#define EXPAND_TAR 0x02
+#define EXPAND_ZIP 0x04
+#define EXPAND_ALL (EXPAND_GZIP | EXPAND_TAR | EXPAND_ZIP)
+
+#define EXPAND_DEFAULT_MAX_DEPTH 4
+#define EXPAND_MAX_DEPTH 32
+#define EXPAND_DEFAULT_MAX_TOTAL_BYTES (256 * 1024 * 1024)
+#define EXPAND_DEFAULT_MAX_MEMBERS 1024
+
+struct ExpandReq {
+	uint32_t formats;
+	uint32_t max_depth;
+	int64_t max_total_bytes;
+	uint32_t max_members;
 };
 
-struct ScanRuleMatch {
-	std::string id;
-	std::list<std::string> tags;
-	std::list<std::string> metas;
-	std::list<std::string> matches;
-	std::list<MatchData*> datas;
+struct ScanReq {
+	std::string filename;
+	int64_t read_limit;
+	const char* buffer;
+	int64_t offset;
+	int64_t length;
+	ScanBlockList blocks;
+	int32_t pid;
+	uint64_t address;
+	uint64_t size;
+	int32_t flags;
+	int32_t timeout;
+	ModuleDataMap module_data;
+	ExpandReq expand;
 };
 
-typedef std::list<ScanRuleMatch*> ScanRuleMatchList;
+/**
+ ** Buffers used to hold file content which is read, instead of mapped, for
+ ** scanning are taken from, and returned to, this pool so they are reused
+ ** between scans instead of being allocated for each file.
+ **/
+#define BUFFER_POOL_GRANULE (64 * 1024)
+#define BUFFER_POOL_MAX_BUFFERS 128
+#define BUFFER_POOL_MAX_BUFFER_SIZE (16 * 1024 * 1024)
+#define BUFFER_POOL_MAX_BYTES (64 * 1024 * 1024)
+
+struct PoolBuffer {
+	uint8_t* data;
+	size_t capacity;
+};
 
-class AsyncScan : public Nan::AsyncWorker {
+class BufferPool {
 public:
-	AsyncScan(
-			ScannerWrap* scanner,
-			ScanReq* scan_req,
+	BufferPool() : pooled_bytes_(0) {
+		pthread_mutex_init(&mutex_, NULL);
+	}
+
+	~BufferPool() {
+		std::list<PoolBuffer>::iterator buffers_it;
+
+		for (buffers_it = buffers_.begin();
+				buffers_it != buffers_.end();
+				buffers_it++)
+			free(buffers_it->data);
+
+		buffers_.clear();
+
+		pthread_mutex_destroy(&mutex_);
+	}
+
+	bool get(size_t size, PoolBuffer* buffer) {
+		pthread_mutex_lock(&mutex_);
+
+		std::list<PoolBuffer>::iterator best = buffers_.end();
+		std::list<PoolBuffer>::iterator buffers_it;
+
+		for (buffers_it = buffers_.begin();
+				buffers_it != buffers_.end();
+				buffers_it++) {
+			if (buffers_it->capacity >= size) {
+				if (best == buffers_.end() || buffers_it->capacity < best->capacity)
+					best = buffers_it;
+			}
+		}
+
+		if (best != buffers_.end()) {
+			*buffer = *best;
+			pooled_bytes_ -= best->capacity;
+			buffers_.erase(best);
+			pthread_mutex_unlock(&mutex_);
+			return true;
+		}
+
+		pthread_mutex_unlock(&mutex_);
+
+		buffer->capacity = ((size / BUFFER_POOL_GRANULE) + 1) * BUFFER_POOL_GRANULE;
+		buffer->data = (uint8_t*) malloc(buffer->capacity);
+
+		return buffer->data ? true : false;
+	}
+
+	void put(PoolBuffer* buffer) {
+		if (buffer->capacity <= BUFFER_POOL_MAX_BUFFER_SIZE) {
+			pthread_mutex_lock(&mutex_);
+
+			if (buffers_.size() < BUFFER_POOL_MAX_BUFFERS
+					&& pooled_bytes_ + buffer->capacity <= BUFFER_POOL_MAX_BYTES) {
+				buffers_.push_back(*buffer);
+				pooled_bytes_ += buffer->capacity;
+				pthread_mutex_unlock(&mutex_);
+				return;
+			}
+
+			pthread_mutex_unlock(&mutex_);
+		}
+
+		free(buffer->data);
+	}
+
+	size_t pooled_bytes(void) {
+		pthread_mutex_lock(&mutex_);
+		size_t bytes = pooled_bytes_;
+		pthread_mutex_unlock(&mutex_);
+		return bytes;
+	}
+
+private:
+	pthread_mutex_t mutex_;
+	std::list<PoolBuffer> buffers_;
+	size_t pooled_bytes_;
+};
+
+BufferPool buffer_pool;
+
+#define ALLOWLIST_MAGIC "YARAALW1"
+#define ALLOWLIST_HEADER_SIZE 16
+
+// Files are hashed in chunks of this size using pooled buffers
+#define ALLOWLIST_READ_SIZE (1024 * 1024)
+
+/**
+ ** A sorted array of SHA-256 digests, memory-mapped from a file written by
+ ** buildAllowlist(), and shared by all scanners.  Like rules, scans hold a
+ ** reference so a replaced allowlist is only unmapped once they complete.
+ **/
+struct Allowlist {
+	void* map;
+	size_t map_size;
+	const uint8_t* digests;
+	uint64_t count;
+	std::atomic<int32_t> refs;
+};
+
+// The current allowlist, only used on the main thread
+Allowlist* allowlist = NULL;
+
+Allowlist* acquireAllowlist(void) {
+	if (allowlist)
+		allowlist->refs++;
+	return allowlist;
+}
+
+void releaseAllowlist(Allowlist* list) {
+	if (list && --list->refs == 0) {
+		munmap(list->map, list->map_size);
+		delete list;
+	}
+}
+
+bool allowlistContains(Allowlist* list, const uint8_t* digest) {
+	uint64_t low = 0;
+	uint64_t high = list->count;
+
+	while (low < high) {
+		uint64_t middle = low + ((high - low) / 2);
+		int rc = memcmp(list->digests + (middle * SHA256_LENGTH), digest,
+				SHA256_LENGTH);
+
+		if (rc == 0)
+			return true;
+		else if (rc < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return false;
+}
+
+struct AllowlistDigest {
+	uint8_t bytes[SHA256_LENGTH];
+
+	bool operator<(const AllowlistDigest& other) const {
+		return memcmp(bytes, other.bytes, SHA256_LENGTH) < 0;
+	}
+
+	bool operator==(const AllowlistDigest& other) const {
+		return memcmp(bytes, other.bytes, SHA256_LENGTH) == 0;
+	}
+};
+
+int hexValue(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+std::string digestToHex(const uint8_t* digest) {
+	static const char* hex = "0123456789abcdef";
+	std::string str;
+
+	for (int i = 0; i < SHA256_LENGTH; i++) {
+		str += hex[digest[i] >> 4];
+		str += hex[digest[i] & 0xf];
+	}
+
+	return str;
+}
+
+class AsyncBuildAllowlist : public Nan::AsyncWorker {
+public:
+	AsyncBuildAllowlist(
+			std::string input,
+			std::string output,
 			Nan::Callback* callback
 		) : Nan::AsyncWorker(callback),
-				scanner_(scanner),
-				scan_req_(scan_req) {
-		matched_bytes = 0;
+				input_(input),
+				output_(output),
+				count_(0) {}
+
+	~AsyncBuildAllowlist() {}
+
+	/**
+	 ** Each line of the input starts with a digest in hex, so the output of
+	 ** sha256sum can be used as is, blank lines and lines starting with # are
+	 ** ignored.
+	 **/
+	void Execute() {
+		FILE* input = NULL;
+		FILE* output = NULL;
+		char* line = NULL;
+		size_t line_size = 0;
+
+		try {
+			input = fopen(input_.c_str(), "r");
+			if (! input)
+				yara_throw(YaraError, "fopen(" << input_.c_str() << ") failed: "
+						<< yara_strerror(errno));
+
+			std::vector<AllowlistDigest> digests;
+			uint64_t line_number = 0;
+
+			while (getline(&line, &line_size, input) >= 0) {
+				line_number++;
+
+				if (line[0] == '#' || line[0] == '\n' || line[0] == '\r' || ! line[0])
+					continue;
+
+				AllowlistDigest digest;
+
+				for (int i = 0; i < SHA256_LENGTH; i++) {
+					int high = hexValue(line[i * 2]);
+					int low = high < 0 ? -1 : hexValue(line[(i * 2) + 1]);
+
+					if (high < 0 || low < 0)
+						yara_throw(YaraError, "Invalid SHA-256 digest on line "
+								<< line_number << " of " << input_.c_str());
+
+					digest.bytes[i] = (high << 4) | low;
+				}
+
+				digests.push_back(digest);
+			}
+
+			std::sort(digests.begin(), digests.end());
+			digests.erase(std::unique(digests.begin(), digests.end()), digests.end());
+
+			count_ = digests.size();
+
+			output = fopen(output_.c_str(), "wb");
+			if (! output)
+				yara_throw(YaraError, "fopen(" << output_.c_str() << ") failed: "
+						<< yara_strerror(errno));
+
+			uint8_t header[ALLOWLIST_HEADER_SIZE];
+			memcpy(header, ALLOWLIST_MAGIC, 8);
+			for (int i = 0; i < 8; i++)
+				header[8 + i] = (uint8_t) (count_ >> (i * 8));
+
+			if (fwrite(header, sizeof(header), 1, output) != 1
+					|| (count_ && fwrite(&digests[0], sizeof(AllowlistDigest),
+							count_, output) != count_))
+				yara_throw(YaraError, "fwrite(" << output_.c_str() << ") failed: "
+						<< yara_strerror(errno));
+
+			int rc = fclose(output);
+			output = NULL;
+			if (rc != 0)
+				yara_throw(YaraError, "fclose(" << output_.c_str() << ") failed: "
+						<< yara_strerror(errno));
+		} catch(std::exception& error) {
+			SetErrorMessage(error.what());
+		}
+
+		free(line);
+
+		if (input)
+			fclose(input);
+		if (output)
+			fclose(output);
+	}
+
+protected:
+	void HandleOKCallback() {
+		Local<Value> argv[2];
+		argv[0] = Nan::Null();
+		argv[1] = Nan::New<Number>((double) count_);
+		callback->Call(2, argv, async_resource);
+	}
+
+private:
+	std::string input_;
+	std::string output_;
+	uint64_t count_;
+};
+
+class AsyncLoadAllowlist : public Nan::AsyncWorker {
+public:
+	AsyncLoadAllowlist(
+			std::string filename,
+			Nan::Callback* callback
+		) : Nan::AsyncWorker(callback),
+				filename_(filename),
+				list_(NULL) {}
+
+	~AsyncLoadAllowlist() {
+		releaseAllowlist(list_);
+	}
+
+	void Execute() {
+		int fd = open(filename_.c_str(), O_RDONLY);
+		if (fd < 0) {
+			std::ostringstream oss;
+			oss << "open(" << filename_.c_str() << ") failed: " << yara_strerror(errno);
+			SetErrorMessage(oss.str().c_str());
+			return;
+		}
+
+		try {
+			struct stat st;
+			if (fstat(fd, &st) < 0)
+				yara_throw(YaraError, "fstat(" << filename_.c_str() << ") failed: "
+						<< yara_strerror(errno));
+
+			if (st.st_size < ALLOWLIST_HEADER_SIZE)
+				yara_throw(YaraError, "Allowlist file is invalid");
+
+			void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED)
+				yara_throw(YaraError, "mmap(" << filename_.c_str() << ") failed: "
+						<< yara_strerror(errno));
+
+			list_ = new Allowlist();
+			list_->map = map;
+			list_->map_size = st.st_size;
+			list_->digests = (const uint8_t*) map + ALLOWLIST_HEADER_SIZE;
+			list_->refs = 1;
+
+			const uint8_t* header = (const uint8_t*) map;
+
+			list_->count = 0;
+			for (int i = 0; i < 8; i++)
+				list_->count |= ((uint64_t) header[8 + i]) << (i * 8);
+
+			// Check the count against the file before multiplying, so a
+			// crafted count cannot wrap round to the file size
+			uint64_t available = (uint64_t) (st.st_size - ALLOWLIST_HEADER_SIZE);
+
+			if (memcmp(header, ALLOWLIST_MAGIC, 8) != 0
+					|| list_->count > available / SHA256_LENGTH
+					|| available != list_->count * SHA256_LENGTH)
+				yara_throw(YaraError, "Allowlist file is invalid");
+
+			for (uint64_t i = 1; i < list_->count; i++) {
+				if (memcmp(list_->digests + ((i - 1) * SHA256_LENGTH),
+						list_->digests + (i * SHA256_LENGTH), SHA256_LENGTH) >= 0)
+					yara_throw(YaraError, "Allowlist file is not sorted");
+			}
+
+			// Lookups are binary searches, so read ahead would be wasted
+			madvise(map, st.st_size, MADV_RANDOM);
+		} catch(std::exception& error) {
+			releaseAllowlist(list_);
+			list_ = NULL;
+			SetErrorMessage(error.what());
+		}
+
+		close(fd);
+	}
+
+protected:
+	void HandleOKCallback() {
+		uint64_t count = list_->count;
+
+		releaseAllowlist(allowlist);
+		allowlist = list_;
+		list_ = NULL;
+
+		Local<Value> argv[2];
+		argv[0] = Nan::Null();
+		argv[1] = Nan::New<Number>((double) count);
+		callback->Call(2, argv, async_resource);
+	}
+
+private:
+	std::string filename_;
+	Allowlist* list_;
+};
+
+NAN_METHOD(BuildAllowlist) {
+	Nan::HandleScope scope;
+
+	if (info.Length() < 3) {
+		Nan::ThrowError("Three arguments are required");
+		return;
+	}
+
+	if (! info[0]->IsString() || ! info[1]->IsString()) {
+		Nan::ThrowError("Input and output arguments must be strings");
+		return;
+	}
+
+	if (! info[2]->IsFunction()) {
+		Nan::ThrowError("Callback argument must be a function");
+		return;
+	}
+
+	Nan::Callback* callback = new Nan::Callback(info[2].As<Function>());
+
+	AsyncBuildAllowlist* async_build = new AsyncBuildAllowlist(
+			*Nan::Utf8String(info[0]),
+			*Nan::Utf8String(info[1]),
+			callback
+		);
+
+	Nan::AsyncQueueWorker(async_build);
+}
+
+NAN_METHOD(LoadAllowlist) {
+	Nan::HandleScope scope;
+
+	if (info.Length() < 2) {
+		Nan::ThrowError("Two arguments are required");
+		return;
+	}
+
+	if (! info[0]->IsString()) {
+		Nan::ThrowError("Filename argument must be a string");
+		return;
+	}
+
+	if (! info[1]->IsFunction()) {
+		Nan::ThrowError("Callback argument must be a function");
+		return;
+	}
+
+	Nan::Callback* callback = new Nan::Callback(info[1].As<Function>());
+
+	AsyncLoadAllowlist* async_load = new AsyncLoadAllowlist(
+			*Nan::Utf8String(info[0]),
+			callback
+		);
+
+	Nan::AsyncQueueWorker(async_load);
+}
+
+NAN_METHOD(UnloadAllowlist) {
+	Nan::HandleScope scope;
+
+	releaseAllowlist(allowlist);
+	allowlist = NULL;
+}
+
+/**
+ ** Read up to size bytes at offset from fd into data, returning the number
+ ** of bytes read, which will be less than size if the file was truncated,
+ ** or -1.
+ **/
+ssize_t readFile(int fd, uint8_t* data, size_t size, off_t offset) {
+	size_t total = 0;
+
+	while (total < size) {
+		ssize_t rc = pread(fd, data + total, size - total, offset + total);
+
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		} else if (rc == 0) {
+			break;
+		}
+
+		total += rc;
+	}
+
+	return total;
+}
+
+void freeMappedFile(char* data, void* hint) {
+	munmap(data, (size_t) (uintptr_t) hint);
+}
+
+void freeReadFile(char* data, void* hint) {
+	free(data);
+}
+
+/**
+ ** Makes the content of a file available as a Buffer, so that it can be
+ ** scanned by several scanners while being read from disk only once.  Files
+ ** no larger than read_limit are read into memory, others are mapped, and
+ ** either is released when the Buffer is garbage collected.
+ **/
+class AsyncMapFile : public Nan::AsyncWorker {
+public:
+	AsyncMapFile(
+			std::string filename,
+			int64_t read_limit,
+			Nan::Callback* callback
+		) : Nan::AsyncWorker(callback),
+				filename_(filename),
+				read_limit_(read_limit),
+				data_(NULL),
+				length_(0),
+				mapped_(false) {}
+
+	~AsyncMapFile() {
+		// Only set if the Buffer was never created
+		if (data_) {
+			if (mapped_)
+				freeMappedFile(data_, (void*) (uintptr_t) length_);
+			else
+				freeReadFile(data_, NULL);
+		}
+	}
+
+	void Execute() {
+		int fd = open(filename_.c_str(), O_RDONLY);
+		if (fd < 0) {
+			std::ostringstream oss;
+			oss << "open(" << filename_.c_str() << ") failed: " << yara_strerror(errno);
+			SetErrorMessage(oss.str().c_str());
+			return;
+		}
+
+		try {
+			struct stat st;
+			if (fstat(fd, &st) < 0)
+				yara_throw(YaraError, "fstat(" << filename_.c_str() << ") failed: "
+						<< yara_strerror(errno));
+
+			if (! S_ISREG(st.st_mode))
+				yara_throw(YaraError, filename_.c_str() << " is not a regular file");
+
+			length_ = st.st_size;
+
+			if (length_ == 0 || length_ > node::Buffer::kMaxLength) {
+				// Nothing to map, or too large for a Buffer, the caller scans
+				// the file by name instead
+				length_ = 0;
+			} else if ((int64_t) length_ <= read_limit_) {
+				data_ = (char*) malloc(length_);
+				if (! data_)
+					yara_throw(YaraError, "malloc(" << length_ << ") failed");
+
+				ssize_t length = readFile(fd, (uint8_t*) data_, length_, 0);
+				if (length < 0)
+					yara_throw(YaraError, "read(" << filename_.c_str() << ") failed: "
+							<< yara_strerror(errno));
+
+				length_ = length;
+			} else {
+				void* map = mmap(NULL, length_, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (map == MAP_FAILED)
+					yara_throw(YaraError, "mmap(" << filename_.c_str() << ") failed: "
+							<< yara_strerror(errno));
+
+				data_ = (char*) map;
+				mapped_ = true;
+
+				// Every scanner reads the whole file, so fault it in once up front
+				madvise(map, length_, MADV_WILLNEED);
+			}
+		} catch(std::exception& error) {
+			SetErrorMessage(error.what());
+		}
+
+		close(fd);
+	}
+
+protected:
+	void HandleOKCallback() {
+		Local<Value> argv[2];
+		argv[0] = Nan::Null();
+
+		if (data_ && length_) {
+			argv[1] = Nan::NewBuffer(data_, length_,
+					mapped_ ? freeMappedFile : freeReadFile,
+					(void*) (uintptr_t) length_).ToLocalChecked();
+			data_ = NULL;
+		} else {
+			argv[1] = Nan::Null();
+		}
+
+		callback->Call(2, argv, async_resource);
+	}
+
+private:
+	std::string filename_;
+	int64_t read_limit_;
+	char* data_;
+	size_t length_;
+	bool mapped_;
+};
+
+NAN_METHOD(MapFile) {
+	Nan::HandleScope scope;
+
+	if (info.Length() < 3) {
+		Nan::ThrowError("Three arguments are required");
+		return;
+	}
+
+	if (! info[0]->IsString()) {
+		Nan::ThrowError("Filename argument must be a string");
+		return;
+	}
+
+	if (! info[1]->IsNumber() || Nan::To<Number>(info[1]).ToLocalChecked()->Value() < 0) {
+		Nan::ThrowError("Read limit cannot be negative");
+		return;
+	}
+
+	if (! info[2]->IsFunction()) {
+		Nan::ThrowError("Callback argument must be a function");
+		return;
+	}
+
+	Nan::Callback* callback = new Nan::Callback(info[2].As<Function>());
+
+	AsyncMapFile* async_map = new AsyncMapFile(
+			*Nan::Utf8String(info[0]),
+			Nan::To<Number>(info[1]).ToLocalChecked()->Value(),
+			callback
+		);
+
+	Nan::AsyncQueueWorker(async_map);
+}
+
+/**
+ ** Presents each item in a ScanBlockList to libyara as a memory block.  The
+ ** base of each block is the sum of the lengths of all blocks before it, plus
+ ** the base of the first block, so match offsets are absolute offsets into
+ ** the concatenated stream, or addresses when scanning process memory.
+ **/
+struct ScanBlockIterator {
+	YR_MEMORY_BLOCK_ITERATOR iterator;
+	YR_MEMORY_BLOCK block;
+	uint64_t base;
+	ScanBlockList* blocks;
+	ScanBlockList::iterator blocks_it;
+};
+
+const uint8_t* scanBlockFetchData(YR_MEMORY_BLOCK* block) {
+	return (const uint8_t*) block->context;
+}
+
+YR_MEMORY_BLOCK* scanBlockIteratorCurrent(ScanBlockIterator* scan_iterator) {
+	if (scan_iterator->blocks_it == scan_iterator->blocks->end())
+		return NULL;
+
+	scan_iterator->block.context = (void*) scan_iterator->blocks_it->buffer;
+	scan_iterator->block.size = scan_iterator->blocks_it->length;
+
+	return &scan_iterator->block;
+}
+
+YR_MEMORY_BLOCK* scanBlockIteratorFirst(YR_MEMORY_BLOCK_ITERATOR* iterator) {
+	ScanBlockIterator* scan_iterator = (ScanBlockIterator*) iterator->context;
+
+	scan_iterator->blocks_it = scan_iterator->blocks->begin();
+	scan_iterator->block.base = scan_iterator->base;
+
+	return scanBlockIteratorCurrent(scan_iterator);
+}
+
+YR_MEMORY_BLOCK* scanBlockIteratorNext(YR_MEMORY_BLOCK_ITERATOR* iterator) {
+	ScanBlockIterator* scan_iterator = (ScanBlockIterator*) iterator->context;
+
+	if (scan_iterator->blocks_it == scan_iterator->blocks->end())
+		return NULL;
+
+	scan_iterator->block.base += scan_iterator->blocks_it->length;
+	scan_iterator->blocks_it++;
+
+	return scanBlockIteratorCurrent(scan_iterator);
+}
+
+void scanBlockIteratorInit(ScanBlockIterator* scan_iterator,
+		ScanBlockList* blocks, uint64_t base) {
+	scan_iterator->base = base;
+	scan_iterator->blocks = blocks;
+	scan_iterator->blocks_it = blocks->begin();
+
+	scan_iterator->block.base = base;
+	scan_iterator->block.size = 0;
+	scan_iterator->block.context = NULL;
+	scan_iterator->block.fetch_data = scanBlockFetchData;
+
+	scan_iterator->iterator.context = (void*) scan_iterator;
+	scan_iterator->iterator.first = scanBlockIteratorFirst;
+	scan_iterator->iterator.next = scanBlockIteratorNext;
+}
+
+struct MatchData {
+	MatchData() {
+		bytes = NULL;
+		length = 0;
+	};
+
+	bool copy(const uint8_t* data_bytes, uint32_t data_length) {
+		bytes = (uint8_t*) realloc((uint8_t*) bytes, data_length);
+		if (! bytes)
+			return false;
+		memcpy((void*) bytes, (void*) data_bytes, data_length);
+		length = data_length;
+		return true;
+	}
+
+	// We don't free bytes since we assume it is managed by a Buffer instance
+	~MatchData() {};
+
+	uint8_t* bytes;
+	uint32_t length;
+};
+
+struct ScanRuleMatch {
+	std::string id;
+	std::list<std::string> tags;
+	std::list<std::string> metas;
+	std::list<std::string> matches;
+	std::list<MatchData*> datas;
+	std::list<std::string> truncated;
+};
+
+typedef std::list<ScanRuleMatch*> ScanRuleMatchList;
+
+#define STREAM_MAX_BATCHES 16
+
+class AsyncScan;
+
+// Scans streaming rules by id, so they can be paused, resumed and aborted,
+// only used on the main thread
+std::map<uint32_t, AsyncScan*> stream_scans;
+uint32_t next_stream_id = 1;
+
+void freeRuleMatches(ScanRuleMatchList* rule_matches) {
+	ScanRuleMatch* rule_match;
+	ScanRuleMatchList::iterator rule_matches_it;
+
+	MatchData* match_data;
+	std::list<MatchData*>::iterator match_data_it;
+
+	for (rule_matches_it = rule_matches->begin();
+			rule_matches_it != rule_matches->end();
+			rule_matches_it++) {
+		rule_match = *rule_matches_it;
+
+		for (match_data_it = rule_match->datas.begin();
+				match_data_it != rule_match->datas.end();
+				match_data_it++) {
+			match_data = *match_data_it;
+			delete match_data;
+		}
+
+		rule_match->datas.clear();
+
+		delete rule_match;
+	}
+
+	rule_matches->clear();
+}
+
+Local<Array> ruleMatchesToArray(ScanRuleMatchList* rule_matches) {
+	Local<Array> rules = Nan::New<Array>();
+	int rules_index = 0;
+
+	for (ScanRuleMatchList::iterator rule_matches_it = rule_matches->begin();
+			rule_matches_it != rule_matches->end();
+			rule_matches_it++) {
+		ScanRuleMatch* rule_match = *rule_matches_it;
+
+		Local<Object> rule = Nan::New<Object>();
+
+		Local<Array> tags = Nan::New<Array>();
+		int tags_index = 0;
+
+		for (std::list<std::string>::iterator tags_it = rule_match->tags.begin();
+				tags_it != rule_match->tags.end();
+				tags_it++) {
+			Local<String> tag = Nan::New((*tags_it).c_str()).ToLocalChecked();
+			Nan::Set(tags, tags_index++, tag);
+		}
+
+		Local<Array> metas = Nan::New<Array>();
+		int metas_index = 0;
+
+		for (std::list<std::string>::iterator metas_it = rule_match->metas.begin();
+				metas_it != rule_match->metas.end();
+				metas_it++) {
+			Local<String> meta = Nan::New((*metas_it).c_str()).ToLocalChecked();
+			Nan::Set(metas, metas_index++, meta);
+		}
+
+		Local<Array> matches = Nan::New<Array>();
+		int matches_index = 0;
+
+		for (std::list<std::string>::iterator matches_it = rule_match->matches.begin();
+				matches_it != rule_match->matches.end();
+				matches_it++) {
+			Local<String> match = Nan::New((*matches_it).c_str()).ToLocalChecked();
+			Nan::Set(matches, matches_index++, match);
+		}
+
+		Local<Array> datas = Nan::New<Array>();
+		int datas_index = 0;
+
+		for (std::list<MatchData*>::iterator datas_it = rule_match->datas.begin();
+				datas_it != rule_match->datas.end();
+				datas_it++) {
+			Local<Object> data = Nan::NewBuffer((char*) (*datas_it)->bytes, (*datas_it)->length).ToLocalChecked();
+			Nan::Set(datas, datas_index++, data);
+		}
+
+		Nan::Set(rule, Nan::New("id").ToLocalChecked(), Nan::New(rule_match->id.c_str()).ToLocalChecked());
+		Nan::Set(rule, Nan::New("tags").ToLocalChecked(), tags);
+		Nan::Set(rule, Nan::New("metas").ToLocalChecked(), metas);
+		Nan::Set(rule, Nan::New("matches").ToLocalChecked(), matches);
+		Nan::Set(rule, Nan::New("datas").ToLocalChecked(), datas);
+
+		if (rule_match->truncated.size()) {
+			Local<Array> truncated = Nan::New<Array>();
+			int truncated_index = 0;
+
+			for (std::list<std::string>::iterator truncated_it = rule_match->truncated.begin();
+					truncated_it != rule_match->truncated.end();
+					truncated_it++) {
+				Local<String> item = Nan::New((*truncated_it).c_str()).ToLocalChecked();
+				Nan::Set(truncated, truncated_index++, item);
+			}
+
+			Nan::Set(rule, Nan::New("truncated").ToLocalChecked(), truncated);
+		}
+
+		Nan::Set(rules, rules_index++, rule);
+	}
+
+	return rules;
+}
+
+Local<Object> moduleDatasToObject(std::map<std::string, std::string>* module_datas) {
+	Local<Object> modules = Nan::New<Object>();
+
+	for (std::map<std::string, std::string>::iterator module_datas_it = module_datas->begin();
+			module_datas_it != module_datas->end();
+			module_datas_it++) {
+		Nan::Set(modules, Nan::New(module_datas_it->first.c_str()).ToLocalChecked(),
+				Nan::New(module_datas_it->second.c_str()).ToLocalChecked());
+	}
+
+	return modules;
+}
+
+/**
+ ** One member of an expanded container, path is the path of the member within
+ ** the outermost container, with the names of nested containers separated by
+ ** slashes, and error is set when the member could not be scanned.  Module
+ ** data selected by the request is kept per member, as each is a separate
+ ** scan.
+ **/
+struct ScanMember {
+	std::string path;
+	std::string error;
+	ScanRuleMatchList rule_matches;
+	std::map<std::string, std::string> module_datas;
+};
+
+typedef std::list<ScanMember*> ScanMemberList;
+
+// Output buffers for inflated members start at this size when no size hint
+// is available, and double until the member fits
+#define EXPAND_INITIAL_BUFFER_SIZE (64 * 1024)
+
+uint16_t readLe16(const uint8_t* data) {
+	return data[0] | (data[1] << 8);
+}
+
+uint32_t readLe32(const uint8_t* data) {
+	return ((uint32_t) data[0]) | ((uint32_t) data[1] << 8)
+			| ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+uint64_t readLe64(const uint8_t* data) {
+	return ((uint64_t) readLe32(data + 4) << 32) | readLe32(data);
+}
+
+/**
+ ** Parse a numeric tar header field, either NUL or space terminated octal, or
+ ** the GNU base-256 encoding used for sizes too large for octal.  Returns -1
+ ** for negative base-256 values, and values which do not fit in an int64_t.
+ **/
+int64_t parseTarNumber(const uint8_t* field, size_t length) {
+	if (field[0] & 0x80) {
+		if (field[0] & 0x40)
+			return -1;
+
+		uint64_t value = field[0] & 0x3f;
+
+		for (size_t i = 1; i < length; i++) {
+			if (value > (INT64_MAX >> 8))
+				return -1;
+			value = (value << 8) | field[i];
+		}
+
+		return (int64_t) value;
+	}
+
+	int64_t value = 0;
+
+	for (size_t i = 0; i < length; i++) {
+		if (field[i] == ' ' && value == 0)
+			continue;
+		if (field[i] < '0' || field[i] > '7')
+			break;
+		value = (value * 8) + (field[i] - '0');
+	}
+
+	return value;
+}
+
+std::string tarString(const uint8_t* field, size_t length) {
+	return std::string((const char*) field, strnlen((const char*) field, length));
+}
+
+/**
+ ** Read the path and size records from a PAX extended header, each formatted
+ ** "<length> <keyword>=<value>\n", leaving path and size unchanged when they
+ ** are not present.  Parsing stops at the first malformed record.
+ **/
+void parsePaxHeader(const uint8_t* data, size_t length, std::string* path,
+		int64_t* size) {
+	size_t offset = 0;
+
+	while (offset < length) {
+		size_t record_length = 0;
+		size_t i = offset;
+
+		while (i < length && data[i] >= '0' && data[i] <= '9' && record_length < length)
+			record_length = (record_length * 10) + (data[i++] - '0');
+
+		if (i >= length || data[i] != ' ' || record_length == 0
+				|| record_length > length - offset
+				|| data[offset + record_length - 1] != '\n')
+			break;
+
+		std::string record((const char*) data + i + 1,
+				record_length - (i + 1 - offset) - 1);
+		size_t equals = record.find('=');
+
+		if (equals != std::string::npos) {
+			std::string keyword = record.substr(0, equals);
+			std::string value = record.substr(equals + 1);
+
+			if (keyword == "path") {
+				*path = value;
+			} else if (keyword == "size") {
+				char* end;
+				errno = 0;
+				long long parsed = strtoll(value.c_str(), &end, 10);
+				if (errno == 0 && *end == '\0' && end != value.c_str() && parsed >= 0)
+					*size = parsed;
+			}
+		}
+
+		offset += record_length;
+	}
+}
+
+std::string joinMemberPath(const std::string& parent, const std::string& name) {
+	return parent.length() ? parent + "/" + name : name;
+}
+
+/**
+ ** Results are encoded into one of these on the scanning thread when the
+ ** output request attribute is specified, so that the main thread only has to
+ ** wrap the encoded bytes in a Buffer.  Maps and arrays are given the number
+ ** of items they will hold up front since MessagePack requires it.
+ **/
+#define SCAN_OUTPUT_NONE 0
+#define SCAN_OUTPUT_NDJSON 1
+#define SCAN_OUTPUT_MSGPACK 2
+
+// Output starts at this size and doubles until the result fits
+#define SCAN_OUTPUT_INITIAL_SIZE (4 * 1024)
+
+class ResultEncoder {
+public:
+	ResultEncoder() : data_(NULL), length_(0), capacity_(0) {}
+
+	virtual ~ResultEncoder() {
+		if (data_)
+			free(data_);
+	}
+
+	virtual void beginMap(uint32_t count) = 0;
+	virtual void endMap(void) = 0;
+	virtual void beginArray(uint32_t count) = 0;
+	virtual void endArray(void) = 0;
+	virtual void key(const char* name) = 0;
+	virtual void string(const char* data, size_t length) = 0;
+	virtual void integer(int64_t value) = 0;
+	virtual void number(double value) = 0;
+	virtual void boolean(bool value) = 0;
+	virtual void null(void) = 0;
+	virtual void bytes(const uint8_t* data, size_t length) = 0;
+
+	// Module data is already JSON
+	virtual void json(const std::string& json) = 0;
+
+	virtual void finish(void) {}
+
+	void string(const std::string& str) {
+		string(str.c_str(), str.length());
+	}
+
+	size_t length(void) {
+		return length_;
+	}
+
+	// The caller becomes responsible for freeing the returned data
+	char* release(void) {
+		char* data = data_;
+		data_ = NULL;
+		length_ = capacity_ = 0;
+		return data;
+	}
+
+protected:
+	void append(const char* data, size_t length) {
+		if (length_ + length > capacity_) {
+			size_t capacity = capacity_ ? capacity_ : SCAN_OUTPUT_INITIAL_SIZE;
+			while (capacity < length_ + length)
+				capacity *= 2;
+
+			char* grown = (char*) realloc(data_, capacity);
+			if (! grown)
+				throw std::bad_alloc();
+
+			data_ = grown;
+			capacity_ = capacity;
+		}
+
+		memcpy(data_ + length_, data, length);
+		length_ += length;
+	}
+
+	void append(char c) {
+		append(&c, 1);
+	}
+
+	void append(const std::string& str) {
+		append(str.data(), str.length());
+	}
+
+private:
+	char* data_;
+	size_t length_;
+	size_t capacity_;
+};
+
+/**
+ ** Returns the length of the UTF-8 sequence at the start of data, or 0 if
+ ** it is not a valid sequence.
+ **/
+size_t utf8SequenceLength(const unsigned char* data, size_t length) {
+	size_t count;
+
+	if (data[0] < 0x80)
+		return 1;
+	else if (data[0] >= 0xc2 && data[0] <= 0xdf)
+		count = 2;
+	else if (data[0] >= 0xe0 && data[0] <= 0xef)
+		count = 3;
+	else if (data[0] >= 0xf0 && data[0] <= 0xf4)
+		count = 4;
+	else
+		return 0;
+
+	if (count > length)
+		return 0;
+
+	for (size_t i = 1; i < count; i++) {
+		if ((data[i] & 0xc0) != 0x80)
+			return 0;
+	}
+
+	// Overlong, surrogate and out of range sequences
+	if (data[0] == 0xe0 && data[1] < 0xa0)
+		return 0;
+	if (data[0] == 0xed && data[1] >= 0xa0)
+		return 0;
+	if (data[0] == 0xf0 && data[1] < 0x90)
+		return 0;
+	if (data[0] == 0xf4 && data[1] >= 0x90)
+		return 0;
+
+	return count;
+}
+
+class JsonEncoder : public ResultEncoder {
+public:
+	using ResultEncoder::string;
+
+	JsonEncoder() : after_key_(false) {}
+
+	void beginMap(uint32_t count) {
+		separate();
+		append('{');
+		first_.push_back(true);
+	}
+
+	void endMap(void) {
+		append('}');
+		first_.pop_back();
+	}
+
+	void beginArray(uint32_t count) {
+		separate();
+		append('[');
+		first_.push_back(true);
+	}
+
+	void endArray(void) {
+		append(']');
+		first_.pop_back();
+	}
+
+	void key(const char* name) {
+		separate();
+		text((const unsigned char*) name, strlen(name));
+		append(':');
+		after_key_ = true;
+	}
+
+	void string(const char* data, size_t length) {
+		separate();
+		text((const unsigned char*) data, length);
+	}
+
+	void integer(int64_t value) {
+		separate();
+
+		char str[32];
+		snprintf(str, sizeof(str), "%lld", (long long) value);
+		append(str, strlen(str));
+	}
+
+	void number(double value) {
+		separate();
+
+		char str[32];
+		snprintf(str, sizeof(str), "%.15g", value);
+		append(str, strlen(str));
+	}
+
+	void boolean(bool value) {
+		separate();
+		append(value ? "true" : "false", value ? 4 : 5);
+	}
+
+	void null(void) {
+		separate();
+		append("null", 4);
+	}
+
+	// Bytes are written as a string of hex digits
+	void bytes(const uint8_t* data, size_t length) {
+		static const char* hex = "0123456789abcdef";
+
+		separate();
+		append('"');
+
+		for (size_t i = 0; i < length; i++) {
+			append(hex[data[i] >> 4]);
+			append(hex[data[i] & 0xf]);
+		}
+
+		append('"');
+	}
+
+	void json(const std::string& json) {
+		separate();
+		append(json);
+	}
+
+	// Each result is one line
+	void finish(void) {
+		append('\n');
+	}
+
+private:
+	void separate(void) {
+		if (after_key_) {
+			after_key_ = false;
+		} else if (first_.size()) {
+			if (! first_.back())
+				append(',');
+			first_.back() = false;
+		}
+	}
+
+	/**
+	 ** Strings are written as UTF-8, as they would be decoded by V8, with
+	 ** invalid sequences replaced by U+FFFD.
+	 **/
+	void text(const unsigned char* data, size_t length) {
+		static const char* hex = "0123456789abcdef";
+
+		append('"');
+
+		size_t i = 0;
+
+		while (i < length) {
+			unsigned char c = data[i];
+
+			if (c == '"' || c == '\\') {
+				append('\\');
+				append((char) c);
+				i++;
+			} else if (c < 0x20) {
+				append("\\u00", 4);
+				append(hex[c >> 4]);
+				append(hex[c & 0xf]);
+				i++;
+			} else {
+				size_t count = utf8SequenceLength(data + i, length - i);
+
+				if (count) {
+					append((const char*) data + i, count);
+					i += count;
+				} else {
+					append("\xef\xbf\xbd", 3);
+					i++;
+				}
+			}
+		}
+
+		append('"');
+	}
+
+	std::vector<bool> first_;
+	bool after_key_;
+};
+
+class MsgpackEncoder : public ResultEncoder {
+public:
+	using ResultEncoder::string;
+
+	void beginMap(uint32_t count) {
+		if (count < 16) {
+			append((char) (0x80 | count));
+		} else if (count <= 0xffff) {
+			append((char) 0xde);
+			big(count, 2);
+		} else {
+			append((char) 0xdf);
+			big(count, 4);
+		}
+	}
+
+	void endMap(void) {}
+
+	void beginArray(uint32_t count) {
+		if (count < 16) {
+			append((char) (0x90 | count));
+		} else if (count <= 0xffff) {
+			append((char) 0xdc);
+			big(count, 2);
+		} else {
+			append((char) 0xdd);
+			big(count, 4);
+		}
+	}
+
+	void endArray(void) {}
+
+	void key(const char* name) {
+		string(name, strlen(name));
+	}
+
+	void string(const char* data, size_t length) {
+		if (length < 32) {
+			append((char) (0xa0 | length));
+		} else if (length <= 0xff) {
+			append((char) 0xd9);
+			big(length, 1);
+		} else if (length <= 0xffff) {
+			append((char) 0xda);
+			big(length, 2);
+		} else {
+			append((char) 0xdb);
+			big(length, 4);
+		}
+
+		append(data, length);
+	}
+
+	void integer(int64_t value) {
+		if (value >= 0) {
+			if (value < 0x80) {
+				append((char) value);
+			} else if (value <= 0xff) {
+				append((char) 0xcc);
+				big(value, 1);
+			} else if (value <= 0xffff) {
+				append((char) 0xcd);
+				big(value, 2);
+			} else if (value <= 0xffffffffLL) {
+				append((char) 0xce);
+				big(value, 4);
+			} else {
+				append((char) 0xcf);
+				big(value, 8);
+			}
+		} else {
+			if (value >= -32) {
+				append((char) value);
+			} else if (value >= -128) {
+				append((char) 0xd0);
+				big(value, 1);
+			} else if (value >= -32768) {
+				append((char) 0xd1);
+				big(value, 2);
+			} else if (value >= -2147483648LL) {
+				append((char) 0xd2);
+				big(value, 4);
+			} else {
+				append((char) 0xd3);
+				big(value, 8);
+			}
+		}
+	}
+
+	void number(double value) {
+		uint64_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+
+		append((char) 0xcb);
+		big(bits, 8);
+	}
+
+	void boolean(bool value) {
+		append((char) (value ? 0xc3 : 0xc2));
+	}
+
+	void null(void) {
+		append((char) 0xc0);
+	}
+
+	void bytes(const uint8_t* data, size_t length) {
+		if (length <= 0xff) {
+			append((char) 0xc4);
+			big(length, 1);
+		} else if (length <= 0xffff) {
+			append((char) 0xc5);
+			big(length, 2);
+		} else {
+			append((char) 0xc6);
+			big(length, 4);
+		}
+
+		append((const char*) data, length);
+	}
+
+	// Module data is written as a string holding its JSON
+	void json(const std::string& json) {
+		string(json.data(), json.length());
+	}
+
+private:
+	void big(uint64_t value, int count) {
+		for (int i = count - 1; i >= 0; i--)
+			append((char) ((value >> (i * 8)) & 0xff));
+	}
+};
+
+void freeMatchBytes(ScanRuleMatchList* rule_matches) {
+	for (ScanRuleMatchList::iterator rule_matches_it = rule_matches->begin();
+			rule_matches_it != rule_matches->end();
+			rule_matches_it++) {
+		for (std::list<MatchData*>::iterator datas_it = (*rule_matches_it)->datas.begin();
+				datas_it != (*rule_matches_it)->datas.end();
+				datas_it++) {
+			free((*datas_it)->bytes);
+			(*datas_it)->bytes = NULL;
+		}
+	}
+}
+
+/**
+ ** Encode matching rules as they are returned by scanner.scan(), parsing the
+ ** strings built by scanCallback() as index.js would.
+ **/
+void encodeRuleMatches(ResultEncoder* encoder, ScanRuleMatchList* rule_matches) {
+	encoder->beginArray(rule_matches->size());
+
+	for (ScanRuleMatchList::iterator rule_matches_it = rule_matches->begin();
+			rule_matches_it != rule_matches->end();
+			rule_matches_it++) {
+		ScanRuleMatch* rule_match = *rule_matches_it;
+
+		encoder->beginMap(rule_match->truncated.size() ? 5 : 4);
+
+		encoder->key("id");
+		encoder->string(rule_match->id);
+
+		encoder->key("tags");
+		encoder->beginArray(rule_match->tags.size());
+		for (std::list<std::string>::iterator tags_it = rule_match->tags.begin();
+				tags_it != rule_match->tags.end();
+				tags_it++)
+			encoder->string(*tags_it);
+		encoder->endArray();
+
+		// "<type>:<id>:<value>"
+		encoder->key("metas");
+		encoder->beginArray(rule_match->metas.size());
+		for (std::list<std::string>::iterator metas_it = rule_match->metas.begin();
+				metas_it != rule_match->metas.end();
+				metas_it++) {
+			const std::string& meta = *metas_it;
+			size_t type_end = meta.find(':');
+			size_t id_end = meta.find(':', type_end + 1);
+
+			int type = atoi(meta.c_str());
+			std::string value = meta.substr(id_end + 1);
+
+			encoder->beginMap(3);
+			encoder->key("type");
+			encoder->integer(type);
+			encoder->key("id");
+			encoder->string(meta.substr(type_end + 1, id_end - type_end - 1));
+			encoder->key("value");
+			if (type == META_TYPE_INTEGER)
+				encoder->integer(strtoll(value.c_str(), NULL, 10));
+			else if (type == META_TYPE_BOOLEAN)
+				encoder->boolean(value == "true");
+			else
+				encoder->string(value);
+			encoder->endMap();
+		}
+		encoder->endArray();
+
+		// "<offset>:<length>:<id>", with match bytes paired by index
+		encoder->key("matches");
+		encoder->beginArray(rule_match->matches.size());
+		std::list<MatchData*>::iterator datas_it = rule_match->datas.begin();
+		for (std::list<std::string>::iterator matches_it = rule_match->matches.begin();
+				matches_it != rule_match->matches.end();
+				matches_it++) {
+			const std::string& match = *matches_it;
+			size_t offset_end = match.find(':');
+			size_t length_end = match.find(':', offset_end + 1);
+
+			bool has_bytes = datas_it != rule_match->datas.end();
+
+			encoder->beginMap(has_bytes ? 4 : 3);
+			encoder->key("offset");
+			encoder->integer(strtoll(match.c_str(), NULL, 10));
+			encoder->key("length");
+			encoder->integer(strtoll(match.c_str() + offset_end + 1, NULL, 10));
+			encoder->key("id");
+			encoder->string(match.substr(length_end + 1));
+			if (has_bytes) {
+				encoder->key("bytes");
+				encoder->bytes((*datas_it)->bytes, (*datas_it)->length);
+				datas_it++;
+			}
+			encoder->endMap();
+		}
+		encoder->endArray();
+
+		// "<count>:<id>"
+		if (rule_match->truncated.size()) {
+			encoder->key("truncated");
+			encoder->beginArray(rule_match->truncated.size());
+			for (std::list<std::string>::iterator truncated_it = rule_match->truncated.begin();
+					truncated_it != rule_match->truncated.end();
+					truncated_it++) {
+				const std::string& item = *truncated_it;
+
+				encoder->beginMap(2);
+				encoder->key("id");
+				encoder->string(item.substr(item.find(':') + 1));
+				encoder->key("count");
+				encoder->integer(strtoll(item.c_str(), NULL, 10));
+				encoder->endMap();
+			}
+			encoder->endArray();
+		}
+
+		encoder->endMap();
+	}
+
+	encoder->endArray();
+}
+
+void encodeModuleDatas(ResultEncoder* encoder, std::map<std::string, std::string>* module_datas) {
+	encoder->beginMap(module_datas->size());
+
+	for (std::map<std::string, std::string>::iterator module_datas_it = module_datas->begin();
+			module_datas_it != module_datas->end();
+			module_datas_it++) {
+		encoder->key(module_datas_it->first.c_str());
+		encoder->json(module_datas_it->second);
+	}
+
+	encoder->endMap();
+}
+
+/**
+ ** Scans which time out, or take longer than latency_ms plus latency_ms_per_mb
+ ** for each MB scanned, are captured to a spool directory so they can be
+ ** rerun later using yara.replay().  Each capture is a directory holding the
+ ** request in capture.json and, unless larger than max_input_bytes, a copy of
+ ** the content scanned in input.  The rules are saved once for each rules
+ ** fingerprint, i.e. the SHA-256 digest of the saved rules, in
+ ** rules-<fingerprint>.yarc, which the yara command can load using -C.  Once
+ ** max_captures or max_bytes is reached further captures are dropped.
+ **/
+#define CAPTURE_DEFAULT_MAX_CAPTURES 100
+#define CAPTURE_DEFAULT_MAX_BYTES (1024LL * 1024 * 1024)
+#define CAPTURE_DEFAULT_MAX_INPUT_BYTES (64 * 1024 * 1024)
+#define CAPTURE_READ_SIZE (1024 * 1024)
+
+// Allowance for capture.json when reserving space in the spool
+#define CAPTURE_REQUEST_BYTES (4 * 1024)
+
+struct CaptureConfig {
+	std::string dir;
+	double latency_ms;
+	double latency_ms_per_mb;
+	bool timeouts;
+	int64_t max_captures;
+	int64_t max_bytes;
+	int64_t max_input_bytes;
+};
+
+class CaptureSpool {
+public:
+	CaptureSpool() : captures_(0), bytes_(0), dropped_(0), failed_(0), sequence_(0) {
+		config_.latency_ms = -1;
+		config_.latency_ms_per_mb = 0;
+		config_.timeouts = true;
+		config_.max_captures = CAPTURE_DEFAULT_MAX_CAPTURES;
+		config_.max_bytes = CAPTURE_DEFAULT_MAX_BYTES;
+		config_.max_input_bytes = CAPTURE_DEFAULT_MAX_INPUT_BYTES;
+
+		pthread_mutex_init(&mutex_, NULL);
+		pthread_mutex_init(&write_mutex_, NULL);
+	}
+
+	~CaptureSpool() {
+		pthread_mutex_destroy(&write_mutex_);
+		pthread_mutex_destroy(&mutex_);
+	}
+
+	/**
+	 ** An empty dir disables capture and keeps the stats for the spool last
+	 ** used, otherwise all stats restart, with captures and bytes being those
+	 ** already in the spool.
+	 **/
+	void configure(const CaptureConfig& config, int64_t captures, int64_t bytes) {
+		pthread_mutex_lock(&mutex_);
+		config_ = config;
+		if (config.dir.length()) {
+			captures_ = captures;
+			bytes_ = bytes;
+			dropped_ = 0;
+			failed_ = 0;
+		}
+		pthread_mutex_unlock(&mutex_);
+	}
+
+	bool enabled(void) {
+		pthread_mutex_lock(&mutex_);
+		bool enabled = config_.dir.length() > 0;
+		pthread_mutex_unlock(&mutex_);
+		return enabled;
+	}
+
+	CaptureConfig config(void) {
+		pthread_mutex_lock(&mutex_);
+		CaptureConfig config = config_;
+		pthread_mutex_unlock(&mutex_);
+		return config;
+	}
+
+	/**
+	 ** Reserve room in the spool for a capture of up to bytes, returns a
+	 ** sequence number for its name, or 0 if the capture must be dropped.
+	 **/
+	uint64_t reserve(int64_t bytes) {
+		uint64_t sequence = 0;
+
+		pthread_mutex_lock(&mutex_);
+		if (captures_ >= config_.max_captures || bytes_ + bytes > config_.max_bytes) {
+			dropped_++;
+		} else {
+			captures_++;
+			bytes_ += bytes;
+			sequence = ++sequence_;
+		}
+		pthread_mutex_unlock(&mutex_);
+
+		return sequence;
+	}
+
+	// Replace a reservation with the bytes actually written
+	void complete(int64_t reserved, int64_t bytes) {
+		pthread_mutex_lock(&mutex_);
+		bytes_ += bytes - reserved;
+		pthread_mutex_unlock(&mutex_);
+	}
+
+	// Release a reservation for a capture which could not be written, bytes
+	// may still have been written, e.g. for saved rules
+	void abandon(int64_t reserved, int64_t bytes) {
+		pthread_mutex_lock(&mutex_);
+		bytes_ += bytes - reserved;
+		captures_--;
+		failed_++;
+		pthread_mutex_unlock(&mutex_);
+	}
+
+	void lock_write(void) {
+		pthread_mutex_lock(&write_mutex_);
+	}
+
+	void unlock_write(void) {
+		pthread_mutex_unlock(&write_mutex_);
+	}
+
+	int64_t captures(void) { return get(&captures_); }
+	int64_t bytes(void) { return get(&bytes_); }
+	int64_t dropped(void) { return get(&dropped_); }
+	int64_t failed(void) { return get(&failed_); }
+
+private:
+	int64_t get(int64_t* value) {
+		pthread_mutex_lock(&mutex_);
+		int64_t copy = *value;
+		pthread_mutex_unlock(&mutex_);
+		return copy;
+	}
+
+	CaptureConfig config_;
+	int64_t captures_;
+	int64_t bytes_;
+	int64_t dropped_;
+	int64_t failed_;
+	uint64_t sequence_;
+
+	pthread_mutex_t mutex_;
+
+	// Held while rules are saved and a capture is published, so rules are
+	// only saved once and always exist before captures using them
+	pthread_mutex_t write_mutex_;
+};
+
+CaptureSpool capture_spool;
+
+bool captureEnabled(void) {
+	return capture_spool.enabled();
+}
+
+void writeAll(int fd, const std::string& path, const char* data, size_t length) {
+	while (length > 0) {
+		ssize_t rc = write(fd, data, length);
+
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			yara_throw(YaraError, "write(" << path << ") failed: "
+					<< yara_strerror(errno));
+		}
+
+		data += rc;
+		length -= rc;
+	}
+}
+
+void writeFile(const std::string& path, const char* data, size_t length) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		yara_throw(YaraError, "open(" << path << ") failed: "
+				<< yara_strerror(errno));
+
+	try {
+		writeAll(fd, path, data, length);
+	} catch(std::exception& error) {
+		close(fd);
+		throw;
+	}
+
+	close(fd);
+}
+
+int64_t fileSize(const std::string& path) {
+	struct stat st;
+
+	if (stat(path.c_str(), &st) != 0)
+		return 0;
+
+	return st.st_size;
+}
+
+/**
+ ** Count the captures in a spool directory, and the bytes used by them and
+ ** any saved rules.
+ **/
+void spoolUsage(const std::string& dir, int64_t* captures, int64_t* bytes) {
+	*captures = 0;
+	*bytes = 0;
+
+	DIR* spool = opendir(dir.c_str());
+	if (! spool)
+		return;
+
+	struct dirent* entry;
+
+	while ((entry = readdir(spool)) != NULL) {
+		std::string name = entry->d_name;
+		std::string path = dir + "/" + name;
+
+		if (name.compare(0, 6, "rules-") == 0) {
+			*bytes += fileSize(path);
+		} else if (name.compare(0, 8, "capture-") == 0) {
+			(*captures)++;
+			*bytes += fileSize(path + "/capture.json");
+			*bytes += fileSize(path + "/input");
+		}
+	}
+
+	closedir(spool);
+}
+
+void removeCapture(const std::string& path) {
+	unlink((path + "/capture.json").c_str());
+	unlink((path + "/input").c_str());
+	rmdir(path.c_str());
+}
+
+class AsyncScan : public Nan::AsyncWorker {
+public:
+	AsyncScan(
+			ScannerWrap* scanner,
+			RulesHandle* rules,
+			ScanReq* scan_req,
+			Nan::Callback* callback
+		) : Nan::AsyncWorker(callback),
+				scanner_(scanner),
+				rules_(rules),
+				allowlist_(NULL),
+				scan_req_(scan_req),
+				scan_rules_(NULL),
+				rules_callback_(NULL),
+				async_(NULL),
+				stream_id_(0),
+				stream_paused_(false),
+				large_(false),
+				filtered_(NULL),
+				expanded_bytes_(0),
+				expand_truncated_(NULL),
+				capture_pending_(false),
+				capture_wall_ns_(0),
+				capture_cpu_ns_(0),
+				capture_size_(0),
+				capture_copy_input_(false),
+				capture_save_rules_(false),
+				capture_reserved_(0),
+				capture_sequence_(0),
+				output_data_(NULL),
+				output_length_(0) {
+		matched_bytes = 0;
+		batch_size = 1;
+
+		max_matches_per_string = -1;
+		max_matches_total = -1;
+		max_result_bytes = -1;
+
+		matches_total = 0;
+		matches_truncated = 0;
+		result_bytes = 0;
+
+		output = SCAN_OUTPUT_NONE;
+		capture = true;
+
+		stats = false;
+		rules_matched = 0;
+		rules_not_matched = 0;
+		bytes_scanned = -1;
+		timed_out = false;
+		aborted = false;
+
+		stream_aborted_ = false;
+
+		// Queue wait is measured from here, when scan() is called
+		queued_ns = uv_hrtime();
+		start_ns = end_ns = queued_ns;
+		cpu_ns = 0;
+	}
+
+	~AsyncScan() {
+		releaseRules(rules_);
+		releaseAllowlist(allowlist_);
+
+		delete scan_req_;
+
+		freeRuleMatches(&rule_matches);
+
+		for (ScanMemberList::iterator members_it = members_.begin();
+				members_it != members_.end();
+				members_it++) {
+			freeRuleMatches(&(*members_it)->rule_matches);
+			delete *members_it;
+		}
+
+		if (async_) {
+			uv_close((uv_handle_t*) async_, onStreamClose);
+
+			pthread_cond_destroy(&stream_cond_);
+			pthread_mutex_destroy(&stream_mutex_);
+
+			ScanRuleMatchList* batch;
+			std::list<ScanRuleMatchList*>::iterator batches_it;
+
+			for (batches_it = stream_batches_.begin();
+					batches_it != stream_batches_.end();
+					batches_it++) {
+				batch = *batches_it;
+				freeMatchBytes(batch);
+				freeRuleMatches(batch);
+				delete batch;
+			}
+		}
+
+		if (rules_callback_)
+			delete rules_callback_;
+
+		if (output_data_)
+			free(output_data_);
+	}
+
+	/**
+	 ** Deliver matching rules to rules_callback in batches of batch_size while
+	 ** the scan is in progress, instead of all at once in the result.  Batches
+	 ** are queued by the scanning thread and drained on the main thread when
+	 ** async_ is signalled.  Once STREAM_MAX_BATCHES batches are queued the
+	 ** scanning thread waits for them to be drained, bounding memory use.
+	 ** Draining stops while the stream is paused, so a slow consumer holds
+	 ** the scanning thread there too, and once aborted the scan is stopped
+	 ** at its next callback and undelivered batches are dropped.
+	 **/
+	void stream(Nan::Callback* rules_callback, uint32_t size) {
+		rules_callback_ = rules_callback;
+		batch_size = size;
+
+		pthread_mutex_init(&stream_mutex_, NULL);
+		pthread_cond_init(&stream_cond_, NULL);
+
+		async_ = new uv_async_t;
+		uv_async_init(Nan::GetCurrentEventLoop(), async_, onStreamAsync);
+		async_->data = (void*) this;
+
+		stream_id_ = next_stream_id++;
+		stream_scans[stream_id_] = this;
+	}
+
+	uint32_t stream_id(void) {
+		return stream_id_;
+	}
+
+	void pause_stream(void) {
+		stream_paused_ = true;
+	}
+
+	void resume_stream(void) {
+		stream_paused_ = false;
+		drainBatches(false);
+	}
+
+	void abort_stream(void) {
+		pthread_mutex_lock(&stream_mutex_);
+		stream_aborted_ = true;
+		pthread_cond_signal(&stream_cond_);
+		pthread_mutex_unlock(&stream_mutex_);
+	}
+
+	bool stream_aborted(void) {
+		return stream_aborted_;
+	}
+
+	void scheduled(bool large) {
+		large_ = large;
+	}
+
+	void use_allowlist(Allowlist* list) {
+		allowlist_ = list;
+	}
+
+	void addScanBytes(int64_t bytes) {
+		scanner_->scan_bytes += bytes;
+	}
+
+	void addRuleMatch(ScanRuleMatch* rule_match) {
+		rule_matches.push_back(rule_match);
+
+		if (async_ && rule_matches.size() >= batch_size)
+			queueBatch(true);
+	}
+
+	void queueBatch(bool signal) {
+		ScanRuleMatchList* batch = new ScanRuleMatchList();
+		batch->swap(rule_matches);
+
+		pthread_mutex_lock(&stream_mutex_);
+		stream_batches_.push_back(batch);
+		pthread_mutex_unlock(&stream_mutex_);
+
+		if (! signal)
+			return;
+
+		uv_async_send(async_);
+
+		pthread_mutex_lock(&stream_mutex_);
+		while (stream_batches_.size() > STREAM_MAX_BATCHES && ! stream_aborted_)
+			pthread_cond_wait(&stream_cond_, &stream_mutex_);
+		pthread_mutex_unlock(&stream_mutex_);
+	}
+
+	/**
+	 ** Deliver queued batches, unless paused, which is ignored once the scan
+	 ** has completed since nothing is left to hold back.
+	 **/
+	void drainBatches(bool completed) {
+		if (stream_paused_ && ! completed)
+			return;
+
+		Nan::HandleScope scope;
+
+		std::list<ScanRuleMatchList*> batches;
+
+		pthread_mutex_lock(&stream_mutex_);
+		batches.swap(stream_batches_);
+		pthread_cond_signal(&stream_cond_);
+		pthread_mutex_unlock(&stream_mutex_);
+
+		ScanRuleMatchList* batch;
+		std::list<ScanRuleMatchList*>::iterator batches_it;
+
+		for (batches_it = batches.begin();
+				batches_it != batches.end();
+				batches_it++) {
+			batch = *batches_it;
+
+			// Match bytes are only owned by Buffer instances once converted
+			if (! stream_aborted_) {
+				Local<Value> argv[1];
+				argv[0] = ruleMatchesToArray(batch);
+				rules_callback_->Call(1, argv, async_resource);
+			} else {
+				freeMatchBytes(batch);
+			}
+
+			freeRuleMatches(batch);
+			delete batch;
+		}
+	}
+
+	static void onStreamAsync(uv_async_t* handle) {
+		AsyncScan* async_scan = (AsyncScan*) handle->data;
+		async_scan->drainBatches(false);
+	}
+
+	static void onStreamClose(uv_handle_t* handle) {
+		delete (uv_async_t*) handle;
+	}
+
+	void WorkComplete() {
+		scanner_->scan_bytes -= result_bytes;
+		scanner_->report_memory();
+
+		if (async_) {
+			stream_scans.erase(stream_id_);
+			drainBatches(true);
+		}
+
+		Nan::AsyncWorker::WorkComplete();
+
+		// Callbacks above may have queued more scans, which are started
+		// after this one has made room for them
+		scanCompleted(large_);
+	}
+
+	void Destroy();
+
+	void Execute() {
+		start_ns = uv_hrtime();
+		int64_t cpu_start_ns = threadCpuTime();
+
+		bool pinned = selectRules();
+
+		try {
+			int rc;
+			const char* scan_function;
+
+			if ((filtered_ = filterInput()) != NULL) {
+				rc = ERROR_SUCCESS;
+			} else if (scan_req_->filename.length() && scan_req_->read_limit > 0) {
+				rc = scanFileRead(&scan_function);
+			} else if (scan_req_->filename.length()) {
+				struct stat st;
+				if (stats && stat(scan_req_->filename.c_str(), &st) == 0)
+					bytes_scanned = st.st_size;
+
+				scan_function = "yr_rules_scan_file";
+				rc = yr_rules_scan_file(
+						scan_rules_,
+						scan_req_->filename.c_str(),
+						scan_req_->flags,
+						scanCallback,
+						(void*) this,
+						scan_req_->timeout
+					);
+			} else if (scan_req_->buffer) {
+				bytes_scanned = scan_req_->length;
+
+				scan_function = "yr_rules_scan_mem";
+				rc = yr_rules_scan_mem(
+						scan_rules_,
+						(uint8_t*) scan_req_->buffer + scan_req_->offset,
+						scan_req_->length,
+						scan_req_->flags,
+						scanCallback,
+						(void*) this,
+						scan_req_->timeout
+					);
+			} else if (scan_req_->blocks.size()) {
+				ScanBlockIterator scan_iterator;
+				scanBlockIteratorInit(&scan_iterator, &scan_req_->blocks, 0);
+
+				bytes_scanned = 0;
+				for (ScanBlockList::iterator blocks_it = scan_req_->blocks.begin();
+						blocks_it != scan_req_->blocks.end();
+						blocks_it++)
+					bytes_scanned += blocks_it->length;
+
+				scan_function = "yr_rules_scan_mem_blocks";
+				rc = yr_rules_scan_mem_blocks(
+						scan_rules_,
+						&scan_iterator.iterator,
+						scan_req_->flags,
+						scanCallback,
+						(void*) this,
+						scan_req_->timeout
+					);
+			} else if (scan_req_->pid && scan_req_->size) {
+				rc = scanProcessRegion(&scan_function);
+			} else if (scan_req_->pid) {
+				scan_function = "yr_rules_scan_proc";
+				rc = yr_rules_scan_proc(
+						scan_rules_,
+						scan_req_->pid,
+						scan_req_->flags,
+						scanCallback,
+						(void*) this,
+						scan_req_->timeout
+					);
+			} else {
+				yara_throw(YaraError, "Either filename of buffer is required");
+			}
+
+			if (rc == ERROR_SCAN_TIMEOUT)
+				timed_out = true;
+
+			if (rc != ERROR_SUCCESS)
+				yara_throw(YaraError, scan_function << "() failed: "
+						<< getErrorString(rc));
+
+			if (scan_req_->expand.formats && ! filtered_)
+				expandInput();
+		} catch(std::exception& error) {
+			aborted = ! timed_out;
+			SetErrorMessage(error.what());
+		}
+
+		// Remaining matches are drained by WorkComplete() on the main thread
+		if (async_ && rule_matches.size())
+			queueBatch(false);
+
+		if (capture && capture_spool.enabled()) {
+			capture_wall_ns_ = uv_hrtime() - start_ns;
+			capture_cpu_ns_ = threadCpuTime() - cpu_start_ns;
+			capture_pending_ = reserveCapture();
+		}
+
+		// The last reference to replaced rules destroys them here, off the
+		// main thread, unless a capture still needs them
+		if (! capture_pending_) {
+			releaseRules(rules_);
+			rules_ = NULL;
+		}
+
+		releaseAllowlist(allowlist_);
+		allowlist_ = NULL;
+
+		if (pinned)
+			unpinThread();
+
+		end_ns = uv_hrtime();
+		cpu_ns = threadCpuTime() - cpu_start_ns;
+
+		if (output != SCAN_OUTPUT_NONE && ! ErrorMessage())
+			encodeOutput();
+
+		// No Buffer instances are created for match bytes when the result is
+		// encoded, or the scan failed
+		if (output != SCAN_OUTPUT_NONE || ErrorMessage()) {
+			freeMatchBytes(&rule_matches);
+
+			for (ScanMemberList::iterator members_it = members_.begin();
+					members_it != members_.end();
+					members_it++)
+				freeMatchBytes(&(*members_it)->rule_matches);
+		}
+	}
+
+	/**
+	 ** Encode the result as NDJSON or MessagePack, in the same shape as the
+	 ** object scanner.scan() would otherwise return.
+	 **/
+	void encodeOutput(void) {
+		ResultEncoder* encoder;
+
+		if (output == SCAN_OUTPUT_MSGPACK)
+			encoder = new MsgpackEncoder();
+		else
+			encoder = new JsonEncoder();
+
+		try {
+			uint32_t count = 1;
+
+			if (matches_truncated > 0)
+				count++;
+			if (stats)
+				count++;
+			if (filtered_)
+				count++;
+			if (sha256_.length())
+				count++;
+			if (scan_req_->expand.formats)
+				count += expand_truncated_ ? 2 : 1;
+			if (module_datas.size())
+				count++;
+
+			encoder->beginMap(count);
+
+			encoder->key("rules");
+			encodeRuleMatches(encoder, &rule_matches);
+
+			if (matches_truncated > 0) {
+				encoder->key("truncated");
+				encoder->integer(matches_truncated);
+			}
+
+			if (stats) {
+				encoder->key("stats");
+				encodeStats(encoder);
+			}
+
+			if (filtered_) {
+				encoder->key("filtered");
+				encoder->string(filtered_, strlen(filtered_));
+			}
+
+			if (sha256_.length()) {
+				encoder->key("sha256");
+				encoder->string(sha256_);
+			}
+
+			if (scan_req_->expand.formats) {
+				encoder->key("members");
+				encoder->beginArray(members_.size());
+
+				for (ScanMemberList::iterator members_it = members_.begin();
+						members_it != members_.end();
+						members_it++) {
+					ScanMember* member = *members_it;
+
+					encoder->beginMap(member->module_datas.size() ? 3 : 2);
+					encoder->key("path");
+					encoder->string(member->path);
+
+					if (member->error.length()) {
+						encoder->key("error");
+						encoder->string(member->error);
+					} else {
+						encoder->key("rules");
+						encodeRuleMatches(encoder, &member->rule_matches);
+					}
+
+					if (member->module_datas.size()) {
+						encoder->key("modules");
+						encodeModuleDatas(encoder, &member->module_datas);
+					}
+
+					encoder->endMap();
+				}
+
+				encoder->endArray();
+
+				if (expand_truncated_) {
+					encoder->key("expandTruncated");
+					encoder->string(expand_truncated_, strlen(expand_truncated_));
+				}
+			}
+
+			if (module_datas.size()) {
+				encoder->key("modules");
+				encodeModuleDatas(encoder, &module_datas);
+			}
+
+			encoder->endMap();
+			encoder->finish();
+
+			if (encoder->length() > node::Buffer::kMaxLength)
+				yara_throw(YaraError, "Output of " << encoder->length()
+						<< " bytes is too large for a Buffer");
+
+			output_length_ = encoder->length();
+			output_data_ = encoder->release();
+		} catch(std::exception& error) {
+			SetErrorMessage(error.what());
+		}
+
+		delete encoder;
+	}
+
+	int64_t inputSize(void) {
+		if (bytes_scanned >= 0)
+			return bytes_scanned;
+		else if (scan_req_->filename.length())
+			return fileSize(scan_req_->filename);
+		else
+			return 0;
+	}
+
+	/**
+	 ** Reserve room in the spool configured using yara.configureCapture() for
+	 ** a capture of this scan if it timed out, or was slow for its size.
+	 ** Process memory cannot be replayed so is never captured, and neither is
+	 ** content which was filtered instead of scanned.  Returns whether the
+	 ** capture should be written by captureScan().
+	 **/
+	bool reserveCapture(void) {
+		if (scan_req_->pid || filtered_)
+			return false;
+
+		capture_config_ = capture_spool.config();
+		if (! capture_config_.dir.length())
+			return false;
+
+		capture_size_ = inputSize();
+
+		if (! (capture_config_.timeouts && timed_out)) {
+			if (capture_config_.latency_ms < 0)
+				return false;
+
+			double threshold_ms = capture_config_.latency_ms
+					+ (capture_config_.latency_ms_per_mb * capture_size_ / (1024.0 * 1024.0));
+
+			if (capture_wall_ns_ / 1e6 <= threshold_ms)
+				return false;
+		}
+
+		// The rules are saved when configured, and only kept if capture was
+		// enabled then, otherwise captures need a scanner to replay them
+		std::string rules_path = capture_config_.dir + "/rules-"
+				+ rules_->fingerprint + ".yarc";
+
+		capture_save_rules_ = rules_->image.length()
+				&& access(rules_path.c_str(), F_OK) != 0;
+		capture_copy_input_ = capture_size_ <= capture_config_.max_input_bytes;
+
+		capture_reserved_ = CAPTURE_REQUEST_BYTES
+				+ (capture_copy_input_ ? capture_size_ : 0)
+				+ (capture_save_rules_ ? rules_->image.length() : 0);
+
+		capture_sequence_ = capture_spool.reserve(capture_reserved_);
+
+		return capture_sequence_ != 0;
+	}
+
+	/**
+	 ** Write the capture reserved by Execute(), called by AsyncCapture on its
+	 ** own pool thread once the scan has completed, so hashing and copying
+	 ** the input adds nothing to the scan's time.  Failures are counted by
+	 ** the spool, and never fail the scan.
+	 **/
+	void captureScan(void) {
+		const CaptureConfig& config = capture_config_;
+		const std::string& fingerprint = rules_->fingerprint;
+		const std::string& image = rules_->image;
+
+		std::string rules_path = config.dir + "/rules-" + fingerprint + ".yarc";
+		std::string tmp_path;
+		int64_t written = 0;
+
+		try {
+			std::ostringstream name;
+			name << "capture-" << (realtimeNs() / 1000000) << "-" << getpid()
+					<< "-" << capture_sequence_;
+
+			// Written under a hidden name and renamed once complete, so
+			// replay never sees partial captures
+			tmp_path = config.dir + "/." + name.str();
+			std::string path = config.dir + "/" + name.str();
+
+			if (mkdir(tmp_path.c_str(), 0700) != 0)
+				yara_throw(YaraError, "mkdir(" << tmp_path << ") failed: "
+						<< yara_strerror(errno));
+
+			std::string sha256 = captureInput(tmp_path + "/input", capture_copy_input_);
+
+			writeCaptureRequest(tmp_path + "/capture.json", fingerprint, sha256,
+					capture_size_, capture_copy_input_, capture_wall_ns_,
+					capture_cpu_ns_);
+
+			// Only saving the rules, and publishing the capture once its
+			// rules exist, is serialised with other captures
+			capture_spool.lock_write();
+
+			try {
+				if (capture_save_rules_ && access(rules_path.c_str(), F_OK) != 0) {
+					writeFile(rules_path + ".tmp", image.data(), image.length());
+
+					if (rename((rules_path + ".tmp").c_str(), rules_path.c_str()) != 0)
+						yara_throw(YaraError, "rename(" << rules_path << ") failed: "
+								<< yara_strerror(errno));
+
+					written += image.length();
+				}
+
+				if (rename(tmp_path.c_str(), path.c_str()) != 0)
+					yara_throw(YaraError, "rename(" << path << ") failed: "
+							<< yara_strerror(errno));
+			} catch(std::exception& error) {
+				capture_spool.unlock_write();
+				throw;
+			}
+
+			capture_spool.unlock_write();
+
+			written += fileSize(path + "/capture.json");
+			written += fileSize(path + "/input");
+
+			capture_spool.complete(capture_reserved_, written);
+		} catch(std::exception& error) {
+			if (tmp_path.length())
+				removeCapture(tmp_path);
+
+			capture_spool.abandon(capture_reserved_, written);
+		}
+
+		releaseRules(rules_);
+		rules_ = NULL;
+	}
+
+	static uint64_t realtimeNs(void) {
+		struct timespec ts;
+		if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
+			return 0;
+		return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+	}
+
+	/**
+	 ** Hash the content scanned, also copying it to path when copy is true,
+	 ** returns the SHA-256 digest in hex.  Files are read again since they
+	 ** may have been mapped, or only partly read, when scanned.
+	 **/
+	std::string captureInput(const std::string& path, bool copy) {
+		Sha256 sha256;
+		uint8_t digest[SHA256_LENGTH];
+
+		int out = -1;
+		int in = -1;
+
+		if (copy) {
+			out = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+			if (out < 0)
+				yara_throw(YaraError, "open(" << path << ") failed: "
+						<< yara_strerror(errno));
+		}
+
+		try {
+			if (scan_req_->filename.length()) {
+				in = open(scan_req_->filename.c_str(), O_RDONLY);
+				if (in < 0)
+					yara_throw(YaraError, "open(" << scan_req_->filename
+							<< ") failed: " << yara_strerror(errno));
+
+				std::vector<uint8_t> buffer(CAPTURE_READ_SIZE);
+				ssize_t rc;
+
+				while ((rc = read(in, &buffer[0], buffer.size())) != 0) {
+					if (rc < 0) {
+						if (errno == EINTR)
+							continue;
+						yara_throw(YaraError, "read(" << scan_req_->filename
+								<< ") failed: " << yara_strerror(errno));
+					}
+
+					sha256.update(&buffer[0], rc);
+
+					if (out >= 0)
+						writeAll(out, path, (const char*) &buffer[0], rc);
+				}
+
+				close(in);
+				in = -1;
+			} else if (scan_req_->buffer) {
+				const char* data = scan_req_->buffer + scan_req_->offset;
+
+				sha256.update((const uint8_t*) data, scan_req_->length);
+
+				if (out >= 0)
+					writeAll(out, path, data, scan_req_->length);
+			} else {
+				for (ScanBlockList::iterator blocks_it = scan_req_->blocks.begin();
+						blocks_it != scan_req_->blocks.end();
+						blocks_it++) {
+					sha256.update((const uint8_t*) blocks_it->buffer, blocks_it->length);
+
+					if (out >= 0)
+						writeAll(out, path, blocks_it->buffer, blocks_it->length);
+				}
+			}
+		} catch(std::exception& error) {
+			if (in >= 0)
+				close(in);
+			if (out >= 0)
+				close(out);
+			throw;
+		}
+
+		if (out >= 0)
+			close(out);
+
+		sha256.final(digest);
+
+		return digestToHex(digest);
+	}
+
+	/**
+	 ** Write capture.json, describing the content scanned, the request
+	 ** attributes needed to repeat the scan, and how the scan went.  Counts
+	 ** given to the encoder are only needed for MessagePack, so are 0.
+	 **/
+	void writeCaptureRequest(const std::string& path, const std::string& fingerprint,
+			const std::string& sha256, int64_t size, bool copy_input,
+			uint64_t wall_ns, int64_t cpu_ns) {
+		JsonEncoder encoder;
+
+		encoder.beginMap(0);
+
+		encoder.key("time");
+		encoder.integer(realtimeNs() / 1000000);
+
+		encoder.key("input");
+		if (scan_req_->filename.length()) {
+			encoder.string("file", 4);
+			encoder.key("filename");
+			encoder.string(scan_req_->filename);
+		} else if (scan_req_->buffer) {
+			encoder.string("buffer", 6);
+		} else {
+			encoder.string("blocks", 6);
+			encoder.key("blocks");
+			encoder.beginArray(0);
+			for (ScanBlockList::iterator blocks_it = scan_req_->blocks.begin();
+					blocks_it != scan_req_->blocks.end();
+					blocks_it++)
+				encoder.integer(blocks_it->length);
+			encoder.endArray();
+		}
+
+		encoder.key("size");
+		encoder.integer(size);
+		encoder.key("sha256");
+		encoder.string(sha256);
+		encoder.key("inputCaptured");
+		encoder.boolean(copy_input);
+
+		encoder.key("request");
+		encoder.beginMap(0);
+
+		encoder.key("flags");
+		encoder.integer(scan_req_->flags);
+		encoder.key("timeout");
+		encoder.integer(scan_req_->timeout);
+
+		if (scan_req_->read_limit > 0) {
+			encoder.key("readLimit");
+			encoder.integer(scan_req_->read_limit);
+		}
+
+		if (matched_bytes > 0) {
+			encoder.key("matchedBytes");
+			encoder.integer(matched_bytes);
+		}
+
+		if (max_matches_per_string >= 0) {
+			encoder.key("maxMatchesPerString");
+			encoder.integer(max_matches_per_string);
+		}
+
+		if (max_matches_total >= 0) {
+			encoder.key("maxMatchesTotal");
+			encoder.integer(max_matches_total);
+		}
+
+		if (max_result_bytes >= 0) {
+			encoder.key("maxResultBytes");
+			encoder.integer(max_result_bytes);
+		}
+
+		if (scan_req_->module_data.size()) {
+			encoder.key("moduleData");
+			encoder.beginArray(0);
+
+			for (ModuleDataMap::iterator module_data_it = scan_req_->module_data.begin();
+					module_data_it != scan_req_->module_data.end();
+					module_data_it++) {
+				std::list<std::string>& fields = module_data_it->second;
+
+				if (! fields.size())
+					encoder.string(module_data_it->first);
+
+				for (std::list<std::string>::iterator fields_it = fields.begin();
+						fields_it != fields.end();
+						fields_it++)
+					encoder.string(module_data_it->first + "." + *fields_it);
+			}
+
+			encoder.endArray();
+		}
+
+		if (scan_req_->expand.formats) {
+			encoder.key("expand");
+			encoder.beginMap(0);
+
+			encoder.key("formats");
+			encoder.beginArray(0);
+			if (scan_req_->expand.formats & EXPAND_GZIP)
+				encoder.string("gzip", 4);
+			if (scan_req_->expand.formats & EXPAND_TAR)
+				encoder.string("tar", 3);
+			if (scan_req_->expand.formats & EXPAND_ZIP)
+				encoder.string("zip", 3);
+			encoder.endArray();
+
+			encoder.key("maxDepth");
+			encoder.integer(scan_req_->expand.max_depth);
+			encoder.key("maxTotalBytes");
+			encoder.integer(scan_req_->expand.max_total_bytes);
+			encoder.key("maxMembers");
+			encoder.integer(scan_req_->expand.max_members);
+
+			encoder.endMap();
+		}
+
+		encoder.endMap();
+
+		encoder.key("rulesFingerprint");
+		encoder.string(fingerprint);
+		encoder.key("wallMs");
+		encoder.number(wall_ns / 1e6);
+		encoder.key("cpuMs");
+		encoder.number(cpu_ns / 1e6);
+		encoder.key("timedOut");
+		encoder.boolean(timed_out);
+
+		if (ErrorMessage()) {
+			encoder.key("error");
+			encoder.string(ErrorMessage(), strlen(ErrorMessage()));
+		}
+
+		encoder.endMap();
+		encoder.finish();
+
+		size_t length = encoder.length();
+		char* data = encoder.release();
+
+		try {
+			writeFile(path, data, length);
+		} catch(std::exception& error) {
+			free(data);
+			throw;
+		}
+
+		free(data);
+	}
+
+	void encodeStats(ResultEncoder* encoder) {
+		encoder->beginMap(9);
+
+		encoder->key("queueWaitMs");
+		encoder->number((start_ns - queued_ns) / 1e6);
+		encoder->key("wallMs");
+		encoder->number((end_ns - start_ns) / 1e6);
+		encoder->key("cpuMs");
+		encoder->number(cpu_ns / 1e6);
+
+		encoder->key("bytes");
+		if (bytes_scanned >= 0)
+			encoder->integer(bytes_scanned);
+		else
+			encoder->null();
+
+		encoder->key("rulesMatched");
+		encoder->integer(rules_matched);
+		encoder->key("rulesEvaluated");
+		encoder->integer(rules_matched + rules_not_matched);
+		encoder->key("matches");
+		encoder->integer(matches_total + matches_truncated);
+		encoder->key("timedOut");
+		encoder->boolean(timed_out);
+		encoder->key("aborted");
+		encoder->boolean(aborted);
+
+		encoder->endMap();
+	}
+
+	/**
+	 ** Scan using the copy of the rules on the NUMA node this thread is
+	 ** running on, when the rules are replicated, and keep the thread on that
+	 ** node until the scan completes.  Returns true if the thread was pinned.
+	 **/
+	bool selectRules(void) {
+		scan_rules_ = rules_->rules;
+
+		if (rules_->replicas.size() < 2)
+			return false;
+
+		int node = currentNumaNode();
+		if ((size_t) node >= rules_->replicas.size())
+			return false;
+
+		scan_rules_ = rules_->replicas[node];
+
+#ifdef __linux__
+		if (pthread_getaffinity_np(pthread_self(), sizeof(previous_cpus_),
+				&previous_cpus_) != 0)
+			return false;
+
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (size_t i = 0; i < node_cpus[node].size(); i++)
+			CPU_SET(node_cpus[node][i], &cpus);
+
+		return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+#else
+		return false;
+#endif
+	}
+
+	void unpinThread(void) {
+#ifdef __linux__
+		pthread_setaffinity_np(pthread_self(), sizeof(previous_cpus_),
+				&previous_cpus_);
+#endif
+	}
+
+	static int64_t threadCpuTime(void) {
+		struct timespec ts;
+		if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+			return 0;
+		return ((int64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+	}
+
+	/**
+	 ** Apply the prefilter configured with the rules and, when the allowlist
+	 ** was requested, look up the SHA-256 digest of the input, returning why
+	 ** the input should be skipped, or NULL when it should be scanned.
+	 ** Process memory, and files which are not regular files, are never
+	 ** skipped.
+	 **/
+	const char* filterInput(void) {
+		if (scan_req_->pid || (! allowlist_ && ! rules_->prefilter.configured()))
+			return NULL;
+
+		if (scan_req_->filename.length())
+			return filterFile();
+
+		Sha256 sha256;
+		const char* reason;
+
+		if (scan_req_->buffer) {
+			const uint8_t* data = (const uint8_t*) scan_req_->buffer + scan_req_->offset;
+
+			reason = checkPrefilter(scan_req_->length, data, scan_req_->length);
+			if (reason || ! allowlist_)
+				return reason;
+
+			sha256.update(data, scan_req_->length);
+		} else {
+			int64_t size = 0;
+			std::string head;
+
+			for (ScanBlockList::iterator blocks_it = scan_req_->blocks.begin();
+					blocks_it != scan_req_->blocks.end();
+					blocks_it++) {
+				size += blocks_it->length;
+
+				if (head.length() < rules_->prefilter.max_magic)
+					head.append(blocks_it->buffer, std::min((size_t) blocks_it->length,
+							rules_->prefilter.max_magic - head.length()));
+			}
+
+			reason = checkPrefilter(size, (const uint8_t*) head.data(), head.length());
+			if (reason || ! allowlist_)
+				return reason;
+
+			for (ScanBlockList::iterator blocks_it = scan_req_->blocks.begin();
+					blocks_it != scan_req_->blocks.end();
+					blocks_it++)
+				sha256.update((const uint8_t*) blocks_it->buffer, blocks_it->length);
+		}
+
+		return checkAllowlist(&sha256);
+	}
+
+	const char* filterFile(void) {
+		int fd = open(scan_req_->filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			yara_throw(YaraError, "open(" << scan_req_->filename.c_str()
+					<< ") failed: " << yara_strerror(errno));
+
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			int error = errno;
+			close(fd);
+			yara_throw(YaraError, "fstat(" << scan_req_->filename.c_str()
+					<< ") failed: " << yara_strerror(error));
+		}
+
+		if (! S_ISREG(st.st_mode)) {
+			close(fd);
+			return NULL;
+		}
+
+		// Size limits alone need nothing read
+		if (! allowlist_ && rules_->prefilter.magics.empty()) {
+			close(fd);
+			return checkPrefilter(st.st_size, NULL, 0);
+		}
+
+		PoolBuffer buffer;
+
+		if (! buffer_pool.get(ALLOWLIST_READ_SIZE, &buffer)) {
+			close(fd);
+			yara_throw(YaraError, "malloc(" << ALLOWLIST_READ_SIZE << ") failed");
+		}
+
+		Sha256 sha256;
+		const char* reason = NULL;
+		off_t offset = 0;
+
+		// Without the allowlist only the magic is needed
+		size_t read_size = allowlist_ ? ALLOWLIST_READ_SIZE : rules_->prefilter.max_magic;
+
+		while (true) {
+			ssize_t length = readFile(fd, buffer.data, read_size, offset);
+
+			if (length < 0) {
+				int error = errno;
+				buffer_pool.put(&buffer);
+				close(fd);
+				yara_throw(YaraError, "read(" << scan_req_->filename.c_str()
+						<< ") failed: " << yara_strerror(error));
+			}
+
+			// The size and magic are checked on the first read only, before
+			// spending any time hashing
+			if (offset == 0)
+				reason = checkPrefilter(st.st_size, buffer.data, length);
+
+			if (reason || length == 0 || ! allowlist_)
+				break;
+
+			sha256.update(buffer.data, length);
+			offset += length;
+		}
+
+		buffer_pool.put(&buffer);
+		close(fd);
+
+		if (reason || ! allowlist_)
+			return reason;
+
+		return checkAllowlist(&sha256);
+	}
+
+	const char* checkPrefilter(int64_t size, const uint8_t* head, size_t head_length) {
+		const Prefilter& prefilter = rules_->prefilter;
+
+		if ((prefilter.min_size >= 0 && size < prefilter.min_size)
+				|| (prefilter.max_size >= 0 && size > prefilter.max_size))
+			return "size";
+
+		if (prefilter.magics.empty())
+			return NULL;
+
+		for (std::list<std::string>::const_iterator magics_it = prefilter.magics.begin();
+				magics_it != prefilter.magics.end();
+				magics_it++) {
+			if (magics_it->length() <= head_length
+					&& memcmp(head, magics_it->data(), magics_it->length()) == 0)
+				return NULL;
+		}
+
+		return "magic";
+	}
+
+	const char* checkAllowlist(Sha256* sha256) {
+		uint8_t digest[SHA256_LENGTH];
+		sha256->final(digest);
+
+		sha256_ = digestToHex(digest);
+
+		return allowlistContains(allowlist_, digest) ? "allowlisted" : NULL;
+	}
+
+	/**
+	 ** Expand the requested buffer, or file, when it is a supported container
+	 ** and scan each member.  Files are mapped, since members are scanned from
+	 ** memory and tar members are scanned in place.  Matches for the outer
+	 ** content are put aside while members are scanned.
+	 **/
+	void expandInput(void) {
+		ScanRuleMatchList outer_matches;
+		outer_matches.swap(rule_matches);
+
+		if (scan_req_->buffer) {
+			expandContainer((const uint8_t*) scan_req_->buffer + scan_req_->offset,
+					scan_req_->length, "", "", 0);
+		} else if (scan_req_->filename.length()) {
+			int fd = open(scan_req_->filename.c_str(), O_RDONLY);
+			if (fd < 0)
+				yara_throw(YaraError, "open(" << scan_req_->filename.c_str()
+						<< ") failed: " << yara_strerror(errno));
+
+			struct stat st;
+			if (fstat(fd, &st) < 0) {
+				int error = errno;
+				close(fd);
+				yara_throw(YaraError, "fstat(" << scan_req_->filename.c_str()
+						<< ") failed: " << yara_strerror(error));
+			}
+
+			if (S_ISREG(st.st_mode) && st.st_size > 0) {
+				void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (map == MAP_FAILED) {
+					int error = errno;
+					close(fd);
+					yara_throw(YaraError, "mmap(" << scan_req_->filename.c_str()
+							<< ") failed: " << yara_strerror(error));
+				}
+
+				madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+				size_t slash = scan_req_->filename.rfind('/');
+				std::string name = (slash == std::string::npos)
+						? scan_req_->filename
+						: scan_req_->filename.substr(slash + 1);
+
+				expandContainer((const uint8_t*) map, st.st_size, "", name, 0);
+
+				munmap(map, st.st_size);
+			}
+
+			close(fd);
+		}
+
+		rule_matches.swap(outer_matches);
+	}
+
+	void expandContainer(const uint8_t* data, size_t length,
+			const std::string& path, const std::string& name, uint32_t depth) {
+		const ExpandReq& expand = scan_req_->expand;
+
+		if (depth >= expand.max_depth || expand_truncated_)
+			return;
+
+		if ((expand.formats & EXPAND_GZIP) && length >= 18
+				&& data[0] == 0x1f && data[1] == 0x8b)
+			expandGzip(data, length, path, name, depth);
+		else if ((expand.formats & EXPAND_ZIP) && length >= 30
+				&& memcmp(data, "PK\x03\x04", 4) == 0)
+			expandZip(data, length, path, depth);
+		else if ((expand.formats & EXPAND_TAR) && length >= 512
+				&& memcmp(data + 257, "ustar", 5) == 0)
+			expandTar(data, length, path, depth);
+	}
+
+	/**
+	 ** Add a member, returning NULL if that would exceed the maxMembers or
+	 ** maxTotalBytes limits, in which case expansion stops.
+	 **/
+	ScanMember* addMember(const std::string& path, int64_t size) {
+		if (members_.size() >= scan_req_->expand.max_members) {
+			expand_truncated_ = "maxMembers";
+			return NULL;
+		}
+
+		if (expanded_bytes_ + size > scan_req_->expand.max_total_bytes) {
+			expand_truncated_ = "maxTotalBytes";
+			return NULL;
+		}
+
+		expanded_bytes_ += size;
+
+		ScanMember* member = new ScanMember();
+		member->path = path;
+		members_.push_back(member);
+
+		return member;
+	}
+
+	void addMemberError(const std::string& path, const std::string& error) {
+		ScanMember* member = addMember(path, 0);
+		if (member)
+			member->error = error;
+	}
+
+	void scanMember(const uint8_t* data, size_t length, const std::string& path,
+			const std::string& name, uint32_t depth) {
+		ScanMember* member = addMember(path, length);
+		if (! member)
+			return;
+
+		if (bytes_scanned >= 0)
+			bytes_scanned += length;
+
+		// Module data for the outer content is put aside, like its matches
+		std::map<std::string, std::string> outer_module_datas;
+		outer_module_datas.swap(module_datas);
+
+		int rc = yr_rules_scan_mem(
+				scan_rules_,
+				(uint8_t*) data,
+				length,
+				scan_req_->flags,
+				scanCallback,
+				(void*) this,
+				scan_req_->timeout
+			);
+
+		member->rule_matches.swap(rule_matches);
+		member->module_datas.swap(module_datas);
+		module_datas.swap(outer_module_datas);
+
+		// Only the error is returned for members which could not be scanned
+		if (rc != ERROR_SUCCESS) {
+			member->error = std::string("yr_rules_scan_mem() failed: ")
+					+ getErrorString(rc);
+			freeMatchBytes(&member->rule_matches);
+			freeRuleMatches(&member->rule_matches);
+			return;
+		}
+
+		expandContainer(data, length, path, name, depth + 1);
+	}
+
+	/**
+	 ** Inflate a zlib stream into a pooled buffer which grows as required, up
+	 ** to the bytes remaining under maxTotalBytes.  Returns false, with error
+	 ** set, if the stream is invalid or too large, otherwise consumed is set to
+	 ** the number of bytes of data the stream occupied.
+	 **/
+	bool inflateMember(const uint8_t* data, size_t length, int window_bits,
+			size_t size_hint, PoolBuffer* buffer, size_t* out_length,
+			size_t* consumed, std::string* error) {
+		int64_t remaining = scan_req_->expand.max_total_bytes - expanded_bytes_;
+		if (remaining < 0)
+			remaining = 0;
+
+		// One byte more than allowed is required to know a stream is too large,
+		// and size hints come from the input so are not trusted beyond the
+		// largest pooled buffer
+		size_t limit = remaining + 1;
+		size_t capacity = size_hint ? size_hint : EXPAND_INITIAL_BUFFER_SIZE;
+		if (capacity > BUFFER_POOL_MAX_BUFFER_SIZE)
+			capacity = BUFFER_POOL_MAX_BUFFER_SIZE;
+		if (capacity > limit)
+			capacity = limit;
+
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+
+		if (inflateInit2(&zs, window_bits) != Z_OK) {
+			*error = "inflateInit2() failed";
+			return false;
+		}
+
+		if (! buffer_pool.get(capacity, buffer)) {
+			inflateEnd(&zs);
+			*error = "malloc() failed";
+			return false;
+		}
+
+		size_t total_in = 0;
+		size_t total_out = 0;
+		bool ok = false;
+
+		while (true) {
+			if (zs.avail_in == 0 && total_in < length) {
+				zs.next_in = (Bytef*) data + total_in;
+				zs.avail_in = std::min(length - total_in, (size_t) UINT_MAX);
+			}
+
+			size_t usable = std::min(buffer->capacity, limit);
+
+			if (total_out == usable) {
+				if (usable >= limit) {
+					expand_truncated_ = "maxTotalBytes";
+					*error = "Member exceeds maxTotalBytes";
+					break;
+				}
+
+				PoolBuffer larger;
+				if (! buffer_pool.get(std::min(buffer->capacity * 2, limit), &larger)) {
+					*error = "malloc() failed";
+					break;
+				}
+
+				memcpy(larger.data, buffer->data, total_out);
+				buffer_pool.put(buffer);
+				*buffer = larger;
+				usable = std::min(buffer->capacity, limit);
+			}
+
+			zs.next_out = buffer->data + total_out;
+			zs.avail_out = std::min(usable - total_out, (size_t) UINT_MAX);
+
+			uInt avail_in = zs.avail_in;
+			uInt avail_out = zs.avail_out;
+
+			int rc = inflate(&zs, Z_NO_FLUSH);
+
+			total_in += avail_in - zs.avail_in;
+			total_out += avail_out - zs.avail_out;
+
+			if (rc == Z_STREAM_END) {
+				ok = true;
+				break;
+			} else if (rc == Z_BUF_ERROR && zs.avail_in == 0 && total_in == length) {
+				*error = "Compressed data is truncated";
+				break;
+			} else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+				*error = std::string("inflate() failed: ")
+						+ (zs.msg ? zs.msg : "unknown error");
+				break;
+			}
+		}
+
+		inflateEnd(&zs);
+
+		if (! ok) {
+			buffer_pool.put(buffer);
+			return false;
+		}
+
+		*out_length = total_out;
+		*consumed = total_in;
+
+		return true;
+	}
+
+	void expandGzip(const uint8_t* data, size_t length, const std::string& path,
+			const std::string& name, uint32_t depth) {
+		uint8_t gzip_flags = data[3];
+		size_t offset = 10;
+
+		// FEXTRA, then FNAME holding the name of the compressed file
+		if (gzip_flags & 0x04) {
+			if (offset + 2 > length) {
+				addMemberError(joinMemberPath(path, name), "Invalid gzip header");
+				return;
+			}
+
+			offset += 2 + readLe16(data + offset);
+		}
+
+		std::string member_name;
+
+		if ((gzip_flags & 0x08) && offset < length) {
+			member_name = std::string((const char*) data + offset,
+					strnlen((const char*) data + offset, length - offset));
+
+			size_t slash = member_name.rfind('/');
+			if (slash != std::string::npos)
+				member_name = member_name.substr(slash + 1);
+		}
+
+		if (! member_name.length()) {
+			member_name = name;
+
+			if (member_name.length() > 4 && member_name.compare(member_name.length() - 4, 4, ".tgz") == 0)
+				member_name = member_name.substr(0, member_name.length() - 4) + ".tar";
+			else if (member_name.length() > 3 && member_name.compare(member_name.length() - 3, 3, ".gz") == 0)
+				member_name = member_name.substr(0, member_name.length() - 3);
+			else
+				member_name = "data";
+		}
+
+		std::string member_path = joinMemberPath(path, member_name);
+
+		// The trailer holds the uncompressed size modulo 2^32, which is only
+		// used as a hint
+		size_t size_hint = readLe32(data + length - 4);
+
+		PoolBuffer buffer;
+		size_t out_length;
+		size_t consumed;
+		std::string error;
+
+		if (! inflateMember(data, length, 15 + 16, size_hint, &buffer,
+				&out_length, &consumed, &error)) {
+			addMemberError(member_path, error);
+			return;
+		}
+
+		scanMember(buffer.data, out_length, member_path, member_name, depth);
+
+		buffer_pool.put(&buffer);
+	}
+
+	void expandTar(const uint8_t* data, size_t length, const std::string& path,
+			uint32_t depth) {
+		std::string long_name;
+		std::string pax_name;
+		int64_t pax_size = -1;
+		size_t offset = 0;
+
+		while (offset + 512 <= length && ! expand_truncated_) {
+			const uint8_t* header = data + offset;
+
+			// The archive ends with two zero blocks
+			if (header[0] == 0)
+				break;
+
+			if (memcmp(header + 257, "ustar", 5) != 0) {
+				addMemberError(path, "Invalid tar header");
+				break;
+			}
+
+			int64_t size = parseTarNumber(header + 124, 12);
+			char type = header[156];
+
+			std::string name;
+
+			// A PAX extended header overrides both the name and size of the
+			// member following it
+			if (pax_name.length()) {
+				name = pax_name;
+				pax_name.clear();
+				long_name.clear();
+			} else if (long_name.length()) {
+				name = long_name;
+				long_name.clear();
+			} else {
+				std::string prefix = tarString(header + 345, 155);
+				name = tarString(header, 100);
+				if (prefix.length())
+					name = prefix + "/" + name;
+			}
+
+			if (pax_size >= 0 && type != 'x' && type != 'g') {
+				size = pax_size;
+				pax_size = -1;
+			}
+
+			size_t data_offset = offset + 512;
+
+			if (size < 0 || (uint64_t) size > length - data_offset) {
+				addMemberError(joinMemberPath(path, name), "Tar member is truncated");
+				break;
+			}
+
+			if (type == 'L') {
+				long_name = tarString(data + data_offset, size);
+			} else if (type == 'x') {
+				parsePaxHeader(data + data_offset, size, &pax_name, &pax_size);
+			} else if (type == '0' || type == '\0' || type == '7') {
+				size_t slash = name.rfind('/');
+				std::string base = (slash == std::string::npos) ? name : name.substr(slash + 1);
+
+				scanMember(data + data_offset, size, joinMemberPath(path, name), base, depth);
+			}
+
+			offset = data_offset + (((size + 511) / 512) * 512);
+		}
+	}
+
+	/**
+	 ** Members are found by walking local file headers, so the central
+	 ** directory at the end of the archive is never needed.  When sizes are
+	 ** only recorded after a member's data, in a data descriptor, deflated
+	 ** members can still be found since the deflate stream marks its end.
+	 **/
+	void expandZip(const uint8_t* data, size_t length, const std::string& path,
+			uint32_t depth) {
+		size_t offset = 0;
+
+		while (offset + 30 <= length && ! expand_truncated_
+				&& memcmp(data + offset, "PK\x03\x04", 4) == 0) {
+			const uint8_t* header = data + offset;
+
+			uint16_t zip_flags = readLe16(header + 6);
+			uint16_t method = readLe16(header + 8);
+			uint64_t compressed_size = readLe32(header + 18);
+			uint64_t size = readLe32(header + 22);
+			uint16_t name_length = readLe16(header + 26);
+			uint16_t extra_length = readLe16(header + 28);
+
+			size_t data_offset = offset + 30 + name_length + extra_length;
+
+			if (data_offset > length) {
+				addMemberError(path, "Invalid zip header");
+				break;
+			}
+
+			std::string name((const char*) header + 30, name_length);
+			std::string member_path = joinMemberPath(path, name);
+
+			// Sizes too large for the header are held in the zip64 extra field
+			bool zip64 = false;
+			const uint8_t* extra = header + 30 + name_length;
+
+			for (size_t i = 0; i + 4 <= extra_length; ) {
+				uint16_t id = readLe16(extra + i);
+				uint16_t field_length = readLe16(extra + i + 2);
+
+				if (id == 0x0001 && i + 4 + field_length <= extra_length) {
+					size_t field = i + 4;
+					zip64 = true;
+
+					if (size == 0xffffffff && field + 8 <= i + 4 + field_length) {
+						size = readLe64(extra + field);
+						field += 8;
+					}
+
+					if (compressed_size == 0xffffffff && field + 8 <= i + 4 + field_length)
+						compressed_size = readLe64(extra + field);
+				}
+
+				i += 4 + field_length;
+			}
+
+			bool descriptor = (zip_flags & 0x08) ? true : false;
+
+			if (descriptor && method != 8) {
+				addMemberError(member_path, "Zip member size is unknown");
+				break;
+			}
+
+			if (! descriptor && compressed_size > length - data_offset) {
+				addMemberError(member_path, "Zip member is truncated");
+				break;
+			}
+
+			size_t consumed = compressed_size;
+			size_t slash = name.rfind('/');
+			std::string base = (slash == std::string::npos) ? name : name.substr(slash + 1);
+
+			if (name.length() && name[name.length() - 1] == '/') {
+				// Directories have no content
+			} else if (zip_flags & 0x01) {
+				addMemberError(member_path, "Zip member is encrypted");
+			} else if (method == 0) {
+				scanMember(data + data_offset, compressed_size, member_path, base, depth);
+			} else if (method == 8) {
+				PoolBuffer buffer;
+				size_t out_length;
+				std::string error;
+
+				if (inflateMember(data + data_offset, descriptor ? length - data_offset : compressed_size,
+						-15, descriptor ? 0 : size, &buffer, &out_length, &consumed, &error)) {
+					scanMember(buffer.data, out_length, member_path, base, depth);
+					buffer_pool.put(&buffer);
+				} else {
+					addMemberError(member_path, error);
+					if (descriptor)
+						break;
+				}
+			} else {
+				std::ostringstream oss;
+				oss << "Zip compression method " << method << " is not supported";
+				addMemberError(member_path, oss.str());
+			}
+
+			offset = data_offset + consumed;
+
+			if (descriptor) {
+				if (offset + 4 <= length && memcmp(data + offset, "PK\x07\x08", 4) == 0)
+					offset += 4;
+				offset += zip64 ? 20 : 12;
+			}
+		}
+	}
+
+	/**
+	 ** Open the requested file once, and when it is no larger than the
+	 ** requests read limit read it into a pooled buffer and scan it from
+	 ** memory, avoiding the cost of mapping, and page faulting, small files.
+	 ** Larger files are scanned using the already open file descriptor.
+	 **/
+	int scanFileRead(const char** scan_function) {
+		int rc;
+
+		int fd = open(scan_req_->filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			yara_throw(YaraError, "open(" << scan_req_->filename.c_str()
+					<< ") failed: " << yara_strerror(errno));
+
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			int error = errno;
+			close(fd);
+			yara_throw(YaraError, "fstat(" << scan_req_->filename.c_str()
+					<< ") failed: " << yara_strerror(error));
+		}
+
+		if (S_ISREG(st.st_mode) && st.st_size <= scan_req_->read_limit) {
+			PoolBuffer buffer;
+
+			if (! buffer_pool.get(st.st_size, &buffer)) {
+				close(fd);
+				yara_throw(YaraError, "malloc(" << st.st_size << ") failed");
+			}
+
+			ssize_t length = readFile(fd, buffer.data, st.st_size, 0);
+			int error = errno;
+
+			close(fd);
+
+			if (length < 0) {
+				buffer_pool.put(&buffer);
+				yara_throw(YaraError, "read(" << scan_req_->filename.c_str()
+						<< ") failed: " << yara_strerror(error));
+			}
+
+			bytes_scanned = length;
+
+			*scan_function = "yr_rules_scan_mem";
+			rc = yr_rules_scan_mem(
+					scan_rules_,
+					buffer.data,
+					length,
+					scan_req_->flags,
+					scanCallback,
+					(void*) this,
+					scan_req_->timeout
+				);
+
+			buffer_pool.put(&buffer);
+		} else {
+			bytes_scanned = st.st_size;
+
+			*scan_function = "yr_rules_scan_fd";
+			rc = yr_rules_scan_fd(
+					scan_rules_,
+					fd,
+					scan_req_->flags,
+					scanCallback,
+					(void*) this,
+					scan_req_->timeout
+				);
+
+			close(fd);
+		}
+
+		return rc;
 	}
 
-	~AsyncScan() {
-		ScanRuleMatch* rule_match;
-		ScanRuleMatchList::iterator rule_matches_it;
+	/**
+	 ** Read one region of a processes memory from /proc/<pid>/mem into a
+	 ** pooled buffer and scan it as a single memory block based at the regions
+	 ** address, so match offsets are addresses in the process.  Unlike
+	 ** yr_rules_scan_proc() this does not attach to, and stop, the process.
+	 **/
+	int scanProcessRegion(const char** scan_function) {
+		int rc;
 
-		MatchData* match_data;
-		std::list<MatchData*>::iterator match_data_it;
+		std::ostringstream path;
+		path << "/proc/" << scan_req_->pid << "/mem";
 
-		for (rule_matches_it = rule_matches.begin();
-				rule_matches_it != rule_matches.end();
-				rule_matches_it++) {
-			rule_match = *rule_matches_it;
+		int fd = open(path.str().c_str(), O_RDONLY);
+		if (fd < 0)
+			yara_throw(YaraError, "open(" << path.str().c_str()
+					<< ") failed: " << yara_strerror(errno));
 
-			for (match_data_it = rule_match->datas.begin();
-					match_data_it != rule_match->datas.end();
-					match_data_it++) {
-				match_data = *match_data_it;
-				delete match_data;
-			}
+		PoolBuffer buffer;
+
+		if (! buffer_pool.get(scan_req_->size, &buffer)) {
+			close(fd);
+			yara_throw(YaraError, "malloc(" << scan_req_->size << ") failed");
+		}
+
+		ssize_t length = readFile(fd, buffer.data, scan_req_->size,
+				scan_req_->address);
+		int error = errno;
 
-			rule_match->datas.clear();
+		close(fd);
 
-			delete rule_match;
+		if (length < 0) {
+			buffer_pool.put(&buffer);
+			yara_throw(YaraError, "read(" << path.str().c_str()
+					<< ") failed: " << yara_strerror(error));
 		}
 
-		rule_matches.clear();
+		ScanBlockList blocks;
+		ScanBlock block;
+		block.buffer = (const char*) buffer.data;
+		block.length = length;
+		blocks.push_back(block);
+
+		bytes_scanned = length;
+
+		ScanBlockIterator scan_iterator;
+		scanBlockIteratorInit(&scan_iterator, &blocks, scan_req_->address);
+
+		*scan_function = "yr_rules_scan_mem_blocks";
+		rc = yr_rules_scan_mem_blocks(
+				scan_rules_,
+				&scan_iterator.iterator,
+				scan_req_->flags,
+				scanCallback,
+				(void*) this,
+				scan_req_->timeout
+			);
+
+		buffer_pool.put(&buffer);
+
+		return rc;
 	}
 
-	void Execute() {
-		scanner_->lock_read();
+	bool overMatchLimits(int64_t string_matches) {
+		if (max_matches_per_string >= 0 && string_matches >= max_matches_per_string)
+			return true;
+		if (max_matches_total >= 0 && matches_total >= max_matches_total)
+			return true;
+		return false;
+	}
 
-		try {
-			int rc;
+	bool overResultBytes(int64_t bytes) {
+		if (max_result_bytes >= 0 && (result_bytes + bytes) > max_result_bytes)
+			return true;
+		return false;
+	}
 
-			if (scan_req_->filename.length()) {
-				rc = yr_rules_scan_file(
-						scanner_->rules,
-						scan_req_->filename.c_str(),
-						scan_req_->flags,
-						scanCallback,
-						(void*) this,
-						scan_req_->timeout
-					);
-			} else if (scan_req_->buffer) {
-				rc = yr_rules_scan_mem(
-						scanner_->rules,
-						(uint8_t*) scan_req_->buffer + scan_req_->offset,
-						scan_req_->length,
-						scan_req_->flags,
-						scanCallback,
-						(void*) this,
-						scan_req_->timeout
-					);
-			} else {
-				yara_throw(YaraError, "Either filename of buffer is required");
-			}
+	void addModuleData(YR_OBJECT* module) {
+		ModuleDataMap::iterator module_data_it
+				= scan_req_->module_data.find(module->identifier);
 
-			if (rc != ERROR_SUCCESS)
-				yara_throw(YaraError,
-						(scan_req_->filename.length() ? "yr_rules_scan_file" : "yr_rules_scan_mem")
-						<< "() failed: " << getErrorString(rc));
-		} catch(std::exception& error) {
-			SetErrorMessage(error.what());
-		}
+		if (module_data_it == scan_req_->module_data.end())
+			return;
+
+		std::string& json = module_datas[module->identifier];
+		json = moduleDataToJson(module, module_data_it->second);
 
-		scanner_->unlock();
+		result_bytes += json.length();
+		addScanBytes(json.length());
 	}
 
 	ScanRuleMatchList rule_matches;
 	int32_t matched_bytes;
+	uint32_t batch_size;
+
+	// Limits on the matches included in results, -1 means no limit
+	int64_t max_matches_per_string;
+	int64_t max_matches_total;
+	int64_t max_result_bytes;
+
+	int64_t matches_total;
+	int64_t matches_truncated;
+	int64_t result_bytes;
+
+	// JSON for each module selected using the moduleData request attribute
+	std::map<std::string, std::string> module_datas;
+
+	// One of the SCAN_OUTPUT_* values, when not SCAN_OUTPUT_NONE the result
+	// is encoded by Execute() and returned as a Buffer
+	int output;
+
+	// Whether the scan may be captured by the capture spool
+	bool capture;
+
+	// Cost accounting, only included in results when stats is true
+	bool stats;
+	int64_t rules_matched;
+	int64_t rules_not_matched;
+	int64_t bytes_scanned;
+	bool timed_out;
+	bool aborted;
+	uint64_t queued_ns;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	int64_t cpu_ns;
 
 protected:
 
 	void HandleOKCallback() {
+		if (output_data_) {
+			Local<Value> argv[2];
+			argv[0] = Nan::Null();
+			argv[1] = Nan::NewBuffer(output_data_, output_length_, freeReadFile, NULL).ToLocalChecked();
+			output_data_ = NULL;
+			callback->Call(2, argv, async_resource);
+			return;
+		}
 
 		Local<Object> res = Nan::New<Object>();
 
-		Local<Array> rules = Nan::New<Array>();
-		int rules_index = 0;
+		Local<Array> rules = ruleMatchesToArray(&rule_matches);
 
-		for (ScanRuleMatchList::iterator rule_matches_it = rule_matches.begin();
-				rule_matches_it != rule_matches.end();
-				rule_matches_it++) {
-			ScanRuleMatch* rule_match = *rule_matches_it;
+		Nan::Set(res, Nan::New("rules").ToLocalChecked(), rules);
 
-			Local<Object> rule = Nan::New<Object>();
+		if (matches_truncated > 0)
+			Nan::Set(res, Nan::New("truncated").ToLocalChecked(), Nan::New<Number>(matches_truncated));
 
-			Local<Array> tags = Nan::New<Array>();
-			int tags_index = 0;
+		if (stats)
+			Nan::Set(res, Nan::New("stats").ToLocalChecked(), statsToObject());
 
-			for (std::list<std::string>::iterator tags_it = rule_match->tags.begin();
-					tags_it != rule_match->tags.end();
-					tags_it++) {
-				Local<String> tag = Nan::New((*tags_it).c_str()).ToLocalChecked();
-				Nan::Set(tags, tags_index++, tag);
-			}
+		if (filtered_)
+			Nan::Set(res, Nan::New("filtered").ToLocalChecked(), Nan::New(filtered_).ToLocalChecked());
 
-			Local<Array> metas = Nan::New<Array>();
-			int metas_index = 0;
+		if (sha256_.length())
+			Nan::Set(res, Nan::New("sha256").ToLocalChecked(), Nan::New(sha256_.c_str()).ToLocalChecked());
 
-			for (std::list<std::string>::iterator metas_it = rule_match->metas.begin();
-					metas_it != rule_match->metas.end();
-					metas_it++) {
-				Local<String> meta = Nan::New((*metas_it).c_str()).ToLocalChecked();
-				Nan::Set(metas, metas_index++, meta);
-			}
+		if (scan_req_->expand.formats) {
+			Local<Array> members = Nan::New<Array>();
+			uint32_t index = 0;
 
-			Local<Array> matches = Nan::New<Array>();
-			int matches_index = 0;
+			for (ScanMemberList::iterator members_it = members_.begin();
+					members_it != members_.end();
+					members_it++) {
+				ScanMember* member = *members_it;
+				Local<Object> obj = Nan::New<Object>();
 
-			for (std::list<std::string>::iterator matches_it = rule_match->matches.begin();
-					matches_it != rule_match->matches.end();
-					matches_it++) {
-				Local<String> match = Nan::New((*matches_it).c_str()).ToLocalChecked();
-				Nan::Set(matches, matches_index++, match);
-			}
+				Nan::Set(obj, Nan::New("path").ToLocalChecked(), Nan::New(member->path.c_str()).ToLocalChecked());
 
-			Local<Array> datas = Nan::New<Array>();
-			int datas_index = 0;
+				if (member->error.length())
+					Nan::Set(obj, Nan::New("error").ToLocalChecked(), Nan::New(member->error.c_str()).ToLocalChecked());
+				else
+					Nan::Set(obj, Nan::New("rules").ToLocalChecked(), ruleMatchesToArray(&member->rule_matches));
+
+				if (member->module_datas.size())
+					Nan::Set(obj, Nan::New("modules").ToLocalChecked(), moduleDatasToObject(&member->module_datas));
 
-			for (std::list<MatchData*>::iterator datas_it = rule_match->datas.begin();
-					datas_it != rule_match->datas.end();
-					datas_it++) {
-				Local<Object> data = Nan::NewBuffer((char*) (*datas_it)->bytes, (*datas_it)->length).ToLocalChecked();
-				Nan::Set(datas, datas_index++, data);
+				Nan::Set(members, index++, obj);
 			}
 
-			Nan::Set(rule, Nan::New("id").ToLocalChecked(), Nan::New(rule_match->id.c_str()).ToLocalChecked());
-			Nan::Set(rule, Nan::New("tags").ToLocalChecked(), tags);
-			Nan::Set(rule, Nan::New("metas").ToLocalChecked(), metas);
-			Nan::Set(rule, Nan::New("matches").ToLocalChecked(), matches);
-			Nan::Set(rule, Nan::New("datas").ToLocalChecked(), datas);
+			Nan::Set(res, Nan::New("members").ToLocalChecked(), members);
 
-			Nan::Set(rules, rules_index++, rule);
+			if (expand_truncated_)
+				Nan::Set(res, Nan::New("expandTruncated").ToLocalChecked(), Nan::New(expand_truncated_).ToLocalChecked());
 		}
 
-		Nan::Set(res, Nan::New("rules").ToLocalChecked(), rules);
+		if (module_datas.size())
+			Nan::Set(res, Nan::New("modules").ToLocalChecked(), moduleDatasToObject(&module_datas));
 
 		Local<Value> argv[2];
 		argv[0] = Nan::Null();
@@ -857,11 +5950,421 @@ protected:
 		callback->Call(2, argv, async_resource);
 	}
 
+	void HandleErrorCallback() {
+		Local<Object> error = Nan::To<Object>(Nan::Error(ErrorMessage())).ToLocalChecked();
+
+		if (stats)
+			Nan::Set(error, Nan::New("stats").ToLocalChecked(), statsToObject());
+
+		Local<Value> argv[1];
+		argv[0] = error;
+		callback->Call(1, argv, async_resource);
+	}
+
+	Local<Object> statsToObject(void) {
+		Local<Object> obj = Nan::New<Object>();
+
+		Nan::Set(obj, Nan::New("queueWaitMs").ToLocalChecked(), Nan::New<Number>((start_ns - queued_ns) / 1e6));
+		Nan::Set(obj, Nan::New("wallMs").ToLocalChecked(), Nan::New<Number>((end_ns - start_ns) / 1e6));
+		Nan::Set(obj, Nan::New("cpuMs").ToLocalChecked(), Nan::New<Number>(cpu_ns / 1e6));
+
+		if (bytes_scanned >= 0)
+			Nan::Set(obj, Nan::New("bytes").ToLocalChecked(), Nan::New<Number>((double) bytes_scanned));
+		else
+			Nan::Set(obj, Nan::New("bytes").ToLocalChecked(), Nan::Null());
+
+		Nan::Set(obj, Nan::New("rulesMatched").ToLocalChecked(), Nan::New<Number>((double) rules_matched));
+		Nan::Set(obj, Nan::New("rulesEvaluated").ToLocalChecked(), Nan::New<Number>((double) (rules_matched + rules_not_matched)));
+		Nan::Set(obj, Nan::New("matches").ToLocalChecked(), Nan::New<Number>((double) (matches_total + matches_truncated)));
+		Nan::Set(obj, Nan::New("timedOut").ToLocalChecked(), Nan::New<Boolean>(timed_out));
+		Nan::Set(obj, Nan::New("aborted").ToLocalChecked(), Nan::New<Boolean>(aborted));
+
+		return obj;
+	}
+
 private:
 	ScannerWrap* scanner_;
+	RulesHandle* rules_;
+	Allowlist* allowlist_;
 	ScanReq* scan_req_;
+
+	// The copy of the rules used by Execute(), and the CPUs the pool thread
+	// could run on before it was pinned to the node of that copy
+	YR_RULES* scan_rules_;
+#ifdef __linux__
+	cpu_set_t previous_cpus_;
+#endif
+
+	Nan::Callback* rules_callback_;
+	uv_async_t* async_;
+	pthread_mutex_t stream_mutex_;
+	pthread_cond_t stream_cond_;
+	std::list<ScanRuleMatchList*> stream_batches_;
+
+	uint32_t stream_id_;
+	bool stream_paused_;
+	std::atomic<bool> stream_aborted_;
+
+	// Whether the scheduler counted this scan against the large scan share
+	bool large_;
+
+	// Why the input was not scanned, and its digest when it was hashed
+	const char* filtered_;
+	std::string sha256_;
+
+	// Members of expanded containers, and which limit stopped expansion
+	ScanMemberList members_;
+	int64_t expanded_bytes_;
+	const char* expand_truncated_;
+
+	// Whether Destroy() hands the scan to AsyncCapture, and what Execute()
+	// reserved for it, including the times it records, since the scan's own
+	// stats exclude capturing
+	bool capture_pending_;
+	uint64_t capture_wall_ns_;
+	int64_t capture_cpu_ns_;
+	CaptureConfig capture_config_;
+	int64_t capture_size_;
+	bool capture_copy_input_;
+	bool capture_save_rules_;
+	int64_t capture_reserved_;
+	uint64_t capture_sequence_;
+
+	// The encoded result when output is specified, freed by the Buffer it is
+	// given to
+	char* output_data_;
+	size_t output_length_;
+};
+
+/**
+ ** Writes the capture of a completed scan on its own pool thread, outside the
+ ** scheduler, then deletes the scan, whose persistent handles keep buffers
+ ** scanned alive until then.
+ **/
+class AsyncCapture : public Nan::AsyncWorker {
+public:
+	AsyncCapture(AsyncScan* async_scan)
+			: Nan::AsyncWorker(NULL), async_scan_(async_scan) {}
+
+	~AsyncCapture() {
+		delete async_scan_;
+	}
+
+	void Execute() {
+		async_scan_->captureScan();
+	}
+
+protected:
+	void HandleOKCallback() {}
+
+private:
+	AsyncScan* async_scan_;
+};
+
+void AsyncScan::Destroy() {
+	if (capture_pending_)
+		Nan::AsyncQueueWorker(new AsyncCapture(this));
+	else
+		delete this;
+}
+
+/**
+ ** Scans are queued here instead of directly with libuv, which runs work in
+ ** FIFO order, so that a few very large scans cannot occupy every thread in
+ ** the pool while small scans wait behind them.  At most threads scans are
+ ** given to libuv at once, scans of at least large_bytes are queued
+ ** separately and at most large_threads of them run at once, leaving the
+ ** remaining threads for small scans.  Only used on the main thread.
+ **/
+#define SCHEDULER_DEFAULT_THREADS 4
+#define SCHEDULER_MAX_THREADS 1024
+#define SCHEDULER_DEFAULT_LARGE_BYTES (16 * 1024 * 1024)
+#define SCHEDULER_DEFAULT_LARGE_SHARE 0.5
+
+class ScanScheduler {
+public:
+	ScanScheduler() : running_(0), large_running_(0) {
+		const char* env = getenv("UV_THREADPOOL_SIZE");
+		int threads = env ? atoi(env) : 0;
+
+		if (threads < 1)
+			threads = SCHEDULER_DEFAULT_THREADS;
+		else if (threads > SCHEDULER_MAX_THREADS)
+			threads = SCHEDULER_MAX_THREADS;
+
+		configure(threads, SCHEDULER_DEFAULT_LARGE_BYTES,
+				SCHEDULER_DEFAULT_LARGE_SHARE);
+	}
+
+	void configure(uint32_t threads, int64_t large_bytes, double large_share) {
+		threads_ = threads;
+		large_bytes_ = large_bytes;
+		large_share_ = large_share;
+
+		large_threads_ = floor(threads * large_share);
+		if (large_threads_ < 1)
+			large_threads_ = 1;
+
+		dispatch();
+	}
+
+	void queue(AsyncScan* async_scan, int64_t cost) {
+		if (cost >= large_bytes_)
+			large_.push_back(async_scan);
+		else
+			small_.push_back(async_scan);
+
+		dispatch();
+	}
+
+	void completed(bool large) {
+		running_--;
+		if (large)
+			large_running_--;
+
+		dispatch();
+	}
+
+	uint32_t threads(void) { return threads_; }
+	int64_t large_bytes(void) { return large_bytes_; }
+	double large_share(void) { return large_share_; }
+	uint32_t running(void) { return running_; }
+	uint32_t large_running(void) { return large_running_; }
+	size_t small_queued(void) { return small_.size(); }
+	size_t large_queued(void) { return large_.size(); }
+
+private:
+	/**
+	 ** Large scans are started first, while below their share, since they
+	 ** cannot otherwise make progress while small scans keep arriving, and
+	 ** any other free threads are given to small scans.
+	 **/
+	void dispatch(void) {
+		while (running_ < threads_) {
+			AsyncScan* async_scan;
+
+			if (large_.size() && large_running_ < large_threads_) {
+				async_scan = large_.front();
+				large_.pop_front();
+				large_running_++;
+				async_scan->scheduled(true);
+			} else if (small_.size()) {
+				async_scan = small_.front();
+				small_.pop_front();
+				async_scan->scheduled(false);
+			} else {
+				break;
+			}
+
+			running_++;
+			Nan::AsyncQueueWorker(async_scan);
+		}
+	}
+
+	uint32_t threads_;
+	int64_t large_bytes_;
+	double large_share_;
+	uint32_t large_threads_;
+
+	uint32_t running_;
+	uint32_t large_running_;
+
+	std::list<AsyncScan*> small_;
+	std::list<AsyncScan*> large_;
 };
 
+ScanScheduler scan_scheduler;
+
+void scanCompleted(bool large) {
+	scan_scheduler.completed(large);
+}
+
+NAN_METHOD(ConfigureScheduler) {
+	Nan::HandleScope scope;
+
+	if (info.Length() < 1) {
+		Nan::ThrowError("One argument is required");
+		return;
+	}
+
+	if (! info[0]->IsObject()) {
+		Nan::ThrowError("Options argument must be an object");
+		return;
+	}
+
+	Local<Object> options = Nan::To<Object>(info[0]).ToLocalChecked();
+
+	uint32_t threads = scan_scheduler.threads();
+	int64_t large_bytes = scan_scheduler.large_bytes();
+	double large_share = scan_scheduler.large_share();
+
+	if (Nan::Get(options, Nan::New("threads").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(options, Nan::New("threads").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() < 1 || n->Value() > SCHEDULER_MAX_THREADS) {
+			Nan::ThrowError("Threads is out of bounds");
+			return;
+		} else {
+			threads = n->Value();
+		}
+	}
+
+	if (Nan::Get(options, Nan::New("largeScanBytes").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(options, Nan::New("largeScanBytes").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() < 1) {
+			Nan::ThrowError("Large scan bytes is out of bounds");
+			return;
+		} else {
+			large_bytes = n->Value();
+		}
+	}
+
+	if (Nan::Get(options, Nan::New("largeScanShare").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(options, Nan::New("largeScanShare").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (! (n->Value() > 0 && n->Value() <= 1)) {
+			Nan::ThrowError("Large scan share is out of bounds");
+			return;
+		} else {
+			large_share = n->Value();
+		}
+	}
+
+	scan_scheduler.configure(threads, large_bytes, large_share);
+}
+
+NAN_METHOD(SchedulerStats) {
+	Nan::HandleScope scope;
+
+	Local<Object> stats = Nan::New<Object>();
+
+	Nan::Set(stats, Nan::New("threads").ToLocalChecked(), Nan::New<Number>(scan_scheduler.threads()));
+	Nan::Set(stats, Nan::New("largeScanBytes").ToLocalChecked(), Nan::New<Number>((double) scan_scheduler.large_bytes()));
+	Nan::Set(stats, Nan::New("largeScanShare").ToLocalChecked(), Nan::New<Number>(scan_scheduler.large_share()));
+	Nan::Set(stats, Nan::New("running").ToLocalChecked(), Nan::New<Number>(scan_scheduler.running()));
+	Nan::Set(stats, Nan::New("largeRunning").ToLocalChecked(), Nan::New<Number>(scan_scheduler.large_running()));
+	Nan::Set(stats, Nan::New("smallQueued").ToLocalChecked(), Nan::New<Number>((double) scan_scheduler.small_queued()));
+	Nan::Set(stats, Nan::New("largeQueued").ToLocalChecked(), Nan::New<Number>((double) scan_scheduler.large_queued()));
+
+	info.GetReturnValue().Set(stats);
+}
+
+NAN_METHOD(ConfigureCapture) {
+	Nan::HandleScope scope;
+
+	if (info.Length() < 1) {
+		Nan::ThrowError("One argument is required");
+		return;
+	}
+
+	if (! info[0]->IsObject()) {
+		Nan::ThrowError("Options argument must be an object");
+		return;
+	}
+
+	Local<Object> options = Nan::To<Object>(info[0]).ToLocalChecked();
+
+	CaptureConfig config;
+	config.latency_ms = -1;
+	config.latency_ms_per_mb = 0;
+	config.timeouts = true;
+	config.max_captures = CAPTURE_DEFAULT_MAX_CAPTURES;
+	config.max_bytes = CAPTURE_DEFAULT_MAX_BYTES;
+	config.max_input_bytes = CAPTURE_DEFAULT_MAX_INPUT_BYTES;
+
+	if (Nan::Get(options, Nan::New("dir").ToLocalChecked()).ToLocalChecked()->IsString())
+		config.dir = *Nan::Utf8String(Nan::Get(options, Nan::New("dir").ToLocalChecked()).ToLocalChecked());
+
+	if (Nan::Get(options, Nan::New("latencyMs").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(options, Nan::New("latencyMs").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (! (n->Value() >= 0)) {
+			Nan::ThrowError("Latency ms is out of bounds");
+			return;
+		} else {
+			config.latency_ms = n->Value();
+		}
+	}
+
+	if (Nan::Get(options, Nan::New("latencyMsPerMB").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(options, Nan::New("latencyMsPerMB").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (! (n->Value() >= 0)) {
+			Nan::ThrowError("Latency ms per MB is out of bounds");
+			return;
+		} else {
+			config.latency_ms_per_mb = n->Value();
+		}
+	}
+
+	if (Nan::Get(options, Nan::New("timeouts").ToLocalChecked()).ToLocalChecked()->IsBoolean())
+		config.timeouts = Nan::To<Boolean>(Nan::Get(options, Nan::New("timeouts").ToLocalChecked()).ToLocalChecked()).ToLocalChecked()->Value();
+
+	if (Nan::Get(options, Nan::New("maxCaptures").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(options, Nan::New("maxCaptures").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() < 1) {
+			Nan::ThrowError("Max captures is out of bounds");
+			return;
+		} else {
+			config.max_captures = n->Value();
+		}
+	}
+
+	if (Nan::Get(options, Nan::New("maxBytes").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(options, Nan::New("maxBytes").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() < 1) {
+			Nan::ThrowError("Max bytes is out of bounds");
+			return;
+		} else {
+			config.max_bytes = n->Value();
+		}
+	}
+
+	if (Nan::Get(options, Nan::New("maxInputBytes").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(options, Nan::New("maxInputBytes").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() < 0) {
+			Nan::ThrowError("Max input bytes is out of bounds");
+			return;
+		} else {
+			config.max_input_bytes = n->Value();
+		}
+	}
+
+	int64_t captures = 0;
+	int64_t bytes = 0;
+
+	if (config.dir.length()) {
+		if (mkdir(config.dir.c_str(), 0700) != 0 && errno != EEXIST) {
+			std::ostringstream oss;
+			oss << "mkdir(" << config.dir << ") failed: " << yara_strerror(errno);
+			Nan::ThrowError(oss.str().c_str());
+			return;
+		}
+
+		// Captures left by earlier processes count against the limits
+		spoolUsage(config.dir, &captures, &bytes);
+	}
+
+	capture_spool.configure(config, captures, bytes);
+}
+
+NAN_METHOD(CaptureStats) {
+	Nan::HandleScope scope;
+
+	Local<Object> stats = Nan::New<Object>();
+
+	Nan::Set(stats, Nan::New("captures").ToLocalChecked(), Nan::New<Number>((double) capture_spool.captures()));
+	Nan::Set(stats, Nan::New("bytes").ToLocalChecked(), Nan::New<Number>((double) capture_spool.bytes()));
+	Nan::Set(stats, Nan::New("dropped").ToLocalChecked(), Nan::New<Number>((double) capture_spool.dropped()));
+	Nan::Set(stats, Nan::New("failed").ToLocalChecked(), Nan::New<Number>((double) capture_spool.failed()));
+
+	info.GetReturnValue().Set(stats);
+}
+
 int scanCallback(int message, void* data, void* param) {
 	AsyncScan* async_scan = (AsyncScan*) param;
 
@@ -872,15 +6375,24 @@ int scanCallback(int message, void* data, void* param) {
 	const char* tag;
 	ScanRuleMatch* rule_match;
 
+	int64_t result_bytes = async_scan->result_bytes;
+
+	if (async_scan->stream_aborted())
+		return CALLBACK_ABORT;
+
 	switch (message) {
 		case CALLBACK_MSG_RULE_MATCHING:
+			async_scan->rules_matched++;
+
 			rule = (YR_RULE*) data;
 			rule_match = new ScanRuleMatch();
 
 			rule_match->id = rule->identifier;
+			async_scan->result_bytes += rule_match->id.length();
 
 			yr_rule_tags_foreach(rule, tag) {
 				rule_match->tags.push_back(std::string(tag));
+				async_scan->result_bytes += rule_match->tags.back().length();
 			}
 
 			yr_rule_metas_foreach(rule, meta) {
@@ -895,52 +6407,181 @@ int scanCallback(int message, void* data, void* param) {
 					oss << meta->string;
 
 				rule_match->metas.push_back(oss.str());
+				async_scan->result_bytes += rule_match->metas.back().length();
 			}
 
 			yr_rule_strings_foreach(rule, string) {
+				int64_t string_matches = 0;
+				int64_t string_truncated = 0;
+
 				yr_string_matches_foreach(string, match) {
+					// Matches over a limit are counted but never formatted
+					if (async_scan->overMatchLimits(string_matches)) {
+						string_truncated++;
+						continue;
+					}
+
 					std::ostringstream oss;
-					oss << match->offset << ":" << match->match_length << ":" << string->identifier;
+					oss << (match->base + match->offset) << ":" << match->match_length << ":" << string->identifier;
+
+					std::string match_str = oss.str();
+
+					uint32_t data_length = 0;
+
+					if (async_scan->matched_bytes > 0)
+						data_length = (match->data_length < async_scan->matched_bytes)
+								? match->data_length
+								: async_scan->matched_bytes;
+
+					if (async_scan->overResultBytes(match_str.length() + data_length)) {
+						string_truncated++;
+						continue;
+					}
 
 					if (async_scan->matched_bytes > 0) {
 						MatchData* match_data = new MatchData();
 
 						// If memory allocation fails we can't really do much
-						if (match_data->copy(match->data,
-								(match->data_length < async_scan->matched_bytes)
-										? match->data_length
-										: async_scan->matched_bytes)) {
+						if (match_data->copy(match->data, data_length)) {
 							rule_match->datas.push_back(match_data);
 						} else {
 							delete match_data;
 						}
 					}
 
-					rule_match->matches.push_back(oss.str());
+					rule_match->matches.push_back(match_str);
+
+					string_matches++;
+					async_scan->matches_total++;
+					async_scan->result_bytes += match_str.length() + data_length;
+				}
+
+				if (string_truncated > 0) {
+					std::ostringstream oss;
+					oss << string_truncated << ":" << string->identifier;
+					rule_match->truncated.push_back(oss.str());
+
+					async_scan->matches_truncated += string_truncated;
 				}
 			}
 
-			async_scan->rule_matches.push_back(rule_match);
+			async_scan->addScanBytes(async_scan->result_bytes - result_bytes);
+			async_scan->addRuleMatch(rule_match);
 
 			break;
 
 		case CALLBACK_MSG_RULE_NOT_MATCHING:
+			async_scan->rules_not_matched++;
 			break;
 
 		case CALLBACK_MSG_SCAN_FINISHED:
 			break;
 
-		case CALLBACK_MSG_IMPORT_MODULE:
-			break;
+		case CALLBACK_MSG_IMPORT_MODULE:
+			break;
+
+		case CALLBACK_MSG_MODULE_IMPORTED:
+			async_scan->addModuleData((YR_OBJECT*) data);
+			break;
+
+		default:
+			break;
+	};
+
+	return CALLBACK_CONTINUE;
+}
+
+/**
+ ** Reads the buffer, offset and length attributes from either a request, or
+ ** an item in a requests buffers array.  A JavaScript exception is thrown,
+ ** and false returned, if offset or length are out of bounds.
+ **/
+bool getScanBuffer(Local<Object> obj, char** buffer, int64_t* offset,
+		int64_t* length) {
+	Local<Object> o = Nan::To<Object>(Nan::Get(obj, Nan::New("buffer").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+	*buffer = node::Buffer::Data(o);
+
+	if (Nan::Get(obj, Nan::New("offset").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(obj, Nan::New("offset").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() < 0) {
+			Nan::ThrowError("Offset is out of bounds");
+			return false;
+		} else if (n->Value() >= node::Buffer::Length(o)) {
+			Nan::ThrowError("Offset is out of bounds");
+			return false;
+		} else {
+			*offset = n->Value();
+		}
+	} else {
+		*offset = 0;
+	}
+
+	if (Nan::Get(obj, Nan::New("length").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(obj, Nan::New("length").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() <= 0) {
+			Nan::ThrowError("Length is out of bounds");
+			return false;
+		} else if ((n->Value() + *offset) > node::Buffer::Length(o)) {
+			Nan::ThrowError("Length is out of bounds");
+			return false;
+		} else {
+			*length = n->Value();
+		}
+	} else {
+		*length = node::Buffer::Length(o) - *offset;
+	}
 
-		case CALLBACK_MSG_MODULE_IMPORTED:
-			break;
+	return true;
+}
 
-		default:
-			break;
-	};
+/**
+ ** Reads an optional non-negative limit from a request, leaving value
+ ** untouched if it is not specified.  A JavaScript exception is thrown, and
+ ** false returned, if it is negative.
+ **/
+bool getScanLimit(Local<Object> req, const char* attribute, const char* name,
+		int64_t* value) {
+	if (Nan::Get(req, Nan::New(attribute).ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(req, Nan::New(attribute).ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() < 0) {
+			std::string message = std::string(name) + " cannot be negative";
+			Nan::ThrowError(message.c_str());
+			return false;
+		} else {
+			*value = n->Value();
+		}
+	}
 
-	return CALLBACK_CONTINUE;
+	return true;
+}
+
+/**
+ ** The number of bytes a scan is expected to read, used to schedule it.  Files
+ ** are not stat()ed here, since that can block the main thread on a slow or
+ ** remote filesystem, so their size is the caller's hint.  Files without one,
+ ** like whole process scans, are treated as large, so that an unexpectedly
+ ** large file cannot hold a thread reserved for small scans.
+ **/
+int64_t scanCost(ScanReq* scan_req, int64_t size_hint) {
+	if (scan_req->filename.length()) {
+		return size_hint >= 0 ? size_hint : INT64_MAX;
+	} else if (scan_req->buffer) {
+		return scan_req->length;
+	} else if (scan_req->blocks.size()) {
+		int64_t cost = 0;
+		for (ScanBlockList::iterator blocks_it = scan_req->blocks.begin();
+				blocks_it != scan_req->blocks.end();
+				blocks_it++)
+			cost += blocks_it->length;
+		return cost;
+	} else if (scan_req->pid && scan_req->size) {
+		return scan_req->size;
+	} else {
+		return INT64_MAX;
+	}
 }
 
 NAN_METHOD(ScannerWrap::Scan) {
@@ -963,9 +6604,12 @@ NAN_METHOD(ScannerWrap::Scan) {
 
 	ScannerWrap* scanner = ScannerWrap::Unwrap<ScannerWrap>(info.This());
 
-	scanner->lock_read();
+	if (scanner->destroyed) {
+		Nan::ThrowError("Scanner has been destroyed");
+		return;
+	}
+
 	bool rules_compiled = scanner->rules ? true : false;
-	scanner->unlock();
 
 	if (! rules_compiled) {
 		Nan::ThrowError("Please call configure() before scan()");
@@ -974,85 +6618,150 @@ NAN_METHOD(ScannerWrap::Scan) {
 
 	Local<Object> req = Nan::To<Object>(info[0]).ToLocalChecked();
 
-	char* filename = NULL;
+	std::string filename;
+	int64_t read_limit = 0;
+	int64_t size_hint = -1;
 	char *buffer = NULL;
 	int64_t offset = 0;
 	int64_t length = 0;
+	ScanBlockList blocks;
+	int32_t pid = 0;
+	uint64_t address = 0;
+	uint64_t size = 0;
 	int32_t flags = 0;
 	int32_t timeout = 0;
 	int32_t matched_bytes = 0;
+	uint32_t batch_size = 1;
+
+	if (info.Length() > 2 && ! info[2]->IsFunction()) {
+		Nan::ThrowError("Rules callback argument must be a function");
+		return;
+	}
 
 	if (Nan::Get(req, Nan::New("filename").ToLocalChecked()).ToLocalChecked()->IsString()) {
 		Local<String> s = Nan::To<String>(Nan::Get(req, Nan::New("filename").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
 		filename = *Nan::Utf8String(s);
-	} else if (Nan::Get(req, Nan::New("buffer").ToLocalChecked()).ToLocalChecked()->IsObject()) {
-		Local<Object> o = Nan::To<Object>(Nan::Get(req, Nan::New("buffer").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
-		buffer = node::Buffer::Data(o);
 
-		if (Nan::Get(req, Nan::New("offset").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
-			Local<Number> n = Nan::To<Number>(Nan::Get(req, Nan::New("offset").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+		if (Nan::Get(req, Nan::New("readLimit").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+			Local<Number> n = Nan::To<Number>(Nan::Get(req, Nan::New("readLimit").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
 
 			if (n->Value() < 0) {
-				Nan::ThrowError("Offset is out of bounds");
-				return;
-			} else if (n->Value() >= node::Buffer::Length(o)) {
-				Nan::ThrowError("Offset is out of bounds");
+				Nan::ThrowError("Read limit cannot be negative");
 				return;
 			} else {
-				offset = n->Value();
+				read_limit = n->Value();
 			}
-		} else {
-			offset = 0;
 		}
 
-		if (Nan::Get(req, Nan::New("length").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
-			Local<Number> n = Nan::To<Number>(Nan::Get(req, Nan::New("length").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+		if (Nan::Get(req, Nan::New("sizeHint").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+			Local<Number> n = Nan::To<Number>(Nan::Get(req, Nan::New("sizeHint").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
 
-			if (n->Value() <= 0) {
-				Nan::ThrowError("Length is out of bounds");
-				return;
-			} else if ((n->Value() + offset) > node::Buffer::Length(o)) {
-				Nan::ThrowError("Length is out of bounds");
+			if (n->Value() < 0) {
+				Nan::ThrowError("Size hint cannot be negative");
 				return;
 			} else {
-				length = n->Value();
+				size_hint = n->Value();
 			}
-		} else {
-			length = node::Buffer::Length(o) - offset;
+		}
+	} else if (Nan::Get(req, Nan::New("buffer").ToLocalChecked()).ToLocalChecked()->IsObject()) {
+		if (! getScanBuffer(req, &buffer, &offset, &length))
+			return;
+	} else if (Nan::Get(req, Nan::New("buffers").ToLocalChecked()).ToLocalChecked()->IsArray()) {
+		Local<Array> items = Local<Array>::Cast(
+				Nan::Get(req, Nan::New("buffers").ToLocalChecked()).ToLocalChecked()
+			);
+
+		if (items->Length() == 0) {
+			Nan::ThrowError("Buffers must contain at least one item");
+			return;
 		}
 
-		if (Nan::Get(req, Nan::New("flags").ToLocalChecked()).ToLocalChecked()->IsInt32()) {
-			Local<Int32> n = Nan::To<Int32>(Nan::Get(req, Nan::New("flags").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+		for (uint32_t i = 0; i < items->Length(); i++) {
+			Local<Value> item = Nan::Get(items, i).ToLocalChecked();
 
-			if (n->Value() < 0) {
-				Nan::ThrowError("Flags cannot be negative");
-				return;
+			ScanBlock block;
+			char* item_buffer = NULL;
+			int64_t item_offset = 0;
+
+			if (node::Buffer::HasInstance(item)) {
+				item_buffer = node::Buffer::Data(item);
+				block.length = node::Buffer::Length(item);
+			} else if (item->IsObject()) {
+				Local<Object> o = Nan::To<Object>(item).ToLocalChecked();
+
+				if (! Nan::Get(o, Nan::New("buffer").ToLocalChecked()).ToLocalChecked()->IsObject()) {
+					Nan::ThrowError("Buffers items must be a Buffer or contain a buffer");
+					return;
+				}
+
+				if (! getScanBuffer(o, &item_buffer, &item_offset, &block.length))
+					return;
 			} else {
-				flags = n->Value();
+				Nan::ThrowError("Buffers items must be a Buffer or contain a buffer");
+				return;
 			}
+
+			block.buffer = item_buffer + item_offset;
+			blocks.push_back(block);
+		}
+	} else if (Nan::Get(req, Nan::New("pid").ToLocalChecked()).ToLocalChecked()->IsInt32()) {
+		Local<Int32> n = Nan::To<Int32>(Nan::Get(req, Nan::New("pid").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() <= 0) {
+			Nan::ThrowError("Pid is out of bounds");
+			return;
 		} else {
-			flags = 0;
+			pid = n->Value();
 		}
 
-		if (Nan::Get(req, Nan::New("timeout").ToLocalChecked()).ToLocalChecked()->IsInt32()) {
-			Local<Int32> n = Nan::To<Int32>(Nan::Get(req, Nan::New("timeout").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+		if (Nan::Get(req, Nan::New("address").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+			Local<Number> a = Nan::To<Number>(Nan::Get(req, Nan::New("address").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+			Local<Number> l = Nan::To<Number>(Nan::Get(req, Nan::New("length").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
 
-			if (n->Value() < 0) {
-				Nan::ThrowError("Timeout cannot be negative");
+			if (a->Value() < 0) {
+				Nan::ThrowError("Address is out of bounds");
+				return;
+			} else if (! (l->Value() > 0)) {
+				Nan::ThrowError("Length is out of bounds");
 				return;
 			} else {
-				timeout = n->Value();
+				address = a->Value();
+				size = l->Value();
 			}
-		} else {
-			timeout = 0;
 		}
 	}
 
-	if ((! filename) && (! buffer)) {
+	if ((! filename.length()) && (! buffer) && (! blocks.size()) && (! pid)) {
 		Nan::ThrowError("Either filename of buffer is required");
 		return;
 	}
 
+	if (Nan::Get(req, Nan::New("flags").ToLocalChecked()).ToLocalChecked()->IsInt32()) {
+		Local<Int32> n = Nan::To<Int32>(Nan::Get(req, Nan::New("flags").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() < 0) {
+			Nan::ThrowError("Flags cannot be negative");
+			return;
+		} else {
+			flags = n->Value();
+		}
+	} else {
+		flags = 0;
+	}
+
+	if (Nan::Get(req, Nan::New("timeout").ToLocalChecked()).ToLocalChecked()->IsInt32()) {
+		Local<Int32> n = Nan::To<Int32>(Nan::Get(req, Nan::New("timeout").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() < 0) {
+			Nan::ThrowError("Timeout cannot be negative");
+			return;
+		} else {
+			timeout = n->Value();
+		}
+	} else {
+		timeout = 0;
+	}
+
 	if (Nan::Get(req, Nan::New("matchedBytes").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
 		Local<Number> n = Nan::To<Number>(Nan::Get(req, Nan::New("matchedBytes").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
 
@@ -1066,32 +6775,395 @@ NAN_METHOD(ScannerWrap::Scan) {
 		matched_bytes = 0;
 	}
 
-	ScanReq* scan_req = new ScanReq();
+	if (Nan::Get(req, Nan::New("batchSize").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+		Local<Number> n = Nan::To<Number>(Nan::Get(req, Nan::New("batchSize").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+		if (n->Value() < 1) {
+			Nan::ThrowError("Batch size is out of bounds");
+			return;
+		} else {
+			batch_size = n->Value();
+		}
+	}
+
+	int64_t max_matches_per_string = -1;
+	int64_t max_matches_total = -1;
+	int64_t max_result_bytes = -1;
+
+	if (! getScanLimit(req, "maxMatchesPerString", "Max matches per string", &max_matches_per_string))
+		return;
+	if (! getScanLimit(req, "maxMatchesTotal", "Max matches total", &max_matches_total))
+		return;
+	if (! getScanLimit(req, "maxResultBytes", "Max result bytes", &max_result_bytes))
+		return;
+
+	ModuleDataMap module_data;
+
+	if (Nan::Get(req, Nan::New("moduleData").ToLocalChecked()).ToLocalChecked()->IsArray()) {
+		Local<Array> selectors = Local<Array>::Cast(Nan::Get(req, Nan::New("moduleData").ToLocalChecked()).ToLocalChecked());
+
+		for (uint32_t i = 0; i < selectors->Length(); i++) {
+			Local<Value> selector = Nan::Get(selectors, i).ToLocalChecked();
+
+			if (! selector->IsString()) {
+				Nan::ThrowError("Module data items must be strings");
+				return;
+			}
+
+			// Either "<module>" for the whole module or "<module>.<field>"
+			std::string str = *Nan::Utf8String(selector);
+			size_t dot = str.find('.');
+
+			std::list<std::string>& fields = module_data[str.substr(0, dot)];
+
+			if (dot != std::string::npos)
+				fields.push_back(str.substr(dot + 1));
+		}
+
+		// Any item selecting a whole module overrides items selecting fields
+		for (uint32_t i = 0; i < selectors->Length(); i++) {
+			std::string str = *Nan::Utf8String(Nan::Get(selectors, i).ToLocalChecked());
+			if (str.find('.') == std::string::npos)
+				module_data[str].clear();
+		}
+	}
+
+	ExpandReq expand;
+	expand.formats = 0;
+	expand.max_depth = EXPAND_DEFAULT_MAX_DEPTH;
+	expand.max_total_bytes = EXPAND_DEFAULT_MAX_TOTAL_BYTES;
+	expand.max_members = EXPAND_DEFAULT_MAX_MEMBERS;
+
+	Local<Value> expand_value = Nan::Get(req, Nan::New("expand").ToLocalChecked()).ToLocalChecked();
+
+	if (expand_value->IsTrue()) {
+		expand.formats = EXPAND_ALL;
+	} else if (expand_value->IsObject()) {
+		Local<Object> o = Nan::To<Object>(expand_value).ToLocalChecked();
+
+		expand.formats = EXPAND_ALL;
+
+		if (Nan::Get(o, Nan::New("formats").ToLocalChecked()).ToLocalChecked()->IsArray()) {
+			Local<Array> formats = Local<Array>::Cast(Nan::Get(o, Nan::New("formats").ToLocalChecked()).ToLocalChecked());
+
+			expand.formats = 0;
+
+			for (uint32_t i = 0; i < formats->Length(); i++) {
+				std::string format = *Nan::Utf8String(Nan::Get(formats, i).ToLocalChecked());
+
+				if (format == "gzip") {
+					expand.formats |= EXPAND_GZIP;
+				} else if (format == "tar") {
+					expand.formats |= EXPAND_TAR;
+				} else if (format == "zip") {
+					expand.formats |= EXPAND_ZIP;
+				} else {
+					Nan::ThrowError("Expand formats must be gzip, tar or zip");
+					return;
+				}
+			}
+		}
+
+		if (Nan::Get(o, Nan::New("maxDepth").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+			Local<Number> n = Nan::To<Number>(Nan::Get(o, Nan::New("maxDepth").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+			if (n->Value() < 1 || n->Value() > EXPAND_MAX_DEPTH) {
+				Nan::ThrowError("Expand maxDepth is out of bounds");
+				return;
+			} else {
+				expand.max_depth = n->Value();
+			}
+		}
+
+		if (Nan::Get(o, Nan::New("maxTotalBytes").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+			Local<Number> n = Nan::To<Number>(Nan::Get(o, Nan::New("maxTotalBytes").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+			if (n->Value() < 0) {
+				Nan::ThrowError("Expand maxTotalBytes is out of bounds");
+				return;
+			} else {
+				expand.max_total_bytes = n->Value();
+			}
+		}
+
+		if (Nan::Get(o, Nan::New("maxMembers").ToLocalChecked()).ToLocalChecked()->IsNumber()) {
+			Local<Number> n = Nan::To<Number>(Nan::Get(o, Nan::New("maxMembers").ToLocalChecked()).ToLocalChecked()).ToLocalChecked();
+
+			if (n->Value() < 1) {
+				Nan::ThrowError("Expand maxMembers is out of bounds");
+				return;
+			} else {
+				expand.max_members = n->Value();
+			}
+		}
+	}
+
+	if (expand.formats && (blocks.size() || pid)) {
+		Nan::ThrowError("Expand requires the filename or buffer attribute");
+		return;
+	}
+
+	if (expand.formats && info.Length() > 2) {
+		Nan::ThrowError("Expanded scans cannot be streamed");
+		return;
+	}
+
+	int output = SCAN_OUTPUT_NONE;
+
+	Local<Value> output_value = Nan::Get(req, Nan::New("output").ToLocalChecked()).ToLocalChecked();
+
+	if (! output_value->IsUndefined()) {
+		std::string format = *Nan::Utf8String(output_value);
+
+		if (format == "ndjson") {
+			output = SCAN_OUTPUT_NDJSON;
+		} else if (format == "msgpack") {
+			output = SCAN_OUTPUT_MSGPACK;
+		} else {
+			Nan::ThrowError("Output must be ndjson or msgpack");
+			return;
+		}
+	}
 
-	if (filename)
-		scan_req->filename = filename;
+	if (output != SCAN_OUTPUT_NONE && info.Length() > 2) {
+		Nan::ThrowError("Output cannot be streamed");
+		return;
+	}
+
+	bool use_allowlist = false;
+
+	if (Nan::Get(req, Nan::New("allowlist").ToLocalChecked()).ToLocalChecked()->IsBoolean())
+		use_allowlist = Nan::To<Boolean>(Nan::Get(req, Nan::New("allowlist").ToLocalChecked()).ToLocalChecked()).ToLocalChecked()->Value();
+
+	if (use_allowlist && ! allowlist) {
+		Nan::ThrowError("No allowlist has been loaded");
+		return;
+	}
+
+	ScanReq* scan_req = new ScanReq();
 
+	scan_req->filename = filename;
+	scan_req->read_limit = read_limit;
 	scan_req->buffer = buffer;
 	scan_req->offset = offset;
 	scan_req->length = length;
+	scan_req->blocks = blocks;
+	scan_req->pid = pid;
+	scan_req->address = address;
+	scan_req->size = size;
 	scan_req->flags = flags;
 	scan_req->timeout = timeout;
+	scan_req->module_data = module_data;
+	scan_req->expand = expand;
 
 	Nan::Callback* callback = new Nan::Callback(info[1].As<Function>());
 
 	AsyncScan* async_scan = new AsyncScan(
 			scanner,
+			scanner->acquire_rules(),
 			scan_req,
 			callback
 		);
 	
 	async_scan->matched_bytes = matched_bytes;
+	async_scan->max_matches_per_string = max_matches_per_string;
+	async_scan->max_matches_total = max_matches_total;
+	async_scan->max_result_bytes = max_result_bytes;
+	async_scan->output = output;
+
+	if (use_allowlist)
+		async_scan->use_allowlist(acquireAllowlist());
+
+	if (Nan::Get(req, Nan::New("stats").ToLocalChecked()).ToLocalChecked()->IsBoolean())
+		async_scan->stats = Nan::To<Boolean>(Nan::Get(req, Nan::New("stats").ToLocalChecked()).ToLocalChecked()).ToLocalChecked()->Value();
+
+	if (Nan::Get(req, Nan::New("capture").ToLocalChecked()).ToLocalChecked()->IsBoolean())
+		async_scan->capture = Nan::To<Boolean>(Nan::Get(req, Nan::New("capture").ToLocalChecked()).ToLocalChecked()).ToLocalChecked()->Value();
+
+	if (info.Length() > 2)
+		async_scan->stream(new Nan::Callback(info[2].As<Function>()), batch_size);
+
+	// Keep the scanner, and scanned Buffer instances, alive until the scan
+	// has completed
+	async_scan->SaveToPersistent("scanner", info.This());
+
+	if (buffer)
+		async_scan->SaveToPersistent("buffer", Nan::Get(req, Nan::New("buffer").ToLocalChecked()).ToLocalChecked());
+	else if (blocks.size())
+		async_scan->SaveToPersistent("buffers", Nan::Get(req, Nan::New("buffers").ToLocalChecked()).ToLocalChecked());
+
+	scan_scheduler.queue(async_scan, scanCost(scan_req, size_hint));
+
+	// Streaming scans return their id for pauseStream() and friends
+	if (info.Length() > 2)
+		info.GetReturnValue().Set(Nan::New<Number>(async_scan->stream_id()));
+	else
+		info.GetReturnValue().Set(info.This());
+}
+
+/**
+ ** Look up a streaming scan by the id returned by scan(), returning NULL once
+ ** it has completed.
+ **/
+AsyncScan* getStreamScan(const Nan::FunctionCallbackInfo<Value>& info) {
+	if (info.Length() < 1 || ! info[0]->IsNumber()) {
+		Nan::ThrowError("Stream id argument must be a number");
+		return NULL;
+	}
+
+	uint32_t id = Nan::To<uint32_t>(info[0]).FromJust();
+
+	std::map<uint32_t, AsyncScan*>::iterator stream_scans_it = stream_scans.find(id);
+	if (stream_scans_it == stream_scans.end())
+		return NULL;
+
+	return stream_scans_it->second;
+}
+
+NAN_METHOD(ScannerWrap::PauseStream) {
+	Nan::HandleScope scope;
+
+	AsyncScan* async_scan = getStreamScan(info);
+	if (async_scan)
+		async_scan->pause_stream();
+}
+
+NAN_METHOD(ScannerWrap::ResumeStream) {
+	Nan::HandleScope scope;
+
+	AsyncScan* async_scan = getStreamScan(info);
+	if (async_scan)
+		async_scan->resume_stream();
+}
+
+NAN_METHOD(ScannerWrap::AbortStream) {
+	Nan::HandleScope scope;
+
+	AsyncScan* async_scan = getStreamScan(info);
+	if (async_scan)
+		async_scan->abort_stream();
+}
+
+class AsyncDestroy : public Nan::AsyncWorker {
+public:
+	AsyncDestroy(
+			ScannerWrap* scanner,
+			RulesHandle* rules,
+			Nan::Callback* callback
+		) : Nan::AsyncWorker(callback),
+				scanner_(scanner),
+				rules_(rules) {}
+
+	~AsyncDestroy() {}
+
+	// Scans still holding the rules destroy them when they release them
+	void Execute() {
+		releaseRules(rules_);
+		rules_ = NULL;
+	}
+
+	void WorkComplete() {
+		scanner_->report_memory();
 
-	Nan::AsyncQueueWorker(async_scan);
+		Nan::AsyncWorker::WorkComplete();
+	}
+
+protected:
+	void HandleOKCallback() {
+		Local<Value> argv[1];
+
+		argv[0] = Nan::Null();
+
+		callback->Call(1, argv, async_resource);
+	}
+
+private:
+	ScannerWrap* scanner_;
+	RulesHandle* rules_;
+};
+
+NAN_METHOD(ScannerWrap::Destroy) {
+	Nan::HandleScope scope;
+
+	if (info.Length() < 1) {
+		Nan::ThrowError("One argument is required");
+		return;
+	}
+
+	if (! info[0]->IsFunction()) {
+		Nan::ThrowError("Callback argument must be a function");
+		return;
+	}
+
+	ScannerWrap* scanner = ScannerWrap::Unwrap<ScannerWrap>(info.This());
+
+	if (scanner->destroyed) {
+		Nan::ThrowError("Scanner has been destroyed");
+		return;
+	}
+
+	scanner->destroyed = true;
+
+	if (scanner->watcher) {
+		delete scanner->watcher;
+		scanner->watcher = NULL;
+	}
+
+	Nan::Callback* callback = new Nan::Callback(info[0].As<Function>());
+
+	AsyncDestroy* async_destroy = new AsyncDestroy(
+			scanner,
+			scanner->swap_rules(NULL),
+			callback
+		);
+
+	async_destroy->SaveToPersistent("scanner", info.This());
+
+	Nan::AsyncQueueWorker(async_destroy);
 
 	info.GetReturnValue().Set(info.This());
 }
 
+NAN_METHOD(ScannerWrap::MemoryUsage) {
+	Nan::HandleScope scope;
+
+	ScannerWrap* scanner = ScannerWrap::Unwrap<ScannerWrap>(info.This());
+
+	scanner->report_memory();
+
+	int64_t rules_size = scanner->rules ? scanner->rules->size : 0;
+
+	Local<Object> usage = Nan::New<Object>();
+
+	Nan::Set(usage, Nan::New("rules").ToLocalChecked(), Nan::New<Number>(rules_size));
+	Nan::Set(usage, Nan::New("scans").ToLocalChecked(), Nan::New<Number>((double) scanner->scan_bytes));
+	Nan::Set(usage, Nan::New("pool").ToLocalChecked(), Nan::New<Number>(buffer_pool.pooled_bytes()));
+
+	info.GetReturnValue().Set(usage);
+}
+
+/**
+ ** The fingerprint of a scanner's current rules, as recorded by scan captures,
+ ** computed when the rules were configured.
+ **/
+NAN_METHOD(ScannerWrap::RulesFingerprint) {
+	Nan::HandleScope scope;
+
+	ScannerWrap* scanner = ScannerWrap::Unwrap<ScannerWrap>(info.This());
+
+	if (scanner->destroyed) {
+		Nan::ThrowError("Scanner has been destroyed");
+		return;
+	}
+
+	if (! scanner->rules) {
+		Nan::ThrowError("Please call configure() before rulesFingerprint()");
+		return;
+	}
+
+	info.GetReturnValue().Set(Nan::New(scanner->rules->fingerprint.c_str()).ToLocalChecked());
+}
+
 }; /* namespace yara */
 
 #endif /* YARA_CC */
@@ -3,6 +3,11 @@
 
 #include <pthread.h>
 
+#include <atomic>
+#include <list>
+#include <string>
+#include <vector>
+
 #include <nan.h>
 
 #include <yara.h>
@@ -17,17 +22,91 @@ void ExportFunctions(Local<Object> target);
 NAN_METHOD(ErrorCodeToString);
 NAN_METHOD(LibyaraVersion);
 NAN_METHOD(Initialize);
+NAN_METHOD(BuildInfo);
+NAN_METHOD(BuildAllowlist);
+NAN_METHOD(LoadAllowlist);
+NAN_METHOD(UnloadAllowlist);
+NAN_METHOD(ConfigureScheduler);
+NAN_METHOD(SchedulerStats);
+NAN_METHOD(MapFile);
+NAN_METHOD(ConfigureCapture);
+NAN_METHOD(CaptureStats);
+
+class RuleWatcher;
+
+/**
+ ** Cheap checks applied before hashing or scanning, inputs failing them are
+ ** skipped.  A size of -1 means no limit, and when magics is not empty the
+ ** input must start with one of them.
+ **/
+struct Prefilter {
+	int64_t min_size;
+	int64_t max_size;
+	std::list<std::string> magics;
+	size_t max_magic;
+
+	bool configured(void) const {
+		return min_size >= 0 || max_size >= 0 || ! magics.empty();
+	}
+};
+
+/**
+ ** Where compiled rules are placed in memory, backed by transparent huge pages,
+ ** locked in memory, and replicated on each NUMA node.
+ **/
+struct Placement {
+	bool huge_pages;
+	bool lock;
+	bool replicas;
+};
+
+/**
+ ** One generation of compiled rules, shared by the scanner it was configured
+ ** for and every scan using it.  Each holds a reference, and the rules are
+ ** destroyed when the last reference is released, on whichever thread that
+ ** happens.
+ **/
+struct RulesHandle {
+	YR_RULES* rules;
+	int64_t size;
+	Prefilter prefilter;
+
+	// One copy of the rules per NUMA node when replicated, in which case rules
+	// is the copy for node 0
+	std::vector<YR_RULES*> replicas;
+	bool locked;
+
+	// SHA-256 digest of the saved rules in hex, and the saved rules when
+	// capture was enabled, both set before the rules are used by any scan
+	std::string fingerprint;
+	std::string image;
+
+	std::atomic<int32_t> refs;
+};
+
+RulesHandle* acquireRules(RulesHandle* handle);
+void releaseRules(RulesHandle* handle);
 
 class ScannerWrap : public Nan::ObjectWrap {
 public:
 	static void Init(Local<Object> exports);
 
-	void lock_read(void);
-	void lock_write(void);
-	void unlock(void);
+	void report_memory(void);
 
-	YR_COMPILER* compiler;
-	YR_RULES* rules;
+	RulesHandle* acquire_rules(void);
+	RulesHandle* swap_rules(RulesHandle* handle);
+
+	// Current generation of rules, only used on the main thread, scans take
+	// their own reference so never need to lock the scanner
+	RulesHandle* rules;
+
+	// Bytes of result data held by scans which have not yet completed
+	std::atomic<int64_t> scan_bytes;
+
+	bool destroyed;
+
+	// Watches rule files for changes, only used on the main thread
+	RuleWatcher* watcher;
 
 private:
 	ScannerWrap();
@@ -36,8 +115,17 @@ private:
 	static NAN_METHOD(New);
 	static NAN_METHOD(Configure);
 	static NAN_METHOD(Scan);
+	static NAN_METHOD(MemoryUsage);
+	static NAN_METHOD(Destroy);
+	static NAN_METHOD(Watch);
+	static NAN_METHOD(Unwatch);
+	static NAN_METHOD(RulesFingerprint);
+	static NAN_METHOD(PauseStream);
+	static NAN_METHOD(ResumeStream);
+	static NAN_METHOD(AbortStream);
 
-	pthread_rwlock_t lock;
+	// Bytes last reported to V8 using Nan::AdjustExternalMemory()
+	int64_t reported_memory_;
 };
 
 }; /* namespace yara */
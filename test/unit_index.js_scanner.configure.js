@@ -1,5 +1,8 @@
 
 var assert = require("assert")
+var fs = require("fs")
+var os = require("os")
+var path = require("path")
 
 var yara = require ("../")
 
@@ -238,5 +241,233 @@ describe("index.js", function() {
 					done()
 				})
 		})
+
+		it("concurrency - out of bounds", function(done) {
+			var scanner = yara.createScanner()
+
+			assert.throws(function() {
+				scanner.configure({rules: [], concurrency: 0}, function() {})
+			}, /Concurrency is out of bounds/)
+
+			done()
+		})
+
+		it("precheck - errors", function(done) {
+			var scanner = yara.createScanner()
+
+			scanner.configure({
+					rules: [
+						{string: "rule bad {}"},
+						{filename: "test/data/unit_index.js_scanner.configure/good.yara"},
+						{filename: "test/data/unit_index.js_scanner.configure/bad.yara"}
+					],
+					precheck: true,
+					concurrency: 2
+				}, function(error) {
+					assert(error instanceof yara.CompileRulesError)
+
+					var expErrors = [{
+						index: 0,
+						line: 1,
+						message: "syntax error, unexpected '}', expecting <condition>"
+					}, {
+						index: 2,
+						line: 4,
+						message: "syntax error, unexpected hex string, expecting identifier"
+					}]
+
+					assert.deepEqual(error.errors, expErrors)
+
+					done()
+				})
+		})
+
+		it("precheck - valid", function(done) {
+			var scanner = yara.createScanner()
+
+			scanner.configure({
+					rules: [
+						{filename: "test/data/unit_index.js_scanner.configure/good.yara"},
+						{string: "rule good2 {\ncondition:\ntrue\n}"}
+					],
+					precheck: true
+				}, function(error) {
+					assert.ifError(error)
+					done()
+				})
+		})
+
+		it("progress - events", function(done) {
+			var scanner = yara.createScanner()
+			var events = []
+
+			scanner.on("progress", function(progress) {
+				events.push(progress)
+			})
+
+			scanner.configure({
+					rules: [
+						{filename: "test/data/unit_index.js_scanner.configure/good.yara"},
+						{string: "rule good2 {\ncondition:\ntrue\n}"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					var load = events.filter(function(progress) {
+						return progress.phase == "load"
+					})
+
+					var compile = events.filter(function(progress) {
+						return progress.phase == "compile"
+					})
+
+					assert.deepEqual(load, [
+						{phase: "load", index: 0, completed: 1, total: 1}
+					])
+
+					assert.deepEqual(compile, [
+						{phase: "compile", index: 0, completed: 1, total: 2},
+						{phase: "compile", index: 1, completed: 2, total: 2}
+					])
+
+					done()
+				})
+		})
+
+		it("watch - reloaded", function(done) {
+			var filename = path.join(os.tmpdir(), "yara-watch-" + process.pid + ".yara")
+			fs.writeFileSync(filename, "rule one {\ncondition:\ntrue\n}\n")
+
+			var scanner = yara.createScanner()
+
+			scanner.on("reloaded", function(reload) {
+				assert.deepEqual(reload.changed, [filename])
+				assert(reload.durationMs >= 0)
+
+				scanner.scan({buffer: Buffer.from("x")}, function(error, result) {
+					assert.ifError(error)
+					assert.equal(result.rules[0].id, "two")
+
+					scanner.destroy(function() {
+						fs.unlinkSync(filename)
+						done()
+					})
+				})
+			})
+
+			scanner.configure({
+					rules: [
+						{filename: filename}
+					],
+					watch: true,
+					debounceMs: 10
+				}, function(error) {
+					assert.ifError(error)
+					fs.writeFileSync(filename, "rule two {\ncondition:\ntrue\n}\n")
+				})
+		})
+
+		it("watch - reloadFailed keeps rules", function(done) {
+			var filename = path.join(os.tmpdir(), "yara-watch-" + process.pid + ".yara")
+			fs.writeFileSync(filename, "rule one {\ncondition:\ntrue\n}\n")
+
+			var scanner = yara.createScanner()
+
+			scanner.on("reloadFailed", function(reload) {
+				assert(reload.error instanceof yara.CompileRulesError)
+
+				scanner.scan({buffer: Buffer.from("x")}, function(error, result) {
+					assert.ifError(error)
+					assert.equal(result.rules[0].id, "one")
+
+					scanner.destroy(function() {
+						fs.unlinkSync(filename)
+						done()
+					})
+				})
+			})
+
+			scanner.configure({
+					rules: [
+						{filename: filename}
+					],
+					watch: true,
+					debounceMs: 10
+				}, function(error) {
+					assert.ifError(error)
+					fs.writeFileSync(filename, "rule bad {}\n")
+				})
+		})
+
+		it("watch - symlinked directory swapped", function(done) {
+			// The layout Kubernetes uses to mount a ConfigMap
+			var dir = fs.mkdtempSync(path.join(os.tmpdir(), "yara-watch-"))
+			var filename = path.join(dir, "rules.yara")
+
+			fs.mkdirSync(path.join(dir, "..1"))
+			fs.writeFileSync(path.join(dir, "..1", "rules.yara"), "rule one {\ncondition:\ntrue\n}\n")
+			fs.symlinkSync("..1", path.join(dir, "..data"))
+			fs.symlinkSync("..data/rules.yara", filename)
+
+			var scanner = yara.createScanner()
+
+			scanner.on("reloaded", function(reload) {
+				assert.deepEqual(reload.changed, [filename])
+
+				scanner.scan({buffer: Buffer.from("x")}, function(error, result) {
+					assert.ifError(error)
+					assert.equal(result.rules[0].id, "two")
+
+					scanner.destroy(function() {
+						fs.unlinkSync(filename)
+						fs.unlinkSync(path.join(dir, "..data"))
+						fs.unlinkSync(path.join(dir, "..1", "rules.yara"))
+						fs.unlinkSync(path.join(dir, "..2", "rules.yara"))
+						fs.rmdirSync(path.join(dir, "..1"))
+						fs.rmdirSync(path.join(dir, "..2"))
+						fs.rmdirSync(dir)
+						done()
+					})
+				})
+			})
+
+			scanner.configure({
+					rules: [
+						{filename: filename}
+					],
+					watch: true,
+					debounceMs: 10
+				}, function(error) {
+					assert.ifError(error)
+
+					fs.mkdirSync(path.join(dir, "..2"))
+					fs.writeFileSync(path.join(dir, "..2", "rules.yara"), "rule two {\ncondition:\ntrue\n}\n")
+					fs.symlinkSync("..2", path.join(dir, "..data_tmp"))
+					fs.renameSync(path.join(dir, "..data_tmp"), path.join(dir, "..data"))
+				})
+		})
+
+		it("placement - huge pages and replicas", function(done) {
+			var scanner = yara.createScanner()
+
+			scanner.configure({
+					rules: [
+						{string: "rule is_stephen {\nstrings:\n$s1 = \"stephen\"\ncondition:\nany of them\n}"}
+					],
+					hugePages: true,
+					numaReplicas: true
+				}, function(error) {
+					assert.ifError(error)
+
+					scanner.scan({buffer: Buffer.from("my name is stephen")}, function(error, result) {
+						assert.ifError(error)
+						assert.equal(result.rules[0].id, "is_stephen")
+
+						scanner.destroy(function() {
+							done()
+						})
+					})
+				})
+		})
 	})
 })
@@ -0,0 +1,51 @@
+
+var assert = require("assert")
+
+var yara = require ("../")
+
+before(function(done) {
+	yara.initialize(function(error) {
+		assert.ifError(error)
+		done()
+	})
+})
+
+describe("index.js", function() {
+	describe("Scanner.destroy()", function() {
+		it("scan() after destroy()", function(done) {
+			var scanner = yara.createScanner()
+
+			scanner.configure({
+					rules: [
+						{string: "rule good {\ncondition:\ntrue\n}"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					scanner.destroy(function(error) {
+						assert.ifError(error)
+
+						assert.equal(scanner.memoryUsage().rules, 0)
+
+						assert.throws(function() {
+							scanner.scan({buffer: Buffer.from("1234")}, function() {})
+						}, /Scanner has been destroyed/)
+
+						done()
+					})
+				})
+		})
+
+		it("destroy() twice", function(done) {
+			var scanner = yara.createScanner()
+
+			scanner.destroy()
+
+			assert.throws(function() {
+				scanner.destroy()
+			}, /Scanner has been destroyed/)
+
+			done()
+		})
+	})
+})
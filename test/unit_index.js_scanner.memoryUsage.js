@@ -0,0 +1,46 @@
+
+var assert = require("assert")
+
+var yara = require ("../")
+
+before(function(done) {
+	yara.initialize(function(error) {
+		assert.ifError(error)
+		done()
+	})
+})
+
+describe("index.js", function() {
+	describe("Scanner.memoryUsage()", function() {
+		it("before configure()", function(done) {
+			var scanner = yara.createScanner()
+
+			var usage = scanner.memoryUsage()
+
+			assert.equal(usage.rules, 0)
+			assert.equal(usage.scans, 0)
+			assert(usage.pool >= 0)
+
+			done()
+		})
+
+		it("after configure()", function(done) {
+			var scanner = yara.createScanner()
+
+			scanner.configure({
+					rules: [
+						{string: "rule good {\nstrings:\n$s1 = \"good\"\ncondition:\nany of them\n}"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					var usage = scanner.memoryUsage()
+
+					assert(usage.rules > 0)
+					assert.equal(usage.scans, 0)
+
+					done()
+				})
+		})
+	})
+})
@@ -1,10 +1,104 @@
 
 var assert = require("assert")
+var crypto = require("crypto")
+var fs = require("fs")
+var os = require("os")
+var path = require("path")
+var zlib = require("zlib")
 
 var yara = require ("../")
 
 var scanner
 
+// Scans a container from test/data with every format expanded
+function expandFixture(name, cb) {
+	scanner.scan({filename: "test/data/unit_index.js_scanner.scan/" + name, expand: true}, cb)
+}
+
+// Decodes the subset of MessagePack written by the output request attribute,
+// throwing if the buffer holds anything other than exactly one value
+function decodeMsgpack(buffer) {
+	var offset = 0
+
+	function bytes(length) {
+		if (offset + length > buffer.length)
+			throw new Error("MessagePack truncated at " + offset)
+		var data = buffer.slice(offset, offset + length)
+		offset += length
+		return data
+	}
+
+	function uint(length) {
+		return bytes(length).readUIntBE(0, length)
+	}
+
+	function int(length) {
+		return bytes(length).readIntBE(0, length)
+	}
+
+	function items(count) {
+		var array = []
+		for (var i = 0; i < count; i++)
+			array.push(value())
+		return array
+	}
+
+	function map(count) {
+		var object = {}
+		for (var i = 0; i < count; i++) {
+			var key = value()
+			if (typeof key != "string")
+				throw new Error("MessagePack map key is not a string at " + offset)
+			object[key] = value()
+		}
+		return object
+	}
+
+	function value() {
+		var type = uint(1)
+
+		if (type < 0x80) return type
+		if (type >= 0xe0) return type - 0x100
+		if (type < 0x90) return map(type & 0x0f)
+		if (type < 0xa0) return items(type & 0x0f)
+		if (type < 0xc0) return bytes(type & 0x1f).toString()
+
+		switch (type) {
+			case 0xc0: return null
+			case 0xc2: return false
+			case 0xc3: return true
+			case 0xc4: return bytes(uint(1))
+			case 0xc5: return bytes(uint(2))
+			case 0xc6: return bytes(uint(4))
+			case 0xcb: return bytes(8).readDoubleBE(0)
+			case 0xcc: return uint(1)
+			case 0xcd: return uint(2)
+			case 0xce: return uint(4)
+			case 0xcf: return uint(2) * 0x1000000000000 + uint(6)
+			case 0xd0: return int(1)
+			case 0xd1: return int(2)
+			case 0xd2: return int(4)
+			case 0xd3: return int(2) * 0x1000000000000 + uint(6)
+			case 0xd9: return bytes(uint(1)).toString()
+			case 0xda: return bytes(uint(2)).toString()
+			case 0xdb: return bytes(uint(4)).toString()
+			case 0xdc: return items(uint(2))
+			case 0xdd: return items(uint(4))
+			case 0xde: return map(uint(2))
+			case 0xdf: return map(uint(4))
+		}
+
+		throw new Error("Unknown MessagePack type " + type + " at " + (offset - 1))
+	}
+
+	var result = value()
+
+	if (offset != buffer.length)
+		throw new Error("MessagePack has " + (buffer.length - offset) + " trailing bytes")
+
+	return result
+}
+
 before(function(done) {
 	yara.initialize(function(error) {
 		assert.ifError(error)
@@ -150,6 +244,77 @@ describe("index.js", function() {
 			})
 		})
 
+		it("limits - max matches per string", function(done) {
+			var req = {
+				buffer: Buffer.from("stephen stephen stephen"),
+				maxMatchesPerString: 1
+			}
+
+			scanner.scan(req, function(error, result) {
+				assert.ifError(error)
+
+				assert.deepEqual(result.rules[0].matches, [
+					{offset: 0, length: 7, id: "$s1"}
+				])
+				assert.deepEqual(result.rules[0].truncated, [
+					{id: "$s1", count: 2}
+				])
+				assert.equal(result.truncated, 4)
+
+				done()
+			})
+		})
+
+		it("limits - max matches total", function(done) {
+			var req = {
+				buffer: Buffer.from("stephen stephen"),
+				maxMatchesTotal: 1
+			}
+
+			scanner.scan(req, function(error, result) {
+				assert.ifError(error)
+
+				assert.equal(result.rules.length, 2)
+				assert.equal(result.rules[0].matches.length, 1)
+				assert.equal(result.rules[1].matches.length, 0)
+				assert.equal(result.truncated, 3)
+
+				done()
+			})
+		})
+
+		it("limits - max result bytes", function(done) {
+			var req = {
+				buffer: Buffer.from("stephen stephen"),
+				maxResultBytes: 0
+			}
+
+			scanner.scan(req, function(error, result) {
+				assert.ifError(error)
+
+				assert.equal(result.rules.length, 2)
+				assert.equal(result.rules[0].matches.length, 0)
+				assert.deepEqual(result.rules[1].truncated, [
+					{id: "$s1", count: 2}
+				])
+
+				done()
+			})
+		})
+
+		it("limits - negative", function(done) {
+			var req = {
+				buffer: Buffer.from("stephen"),
+				maxMatchesTotal: -1
+			}
+
+			assert.throws(function() {
+				scanner.scan(req, function(error, result) {})
+			}, /Max matches total cannot be negative/)
+
+			done()
+		})
+
 		it("buffer.length - out of range (negative)", function(done) {
 			var req = {
 				buffer: Buffer.from("1234"),
@@ -273,6 +438,215 @@ describe("index.js", function() {
 			})
 		})
 
+		it("buffers - valid", function(done) {
+			var req = {
+				buffers: [
+					Buffer.from("my name "),
+					Buffer.from("is stephen")
+				]
+			}
+
+			scanner.scan(req, function(error, result) {
+				assert.ifError(error)
+
+				var expected = {
+					"rules": [
+						{
+							"id": "is_stephen",
+							"tags": ["human", "man"],
+							"matches": [
+								{offset: 11, length: 7, id: "$s1"}
+							],
+							"metas": [
+								{type: 2, id: "m1", value: "m1"},
+								{type: 3, id: "m2", value: true},
+								{type: 1, id: "m3", value: 123}
+							]
+						},
+						{
+							"id": "is_either",
+							"tags": ["human", "man", "woman"],
+							"matches": [
+								{offset: 11, length: 7, id: "$s1"}
+							],
+							"metas": []
+						}
+					]
+				}
+
+				assert.deepEqual(result, expected)
+
+				done()
+			})
+		})
+
+		it("buffers - slices", function(done) {
+			var req = {
+				buffers: [
+					{buffer: Buffer.from("--my name is "), offset: 2},
+					{buffer: Buffer.from("silvia--"), length: 6}
+				]
+			}
+
+			scanner.scan(req, function(error, result) {
+				assert.ifError(error)
+				assert.equal(result.rules.length, 2)
+				assert.deepEqual(result.rules[0].matches, [
+					{offset: 11, length: 6, id: "$s1"}
+				])
+
+				done()
+			})
+		})
+
+		it("buffers - empty", function(done) {
+			var req = {
+				buffers: []
+			}
+
+			assert.throws(function() {
+				scanner.scan(req, function(error, result) {})
+			}, /Buffers must contain at least one item/)
+
+			done()
+		})
+
+		it("buffers.length - out of range (plus offset)", function(done) {
+			var req = {
+				buffers: [
+					{buffer: Buffer.from("1234"), length: 3, offset: 2}
+				]
+			}
+
+			assert.throws(function() {
+				scanner.scan(req, function(error, result) {})
+			}, /Length is out of bounds/)
+
+			done()
+		})
+
+		it("promise - valid", function(done) {
+			var req = {
+				buffer: Buffer.from("my name is silvia")
+			}
+
+			scanner.scan(req).then(function(result) {
+				assert.equal(result.rules.length, 2)
+				done()
+			}, done)
+		})
+
+		it("promise - rejected", function(done) {
+			var req = {
+				buffer: Buffer.from("1234"),
+				offset: -1
+			}
+
+			scanner.scan(req).then(function() {
+				done(new Error("Expected scan to be rejected"))
+			}, function(error) {
+				assert(/Offset is out of bounds/.test(error.message))
+				done()
+			})
+		})
+
+		it("stream - events", function(done) {
+			var req = {
+				buffer: Buffer.from("my name is stephen"),
+				batchSize: 1
+			}
+
+			var ids = []
+
+			scanner.scanStream(req)
+				.on("rule", function(rule) {
+					ids.push(rule.id)
+					assert.deepEqual(rule.matches, [
+						{offset: 11, length: 7, id: "$s1"}
+					])
+				})
+				.on("end", function(result) {
+					assert.deepEqual(ids, ["is_stephen", "is_either"])
+					assert.equal(result.rules.length, 0)
+					done()
+				})
+				.on("error", done)
+		})
+
+		it("stream - async iterator", function(done) {
+			var req = {
+				buffer: Buffer.from("my name is silvia")
+			}
+
+			var iterator = scanner.scanStream(req)[Symbol.asyncIterator]()
+			var ids = []
+
+			function next() {
+				iterator.next().then(function(item) {
+					if (item.done) {
+						assert.deepEqual(ids, ["is_silvia", "is_either"])
+						done()
+					} else {
+						ids.push(item.value.id)
+						next()
+					}
+				}, done)
+			}
+
+			next()
+		})
+
+		it("stream - iterator return aborts scan", function(done) {
+			// Enough rules that the scanning thread must wait for rules to be
+			// consumed, so the loop is always left before the scan completes
+			var source = ""
+			for (var i = 0; i < 4096; i++)
+				source += "rule r" + i + " {\ncondition:\ntrue\n}\n"
+
+			var aborting = yara.createScanner()
+
+			aborting.configure({rules: [{string: source}]}, function(error) {
+				assert.ifError(error)
+
+				var stream = aborting.scanStream({buffer: Buffer.from("x"), batchSize: 1})
+				var iterator = stream[Symbol.asyncIterator]()
+				var ids = []
+				var returned = -1
+
+				stream.on("rule", function(rule) {
+					ids.push(rule.id)
+				})
+
+				stream.on("end", function() {
+					assert(returned > 0)
+					assert(returned < 4096)
+					assert.equal(ids.length, returned)
+
+					aborting.destroy(function() {
+						done()
+					})
+				})
+
+				iterator.next().then(function(item) {
+					assert.equal(item.value.id, "r0")
+
+					returned = ids.length
+					return iterator.return()
+				}).then(function(item) {
+					assert(item.done)
+				}).catch(done)
+			})
+		})
+
+		it("stream - abort after end", function(done) {
+			var stream = scanner.scanStream({buffer: Buffer.from("my name is stephen")})
+
+			stream.on("end", function() {
+				assert.strictEqual(stream.abort(), stream)
+				done()
+			})
+		})
+
 		it("file - missing (and no buffer)", function(done) {
 			var req = {}
 
@@ -335,79 +709,233 @@ describe("index.js", function() {
 			})
 		})
 
-		it("flags - defaults to no FastMode", function(done) {
+		it("file - read limit (read)", function(done) {
+			var req = {
+				filename: "test/data/unit_index.js_scanner.scan/valid.txt",
+				readLimit: 4096
+			}
+
+			scanner.scan(req, function(error, result) {
+				assert.ifError(error)
+				assert.equal(result.rules.length, 2)
+				assert.deepEqual(result.rules[0].matches, [
+					{offset: 20, length: 7, id: "$s1"}
+				])
+
+				done()
+			})
+		})
+
+		it("file - read limit (mapped)", function(done) {
+			var req = {
+				filename: "test/data/unit_index.js_scanner.scan/valid.txt",
+				readLimit: 4
+			}
+
+			scanner.scan(req, function(error, result) {
+				assert.ifError(error)
+				assert.equal(result.rules.length, 2)
+				assert.deepEqual(result.rules[0].matches, [
+					{offset: 20, length: 7, id: "$s1"}
+				])
+
+				done()
+			})
+		})
+
+		it("file - read limit (negative)", function(done) {
+			var req = {
+				filename: "test/data/unit_index.js_scanner.scan/valid.txt",
+				readLimit: -1
+			}
+
+			assert.throws(function() {
+				scanner.scan(req, function(error, result) {})
+			}, /Read limit cannot be negative/)
+
+			done()
+		})
+
+		it("pid - out of range (negative)", function(done) {
+			var req = {
+				pid: -1
+			}
+
+			assert.throws(function() {
+				scanner.scan(req, function(error, result) {})
+			}, /Pid is out of bounds/)
+
+			done()
+		})
+
+		it("pid - regions", function(done) {
+			var marker = Buffer.from("my name is stephen")
+
 			scanner.configure({
 					rules: [
-						{filename: "test/data/unit_index.js_scanner.scan/flags.txt"}
+						{string: "rule is_marker {\nstrings:\n$s1 = \"my name is stephen\"\ncondition:\nany of them\n}"}
 					]
 				}, function(error) {
 					assert.ifError(error)
 
 					var req = {
-						buffer: Buffer.from("stephen stephen")
+						pid: process.pid,
+						matchedBytes: marker.length,
+						regions: {
+							permissions: "rw",
+							maxSize: 64 * 1024 * 1024
+						}
 					}
 
 					scanner.scan(req, function(error, result) {
 						assert.ifError(error)
+						assert(result.regions.length > 0)
 
-						var expected = {
-							"rules": [
-								{
-									"id": "is_stephen",
-									"tags": [],
-									"matches": [
-										{offset: 0, length: 7, id: "$s1"},
-										{offset: 8, length: 7, id: "$s1"}
-									],
-									"metas": []
-								}
-							]
-						}
+						var matched = result.regions.filter(function(region) {
+							return region.rules && region.rules.some(function(rule) {
+								return rule.id == "is_marker"
+							})
+						})
 
-						assert.deepEqual(result, expected)
+						assert(matched.length > 0)
+
+						var rule = matched[0].rules.filter(function(rule) {
+							return rule.id == "is_marker"
+						})[0]
+
+						assert(rule.matches.length > 0)
+
+						rule.matches.forEach(function(match) {
+							assert(match.offset >= matched[0].address)
+							assert(match.offset < matched[0].address + matched[0].length)
+							assert.equal(match.length, marker.length)
+							assert(match.bytes.equals(marker))
+						})
 
 						done()
 					})
 				})
 		})
 
-		it("flags - FastMode matches once", function(done) {
+		it("pid - regions with match limits", function(done) {
+			var marker = Buffer.from("my name is stephen")
+
 			scanner.configure({
 					rules: [
-						{filename: "test/data/unit_index.js_scanner.scan/flags.txt"}
+						{string: "rule is_marker {\nstrings:\n$s1 = \"my name is stephen\"\ncondition:\nany of them\n}"}
 					]
 				}, function(error) {
 					assert.ifError(error)
 
 					var req = {
-						buffer: Buffer.from("stephen stephen"),
-						flags: yara.ScanFlag.FastMode
+						pid: process.pid,
+						maxMatchesTotal: 0,
+						regions: {
+							permissions: "rw",
+							maxSize: 64 * 1024 * 1024
+						}
 					}
 
 					scanner.scan(req, function(error, result) {
 						assert.ifError(error)
 
-						var expected = {
-							"rules": [
-								{
-									"id": "is_stephen",
-									"tags": [],
-									"matches": [
-										{offset: 0, length: 7, id: "$s1"}
-									],
-									"metas": []
-								}
-							]
-						}
+						var matched = result.regions.filter(function(region) {
+							return region.rules && region.rules.some(function(rule) {
+								return rule.id == "is_marker"
+							})
+						})
 
-						assert.deepEqual(result, expected)
+						assert(matched.length > 0)
+
+						matched.forEach(function(region) {
+							assert(region.truncated > 0)
+
+							var rule = region.rules.filter(function(rule) {
+								return rule.id == "is_marker"
+							})[0]
+
+							assert.equal(rule.matches.length, 0)
+							assert.equal(rule.truncated[0].id, "$s1")
+						})
 
 						done()
 					})
 				})
 		})
 
-		it("rules - retains colon in meta value", function(done) {
+		it("flags - defaults to no FastMode", function(done) {
+			scanner.configure({
+					rules: [
+						{filename: "test/data/unit_index.js_scanner.scan/flags.txt"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					var req = {
+						buffer: Buffer.from("stephen stephen")
+					}
+
+					scanner.scan(req, function(error, result) {
+						assert.ifError(error)
+
+						var expected = {
+							"rules": [
+								{
+									"id": "is_stephen",
+									"tags": [],
+									"matches": [
+										{offset: 0, length: 7, id: "$s1"},
+										{offset: 8, length: 7, id: "$s1"}
+									],
+									"metas": []
+								}
+							]
+						}
+
+						assert.deepEqual(result, expected)
+
+						done()
+					})
+				})
+		})
+
+		it("flags - FastMode matches once", function(done) {
+			scanner.configure({
+					rules: [
+						{filename: "test/data/unit_index.js_scanner.scan/flags.txt"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					var req = {
+						buffer: Buffer.from("stephen stephen"),
+						flags: yara.ScanFlag.FastMode
+					}
+
+					scanner.scan(req, function(error, result) {
+						assert.ifError(error)
+
+						var expected = {
+							"rules": [
+								{
+									"id": "is_stephen",
+									"tags": [],
+									"matches": [
+										{offset: 0, length: 7, id: "$s1"}
+									],
+									"metas": []
+								}
+							]
+						}
+
+						assert.deepEqual(result, expected)
+
+						done()
+					})
+				})
+		})
+
+		it("rules - retains colon in meta value", function(done) {
 			scanner.configure({
 					rules: [
 						{string: "rule colon_in_meta {\nmeta:\nm1 = \"colon : in meta\"\n\nstrings:\n$s1 = \"colon_in_meta\"\ncondition:\nany of them\n}"}
@@ -443,5 +971,758 @@ describe("index.js", function() {
 					})
 				})
 		})
+
+		it("moduleData - selected fields", function(done) {
+			scanner.configure({
+					rules: [
+						{string: "import \"tests\"\nrule uses_tests {\ncondition:\ntests.constants.one == 1\n}"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					var req = {
+						buffer: Buffer.from("stephen"),
+						moduleData: ["tests.constants", "pe"]
+					}
+
+					scanner.scan(req, function(error, result) {
+						assert.ifError(error)
+
+						assert.equal(result.rules[0].id, "uses_tests")
+						assert.deepEqual(Object.keys(result.modules), ["tests"])
+						assert.equal(result.modules.tests.constants.one, 1)
+						assert.equal(result.modules.tests.constants.two, 2)
+						assert.equal(result.modules.tests.constants.foo, "foo")
+
+						done()
+					})
+				})
+		})
+
+		it("moduleData - not requested", function(done) {
+			scanner.scan({buffer: Buffer.from("stephen")}, function(error, result) {
+				assert.ifError(error)
+				assert.equal(result.modules, undefined)
+				done()
+			})
+		})
+
+		it("stats - included", function(done) {
+			scanner.configure({
+					rules: [
+						{string: "rule is_stephen {\nstrings:\n$s1 = \"stephen\"\ncondition:\nany of them\n}"},
+						{string: "rule is_never {\ncondition:\nfalse\n}"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					var req = {
+						buffer: Buffer.from("stephen stephen"),
+						stats: true
+					}
+
+					scanner.scan(req, function(error, result) {
+						assert.ifError(error)
+
+						assert.equal(result.stats.bytes, 15)
+						assert.equal(result.stats.rulesMatched, 1)
+						assert.equal(result.stats.rulesEvaluated, 2)
+						assert.equal(result.stats.matches, 2)
+						assert.equal(result.stats.timedOut, false)
+						assert.equal(result.stats.aborted, false)
+						assert(result.stats.queueWaitMs >= 0)
+						assert(result.stats.wallMs >= 0)
+						assert(result.stats.cpuMs >= 0)
+
+						done()
+					})
+				})
+		})
+
+		it("allowlist - known-good content skipped", function(done) {
+			var dir = fs.mkdtempSync(path.join(os.tmpdir(), "yara-allowlist-"))
+			var input = path.join(dir, "allowlist.txt")
+			var output = path.join(dir, "allowlist.bin")
+
+			var digest = crypto.createHash("sha256").update("my name is stephen").digest("hex")
+			fs.writeFileSync(input, "# known-good\n" + digest + "  stephen.txt\n" + digest + "\n")
+
+			yara.buildAllowlist(input, output, function(error, count) {
+				assert.ifError(error)
+				assert.equal(count, 1)
+
+				yara.loadAllowlist(output, function(error, count) {
+					assert.ifError(error)
+					assert.equal(count, 1)
+
+					var req = {
+						buffer: Buffer.from("my name is stephen"),
+						allowlist: true
+					}
+
+					scanner.scan(req, function(error, result) {
+						assert.ifError(error)
+
+						assert.equal(result.filtered, "allowlisted")
+						assert.equal(result.sha256, digest)
+						assert.equal(result.rules.length, 0)
+
+						req.buffer = Buffer.from("my name is stephen!")
+
+						scanner.scan(req, function(error, result) {
+							assert.ifError(error)
+
+							assert.equal(result.filtered, undefined)
+							assert.equal(result.rules.length, 1)
+
+							yara.unloadAllowlist()
+							fs.unlinkSync(input)
+							fs.unlinkSync(output)
+							fs.rmdirSync(dir)
+
+							done()
+						})
+					})
+				})
+			})
+		})
+
+		it("allowlist - not loaded", function() {
+			assert.throws(function() {
+				scanner.scan({buffer: Buffer.from("stephen"), allowlist: true}, function() {})
+			}, /No allowlist has been loaded/)
+		})
+
+		it("allowlist - invalid count", function(done) {
+			var dir = fs.mkdtempSync(path.join(os.tmpdir(), "yara-allowlist-"))
+			var output = path.join(dir, "allowlist.bin")
+
+			// A count of 2^59 + 1 multiplied by 32 wraps round to 32
+			var header = Buffer.alloc(16 + 32)
+			header.write("YARAALW1", 0, "latin1")
+			header.writeUInt32LE(1, 8)
+			header.writeUInt32LE(0x08000000, 12)
+			fs.writeFileSync(output, header)
+
+			yara.loadAllowlist(output, function(error) {
+				assert(error)
+				assert.equal(error.message, "Allowlist file is invalid")
+
+				fs.unlinkSync(output)
+				fs.rmdirSync(dir)
+
+				done()
+			})
+		})
+
+		it("allowlist - prefilter magic", function(done) {
+			var dir = fs.mkdtempSync(path.join(os.tmpdir(), "yara-allowlist-"))
+			var input = path.join(dir, "allowlist.txt")
+			var output = path.join(dir, "allowlist.bin")
+
+			fs.writeFileSync(input, "")
+
+			scanner.configure({
+					rules: [
+						{string: "rule is_stephen {\nstrings:\n$s1 = \"stephen\"\ncondition:\nany of them\n}"}
+					],
+					prefilter: {magic: ["MZ", Buffer.from([0x7f, 0x45, 0x4c, 0x46])]}
+				}, function(error) {
+					assert.ifError(error)
+
+					yara.buildAllowlist(input, output, function(error, count) {
+						assert.ifError(error)
+						assert.equal(count, 0)
+
+						yara.loadAllowlist(output, function(error) {
+							assert.ifError(error)
+
+							var req = {
+								buffer: Buffer.from("stephen"),
+								allowlist: true
+							}
+
+							scanner.scan(req, function(error, result) {
+								assert.ifError(error)
+
+								assert.equal(result.filtered, "magic")
+								assert.equal(result.sha256, undefined)
+
+								req.buffer = Buffer.from("MZ stephen")
+
+								scanner.scan(req, function(error, result) {
+									assert.ifError(error)
+
+									assert.equal(result.filtered, undefined)
+									assert.equal(result.rules.length, 1)
+
+									yara.unloadAllowlist()
+									fs.unlinkSync(input)
+									fs.unlinkSync(output)
+									fs.rmdirSync(dir)
+
+									done()
+								})
+							})
+						})
+					})
+				})
+		})
+
+		it("prefilter - applied without allowlist", function(done) {
+			scanner.configure({
+					rules: [
+						{string: "rule is_stephen {\nstrings:\n$s1 = \"stephen\"\ncondition:\nany of them\n}"}
+					],
+					prefilter: {minSize: 10}
+				}, function(error) {
+					assert.ifError(error)
+
+					scanner.scan({buffer: Buffer.from("stephen")}, function(error, result) {
+						assert.ifError(error)
+
+						assert.equal(result.filtered, "size")
+						assert.equal(result.sha256, undefined)
+						assert.equal(result.rules.length, 0)
+
+						scanner.scan({buffer: Buffer.from("my name is stephen")}, function(error, result) {
+							assert.ifError(error)
+
+							assert.equal(result.filtered, undefined)
+							assert.equal(result.sha256, undefined)
+							assert.equal(result.rules.length, 1)
+
+							// Leave the scanner without a prefilter for later tests
+							scanner.configure({
+									rules: [
+										{string: "rule is_stephen {\nstrings:\n$s1 = \"stephen\"\ncondition:\nany of them\n}"}
+									]
+								}, done)
+						})
+					})
+				})
+		})
+
+		it("scheduler - large scans capped", function(done) {
+			var previous = yara.schedulerStats()
+
+			yara.configureScheduler({threads: 2, largeScanBytes: 1024, largeScanShare: 0.5})
+
+			var pending = 4
+
+			function scanned(error) {
+				assert.ifError(error)
+
+				if (--pending == 0) {
+					yara.configureScheduler({
+						threads: previous.threads,
+						largeScanBytes: previous.largeScanBytes,
+						largeScanShare: previous.largeScanShare
+					})
+
+					var stats = yara.schedulerStats()
+					assert.equal(stats.largeScanBytes, previous.largeScanBytes)
+					assert.equal(stats.largeScanShare, previous.largeScanShare)
+
+					done()
+				}
+			}
+
+			for (var i = 0; i < 3; i++)
+				scanner.scan({buffer: Buffer.alloc(4096)}, scanned)
+
+			var stats = yara.schedulerStats()
+			assert.equal(stats.running, 1)
+			assert.equal(stats.largeRunning, 1)
+			assert.equal(stats.largeQueued, 2)
+
+			scanner.scan({buffer: Buffer.from("stephen")}, scanned)
+
+			stats = yara.schedulerStats()
+			assert.equal(stats.running, 2)
+			assert.equal(stats.smallQueued, 0)
+		})
+
+		it("scheduler - file size hint", function(done) {
+			var dir = fs.mkdtempSync(path.join(os.tmpdir(), "yara-scheduler-"))
+			var filename = path.join(dir, "input.txt")
+			var previous = yara.schedulerStats()
+
+			fs.writeFileSync(filename, "my name is stephen")
+
+			yara.configureScheduler({threads: 1, largeScanBytes: 1024})
+
+			var pending = 2
+
+			function scanned(error) {
+				assert.ifError(error)
+
+				if (--pending == 0) {
+					yara.configureScheduler({
+						threads: previous.threads,
+						largeScanBytes: previous.largeScanBytes
+					})
+
+					fs.unlinkSync(filename)
+					fs.rmdirSync(dir)
+
+					done()
+				}
+			}
+
+			// The file is much smaller than the hint, which alone decides
+			scanner.scan({filename: filename, sizeHint: 4096}, scanned)
+			scanner.scan({filename: filename, sizeHint: 4096}, scanned)
+
+			var stats = yara.schedulerStats()
+			assert.equal(stats.largeRunning, 1)
+			assert.equal(stats.largeQueued, 1)
+			assert.equal(stats.smallQueued, 0)
+		})
+
+		it("scheduler - file without size hint is large", function(done) {
+			var dir = fs.mkdtempSync(path.join(os.tmpdir(), "yara-scheduler-"))
+			var filename = path.join(dir, "input.bin")
+			var previous = yara.schedulerStats()
+
+			fs.writeFileSync(filename, Buffer.alloc(previous.largeScanBytes * 2))
+
+			yara.configureScheduler({threads: 2, largeScanShare: 0.5})
+
+			var pending = 3
+
+			function scanned(error) {
+				assert.ifError(error)
+
+				if (--pending == 0) {
+					yara.configureScheduler({
+						threads: previous.threads,
+						largeScanShare: previous.largeScanShare
+					})
+
+					fs.unlinkSync(filename)
+					fs.rmdirSync(dir)
+
+					done()
+				}
+			}
+
+			scanner.scan({filename: filename}, scanned)
+			scanner.scan({filename: filename}, scanned)
+
+			var stats = yara.schedulerStats()
+			assert.equal(stats.running, 1)
+			assert.equal(stats.largeRunning, 1)
+			assert.equal(stats.largeQueued, 1)
+
+			// The remaining thread is still free for small scans
+			scanner.scan({buffer: Buffer.from("stephen")}, scanned)
+
+			stats = yara.schedulerStats()
+			assert.equal(stats.running, 2)
+			assert.equal(stats.smallQueued, 0)
+		})
+
+		it("scheduler - negative size hint", function() {
+			assert.throws(function() {
+				scanner.scan({filename: "input.txt", sizeHint: -1}, function() {})
+			}, /Size hint cannot be negative/)
+		})
+
+		it("scheduler - share out of bounds", function() {
+			assert.throws(function() {
+				yara.configureScheduler({largeScanShare: 0})
+			}, /Large scan share is out of bounds/)
+		})
+
+		it("expand - gzip member scanned", function(done) {
+			scanner.configure({
+					rules: [
+						{string: "rule is_stephen {\nstrings:\n$s1 = \"stephen\"\ncondition:\nany of them\n}"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					var req = {
+						buffer: zlib.gzipSync(Buffer.from("my name is stephen")),
+						expand: {formats: ["gzip"]}
+					}
+
+					scanner.scan(req, function(error, result) {
+						assert.ifError(error)
+
+						assert.equal(result.rules.length, 0)
+						assert.equal(result.members.length, 1)
+						assert.equal(result.members[0].path, "data")
+						assert.equal(result.members[0].rules.length, 1)
+						assert.equal(result.members[0].rules[0].id, "is_stephen")
+						assert.equal(result.members[0].rules[0].matches[0].offset, 11)
+
+						done()
+					})
+				})
+		})
+
+		it("expand - module data per member", function(done) {
+			scanner.configure({
+					rules: [
+						{string: "import \"tests\"\nrule uses_tests {\ncondition:\ntests.constants.one == 1\n}"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					var req = {
+						buffer: zlib.gzipSync(Buffer.from("my name is stephen")),
+						expand: {formats: ["gzip"]},
+						moduleData: ["tests.constants"]
+					}
+
+					scanner.scan(req, function(error, result) {
+						assert.ifError(error)
+
+						assert.equal(result.modules.tests.constants.one, 1)
+						assert.equal(result.members.length, 1)
+						assert.equal(result.members[0].rules[0].id, "uses_tests")
+						assert.equal(result.members[0].modules.tests.constants.one, 1)
+
+						done()
+					})
+				})
+		})
+
+		it("expand - tar header variants", function(done) {
+			var fixtures = [
+				["ustar-prefix.tar", new Array(61).join("a") + "/" + new Array(61).join("b") + "/stephen.txt"],
+				["gnu-longname.tar", new Array(121).join("c") + ".txt"],
+				["pax-path.tar", new Array(121).join("d") + ".txt"],
+				["base256.tar", "base256.txt"]
+			]
+
+			function next() {
+				var fixture = fixtures.shift()
+				if (! fixture)
+					return done()
+
+				expandFixture(fixture[0], function(error, result) {
+					assert.ifError(error)
+
+					assert.equal(result.members.length, 1)
+					assert.equal(result.members[0].path, fixture[1])
+					assert.equal(result.members[0].rules.length, 1)
+					assert.equal(result.members[0].rules[0].id, "is_stephen")
+
+					next()
+				})
+			}
+
+			scanner.configure({
+					rules: [
+						{string: "rule is_stephen {\nstrings:\n$s1 = \"stephen\"\ncondition:\nany of them\n}"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+					next()
+				})
+		})
+
+		it("expand - zip variants", function(done) {
+			expandFixture("descriptor.zip", function(error, result) {
+				assert.ifError(error)
+
+				assert.equal(result.members.length, 2)
+				assert.equal(result.members[0].path, "streamed.txt")
+				assert.equal(result.members[0].rules[0].id, "is_stephen")
+				assert.equal(result.members[1].path, "after.txt")
+				assert.equal(result.members[1].rules.length, 0)
+
+				expandFixture("zip64.zip", function(error, result) {
+					assert.ifError(error)
+
+					assert.equal(result.members.length, 1)
+					assert.equal(result.members[0].path, "zip64.txt")
+					assert.equal(result.members[0].rules[0].id, "is_stephen")
+
+					expandFixture("stored-encrypted.zip", function(error, result) {
+						assert.ifError(error)
+
+						assert.equal(result.members.length, 2)
+						assert.equal(result.members[0].path, "stored.txt")
+						assert.equal(result.members[0].rules[0].id, "is_stephen")
+						assert.equal(result.members[1].path, "encrypted.txt")
+						assert.equal(result.members[1].rules, undefined)
+						assert.equal(result.members[1].error, "Zip member is encrypted")
+
+						done()
+					})
+				})
+			})
+		})
+
+		it("expand - nested tar.gz", function(done) {
+			expandFixture("nested.tar.gz", function(error, result) {
+				assert.ifError(error)
+
+				assert.deepEqual(result.members.map(function(member) {
+					return member.path
+				}), ["nested.tar", "nested.tar/inner.zip", "nested.tar/inner.zip/stephen.txt"])
+				assert.equal(result.members[2].rules[0].id, "is_stephen")
+				assert.equal(result.members[2].rules[0].matches[0].offset, 11)
+
+				done()
+			})
+		})
+
+		it("expand - maxTotalBytes limits decompression", function(done) {
+			var req = {
+				buffer: zlib.gzipSync(Buffer.alloc(1024 * 1024)),
+				expand: {maxTotalBytes: 1024}
+			}
+
+			scanner.scan(req, function(error, result) {
+				assert.ifError(error)
+
+				assert.equal(result.expandTruncated, "maxTotalBytes")
+				assert.equal(result.members.length, 1)
+				assert.equal(result.members[0].rules, undefined)
+				assert.equal(result.members[0].error, "Member exceeds maxTotalBytes")
+
+				done()
+			})
+		})
+
+		it("expand - maxDepth out of bounds", function() {
+			assert.throws(function() {
+				scanner.scan({buffer: Buffer.from("stephen"), expand: {maxDepth: 0}}, function() {})
+			}, /Expand maxDepth is out of bounds/)
+		})
+
+		it("scanMulti - file read once for every scanner", function(done) {
+			var dir = fs.mkdtempSync(path.join(os.tmpdir(), "yara-multi-"))
+			var filename = path.join(dir, "input.txt")
+
+			fs.writeFileSync(filename, "my name is stephen and silvia")
+
+			var other = yara.createScanner()
+
+			other.configure({
+					rules: [
+						{string: "rule is_silvia {\nstrings:\n$s1 = \"silvia\"\ncondition:\nany of them\n}"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					scanner.configure({
+							rules: [
+								{string: "rule is_stephen {\nstrings:\n$s1 = \"stephen\"\ncondition:\nany of them\n}"}
+							]
+						}, function(error) {
+							assert.ifError(error)
+
+							var scanners = {first: scanner, second: other}
+
+							yara.scanMulti(scanners, {filename: filename}, function(error, results) {
+								assert.ifError(error)
+
+								assert.equal(results.first.rules.length, 1)
+								assert.equal(results.first.rules[0].id, "is_stephen")
+								assert.equal(results.first.rules[0].matches[0].offset, 11)
+								assert.equal(results.second.rules.length, 1)
+								assert.equal(results.second.rules[0].id, "is_silvia")
+								assert.equal(results.second.rules[0].matches[0].offset, 23)
+
+								fs.unlinkSync(filename)
+								fs.rmdirSync(dir)
+
+								other.destroy(function() {
+									done()
+								})
+							})
+						})
+				})
+		})
+
+		it("output - ndjson result", function(done) {
+			scanner.configure({
+					rules: [
+						{string: "rule is_stephen {\nmeta:\nscore = 7\nstrings:\n$s1 = \"stephen\"\ncondition:\nany of them\n}"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					var req = {
+						buffer: Buffer.from("my name is stephen"),
+						matchedBytes: 4,
+						output: "ndjson"
+					}
+
+					scanner.scan(req, function(error, result) {
+						assert.ifError(error)
+
+						assert(Buffer.isBuffer(result))
+						assert.equal(result[result.length - 1], 0x0a)
+
+						var parsed = JSON.parse(result.toString())
+
+						assert.equal(parsed.rules.length, 1)
+						assert.equal(parsed.rules[0].id, "is_stephen")
+						assert.deepEqual(parsed.rules[0].metas, [{type: yara.MetaType.Integer, id: "score", value: 7}])
+						assert.equal(parsed.rules[0].matches[0].offset, 11)
+						assert.equal(parsed.rules[0].matches[0].bytes, "73746570")
+
+						done()
+					})
+				})
+		})
+
+		it("output - invalid format", function() {
+			assert.throws(function() {
+				scanner.scan({buffer: Buffer.from("stephen"), output: "xml"}, function() {})
+			}, /Output must be ndjson or msgpack/)
+		})
+
+		it("capture - slow scan captured and replayed", function(done) {
+			var dir = fs.mkdtempSync(path.join(os.tmpdir(), "yara-capture-"))
+
+			// Rules are only kept for capture when it is enabled first
+			yara.configureCapture({dir: dir, latencyMs: 0})
+
+			// Captures are written after the scan completes
+			function captured(cb) {
+				var names = fs.readdirSync(dir).filter(function(name) {
+					return /^capture-/.test(name)
+				})
+
+				if (names.length)
+					cb()
+				else
+					setTimeout(captured, 10, cb)
+			}
+
+			scanner.configure({
+					rules: [
+						{string: "rule is_stephen {\nstrings:\n$s1 = \"stephen\"\ncondition:\nany of them\n}"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					scanner.scan({buffer: Buffer.from("my name is stephen")}, function(error) {
+						assert.ifError(error)
+
+						// Disabling capture keeps the stats of the spool, and
+						// captures already reserved are still written
+						yara.configureCapture({})
+
+						var stats = yara.captureStats()
+
+						assert.equal(stats.captures, 1)
+						assert(stats.bytes > 0)
+						assert.equal(stats.dropped, 0)
+						assert.equal(stats.failed, 0)
+
+						captured(function() {
+							yara.replay(dir, scanner, function(error, results) {
+								assert.ifError(error)
+
+								assert.equal(results.length, 1)
+								assert.equal(results[0].input, "buffer")
+								assert.equal(results[0].size, 18)
+								assert.equal(results[0].rules.length, 1)
+								assert.equal(results[0].rules[0].id, "is_stephen")
+								assert(results[0].stats)
+								assert(fs.existsSync(results[0].rulesFile))
+
+								// Without a scanner the saved rules are loaded
+								yara.replay(dir, function(error, saved) {
+									assert.ifError(error)
+
+									assert.equal(saved[0].error, undefined)
+									assert.equal(saved[0].rules[0].id, "is_stephen")
+
+									scanner.configure({
+											rules: [
+												{string: "rule is_silvia {\nstrings:\n$s1 = \"silvia\"\ncondition:\nany of them\n}"}
+											]
+										}, function(error) {
+											assert.ifError(error)
+
+											yara.replay(dir, scanner, function(error, changed) {
+												assert.ifError(error)
+
+												assert.equal(changed[0].rules, undefined)
+												assert.equal(changed[0].error, "Scanner rules do not match the captured rules")
+
+												fs.readdirSync(dir).forEach(function(name) {
+													var item = path.join(dir, name)
+
+													if (fs.statSync(item).isDirectory()) {
+														fs.readdirSync(item).forEach(function(file) {
+															fs.unlinkSync(path.join(item, file))
+														})
+														fs.rmdirSync(item)
+													} else {
+														fs.unlinkSync(item)
+													}
+												})
+												fs.rmdirSync(dir)
+
+												done()
+											})
+										})
+								})
+							})
+						})
+					})
+				})
+		})
+
+		it("output - msgpack result with stats, truncated and members", function(done) {
+			scanner.configure({
+					rules: [
+						{string: "rule is_stephen {\nmeta:\nscore = 7\nstrings:\n$s1 = \"stephen\"\ncondition:\nany of them\n}"}
+					]
+				}, function(error) {
+					assert.ifError(error)
+
+					var req = {
+						buffer: zlib.gzipSync(Buffer.from("stephen, stephen and stephen")),
+						expand: {formats: ["gzip"]},
+						matchedBytes: 4,
+						maxMatchesTotal: 1,
+						stats: true,
+						output: "msgpack"
+					}
+
+					scanner.scan(req, function(error, result) {
+						assert.ifError(error)
+
+						assert(Buffer.isBuffer(result))
+
+						var decoded = decodeMsgpack(result)
+
+						assert.deepEqual(Object.keys(decoded).sort(), ["members", "rules", "stats", "truncated"])
+						assert.equal(decoded.rules.length, 0)
+						assert.equal(decoded.truncated, 2)
+
+						assert.equal(decoded.stats.rulesMatched, 1)
+						assert.equal(decoded.stats.matches, 3)
+						assert.equal(decoded.stats.timedOut, false)
+						assert.equal(decoded.stats.aborted, false)
+
+						assert.equal(decoded.members.length, 1)
+						assert.equal(decoded.members[0].path, "data")
+
+						var rule = decoded.members[0].rules[0]
+
+						assert.equal(rule.id, "is_stephen")
+						assert.deepEqual(rule.metas, [{type: yara.MetaType.Integer, id: "score", value: 7}])
+						assert.equal(rule.matches.length, 1)
+						assert.equal(rule.matches[0].offset, 0)
+						assert.equal(rule.matches[0].bytes.toString(), "step")
+						assert.deepEqual(rule.truncated, [{id: "$s1", count: 2}])
+
+						done()
+					})
+				})
+		})
 	})
 })